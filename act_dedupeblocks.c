@@ -0,0 +1,401 @@
+/* Block-level deduplication of partially identical files
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#include "jdupes.h"
+
+#if defined ENABLE_DEDUPE && defined __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+/* Use built-in static dedupe header if requested */
+#ifdef STATIC_DEDUPE_H
+ #include "linux-dedupe-static.h"
+#else
+ #include <linux/fs.h>
+#endif /* STATIC_DEDUPE_H */
+#ifndef FILE_DEDUPE_RANGE_SAME
+ #include "linux-dedupe-static.h"
+#endif /* FILE_DEDUPE_RANGE_SAME */
+
+#include "libjodycode.h"
+#include "likely_unlikely.h"
+#include "act_dedupeblocks.h"
+#include "filehash.h"
+#include "interrupt.h"
+#ifndef NO_XXHASH2
+ #include "xxhash.h"
+#endif
+
+#define KERNEL_DEDUP_MAX_SIZE 16777216
+
+/* Block size for fingerprinting, set by --dedupe-blocks */
+size_t blockdedupe_size = 0;
+
+/* One fingerprinted block; kept at 16 bytes so the index stays small */
+struct block_fp {
+  uint64_t hash;
+  uint32_t file;
+  uint32_t block;
+};
+
+/* A run of blocks in one file with the same fingerprints as a run in
+ * another; each match starts as one block and is merged with its
+ * neighbours by merge_block_matches() */
+struct block_match {
+  uint32_t src;
+  uint32_t dst;
+  uint32_t src_block;
+  uint32_t dst_block;
+  uint32_t blocks;
+};
+
+/* Totals for the final report */
+struct blockdedupe_totals {
+  uint64_t matched;
+  uint64_t deduped;
+  uint64_t runs;
+  uint64_t pairs;
+};
+
+
+static int cmp_block_fp(const void *a, const void *b)
+{
+  const struct block_fp * const restrict fa = (const struct block_fp *)a;
+  const struct block_fp * const restrict fb = (const struct block_fp *)b;
+
+  if (fa->hash != fb->hash) return (fa->hash < fb->hash) ? -1 : 1;
+  if (fa->file != fb->file) return (fa->file < fb->file) ? -1 : 1;
+  if (fa->block != fb->block) return (fa->block < fb->block) ? -1 : 1;
+  return 0;
+}
+
+
+static int cmp_block_match(const void *a, const void *b)
+{
+  const struct block_match * const restrict ma = (const struct block_match *)a;
+  const struct block_match * const restrict mb = (const struct block_match *)b;
+
+  if (ma->src != mb->src) return (ma->src < mb->src) ? -1 : 1;
+  if (ma->dst != mb->dst) return (ma->dst < mb->dst) ? -1 : 1;
+  if (ma->dst_block != mb->dst_block) return (ma->dst_block < mb->dst_block) ? -1 : 1;
+  return 0;
+}
+
+
+static inline uint64_t block_fingerprint(const char * const restrict block, const size_t len)
+{
+#ifndef NO_XXHASH2
+  return (uint64_t)XXH64(block, len, 0);
+#else
+  uint64_t hash = 0;
+  jc_block_hash((uint64_t *)block, &hash, len);
+  return hash;
+#endif
+}
+
+
+/* Blocks of zeroes are left alone; they are holes or trivially compressible */
+static inline int block_is_zero(const char * const restrict block, const size_t len)
+{
+  return (block[0] == 0 && memcmp(block, block + 1, len - 1) == 0);
+}
+
+
+/* Fingerprint the blocks of a file that belong to the current pass
+ *
+ * Only blocks whose fingerprint modulo the pass count equals the pass
+ * number are indexed, so each pass holds a fraction of all blocks.
+ * Returns 0 on success or -1 if the file could not be read. */
+static int fingerprint_file(const file_t * const restrict file, const uint32_t index,
+    const unsigned int pass, const unsigned int passes,
+    struct block_fp **fp, size_t *count, size_t *alloc,
+    char * const restrict buf, const size_t buf_size)
+{
+  const off_t bs = (off_t)blockdedupe_size;
+  off_t limit, pos = 0, region_end = 0;
+  uint64_t nblocks;
+  int fd;
+
+  LOUD(fprintf(stderr, "fingerprint_file('%s', pass %u/%u)\n", file->d_name, pass + 1, passes);)
+  fd = open(file->d_name, O_RDONLY);
+  if (fd == -1) return -1;
+  /* The trailing partial block can't be deduped on its own */
+  nblocks = (uint64_t)(file->size / bs);
+  if (nblocks > UINT32_MAX) nblocks = UINT32_MAX;
+  limit = (off_t)nblocks * bs;
+  posix_fadvise(fd, 0, limit, POSIX_FADV_SEQUENTIAL);
+
+  while (pos < limit) {
+    off_t len;
+
+    if (interrupt) break;
+    /* Skip whole blocks that lie inside holes without reading them */
+    if (pos >= region_end) {
+      if (sparse_region(fd, pos, limit, &region_end) == 1) {
+        const off_t skip = (region_end / bs) * bs;
+        if (skip > pos) {
+          pos = skip;
+          continue;
+        }
+        region_end = pos + bs;
+      }
+    }
+    len = (limit - pos > (off_t)buf_size) ? (off_t)buf_size : limit - pos;
+    if (pread(fd, buf, (size_t)len, pos) != (ssize_t)len) goto error_read;
+
+    for (off_t i = 0; i < len; i += bs) {
+      uint64_t hash;
+
+      if (block_is_zero(buf + i, (size_t)bs)) continue;
+      hash = block_fingerprint(buf + i, (size_t)bs);
+      if ((hash % passes) != pass) continue;
+      if (unlikely(*count == *alloc)) {
+        *alloc *= 2;
+        *fp = (struct block_fp *)realloc(*fp, sizeof(struct block_fp) * *alloc);
+        if (*fp == NULL) jc_oom("fingerprint_file()");
+      }
+      (*fp)[*count].hash = hash;
+      (*fp)[*count].file = index;
+      (*fp)[*count].block = (uint32_t)((pos + i) / bs);
+      (*count)++;
+    }
+    pos += len;
+  }
+  close(fd);
+  return 0;
+
+error_read:
+  close(fd);
+  return -1;
+}
+
+
+/* Sort matches and merge the ones that continue each other in both files
+ * into runs; returns the new number of matches */
+static size_t merge_block_matches(struct block_match * const restrict bm, const size_t count)
+{
+  size_t out = 0;
+
+  if (count == 0) return 0;
+  qsort(bm, count, sizeof(struct block_match), cmp_block_match);
+  for (size_t i = 1; i < count; i++) {
+    struct block_match * const last = &bm[out];
+
+    if (bm[i].src == last->src && bm[i].dst == last->dst
+        && bm[i].dst_block == last->dst_block + last->blocks
+        && bm[i].src_block == last->src_block + last->blocks) {
+      last->blocks += bm[i].blocks;
+      continue;
+    }
+    bm[++out] = bm[i];
+  }
+  return out + 1;
+}
+
+
+/* Dedupe one run of identical blocks; returns the number of bytes the
+ * kernel reported as deduplicated or -1 on error */
+static off_t dedupe_run(struct file_dedupe_range * const restrict fdr, const int src_fd, const uint64_t src_off, const uint64_t dst_off, const uint64_t len)
+{
+  struct file_dedupe_range_info * const fdri = &fdr->info[0];
+  uint64_t done = 0;
+  off_t same = 0;
+
+  while (done < len) {
+    errno = 0;
+    fdr->src_offset = src_off + done;
+    fdri->dest_offset = dst_off + done;
+    fdr->src_length = (len - done <= KERNEL_DEDUP_MAX_SIZE) ? len - done : KERNEL_DEDUP_MAX_SIZE;
+    fdri->status = FILE_DEDUPE_RANGE_SAME;
+    if (ioctl(src_fd, FIDEDUPERANGE, fdr) != 0) return -1;
+    if (fdri->status < 0) return -1;
+    if (fdri->status == FILE_DEDUPE_RANGE_SAME) same += (off_t)fdri->bytes_deduped;
+    done += fdr->src_length;
+  }
+  return same;
+}
+
+
+/* Dedupe merged runs of matched blocks and report them per file pair */
+static void dedupe_block_matches(const struct block_match * const restrict bm, const size_t bmcount,
+    file_t ** const restrict list, struct blockdedupe_totals * const restrict totals)
+{
+  struct file_dedupe_range *fdr;
+  const off_t bs = (off_t)blockdedupe_size;
+
+  fdr = (struct file_dedupe_range *)calloc(1, sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+  if (fdr == NULL) jc_oom("dedupe_block_matches() fdr");
+  fdr->dest_count = 1;
+
+  for (size_t i = 0; i < bmcount; ) {
+    const uint32_t src = bm[i].src, dst = bm[i].dst;
+    uint64_t pair_matched = 0, pair_deduped = 0, pair_runs = 0;
+    int src_fd, dst_fd, failed = 0;
+
+    if (interrupt) break;
+    if (i == 0 || bm[i - 1].src != src) printf("  [SRC] %s\n", list[src]->d_name);
+    src_fd = open(list[src]->d_name, O_RDONLY);
+    dst_fd = open(list[dst]->d_name, O_RDONLY);
+    fdr->info[0].dest_fd = dst_fd;
+
+    for (; i < bmcount && bm[i].src == src && bm[i].dst == dst; i++) {
+      const uint64_t len = (uint64_t)bm[i].blocks * (uint64_t)bs;
+      off_t same;
+
+      pair_matched += len;
+      pair_runs++;
+      if (src_fd != -1 && dst_fd != -1 && failed == 0) {
+        same = dedupe_run(fdr, src_fd, (uint64_t)bm[i].src_block * (uint64_t)bs,
+            (uint64_t)bm[i].dst_block * (uint64_t)bs, len);
+        if (same < 0) failed = (errno != 0) ? errno : -fdr->info[0].status;
+        else pair_deduped += (uint64_t)same;
+      }
+    }
+
+    if (src_fd == -1 || dst_fd == -1) {
+      printf("  -XX-> %s\n", list[dst]->d_name);
+      fprintf(stderr, "dedupe: open failed (skipping): %s\n", (src_fd == -1) ? list[src]->d_name : list[dst]->d_name);
+      exit_status = EXIT_FAILURE;
+    } else if (failed != 0) {
+      printf("  -XX-> %s (%" PRIu64 " ranges, %" PRIu64 " matched bytes)\n", list[dst]->d_name, pair_runs, pair_matched);
+      fprintf(stderr, "error: %s (%d)\n", strerror(failed), failed);
+      exit_status = EXIT_FAILURE;
+    } else {
+      printf("  ====> %s (%" PRIu64 " ranges, %" PRIu64 " of %" PRIu64 " matched bytes deduplicated)\n",
+          list[dst]->d_name, pair_runs, pair_deduped, pair_matched);
+    }
+    if (src_fd != -1) close(src_fd);
+    if (dst_fd != -1) close(dst_fd);
+    if (i == bmcount || bm[i].src != src) printf("\n");
+
+    totals->matched += pair_matched;
+    totals->deduped += pair_deduped;
+    totals->runs += pair_runs;
+    totals->pairs++;
+  }
+  free(fdr);
+  return;
+}
+
+
+void dedupeblocks(file_t * restrict files)
+{
+  struct blockdedupe_totals totals = { 0, 0, 0, 0 };
+  struct block_fp *fp = NULL;
+  struct block_match *bm = NULL;
+  file_t **list = NULL;
+  file_t *curfile;
+  char *buf = NULL;
+  size_t buf_size, fpcount, fpalloc, max_entries;
+  size_t bmcount = 0, bmalloc = 0;
+  /* The index and the matches each get half of the memory budget */
+  const size_t bm_max = (BLOCKDEDUPE_MEMORY / 2) / sizeof(struct block_match);
+  uint32_t listcount = 0;
+  uint64_t total_blocks = 0;
+  unsigned int passes;
+  const off_t bs = (off_t)blockdedupe_size;
+  const off_t min_size = (BLOCKDEDUPE_MIN_SIZE > (2 * bs)) ? BLOCKDEDUPE_MIN_SIZE : (2 * bs);
+
+  LOUD(fprintf(stderr, "\ndedupeblocks: %p, block size %" PRIuMAX "\n", files, (uintmax_t)blockdedupe_size);)
+
+  /* Collect the files large enough to be worth fingerprinting */
+  for (curfile = files; curfile; curfile = curfile->next) {
+#ifndef NO_HARDLINKS
+    if (ISFLAG(curfile->flags, FF_HARDLINK_ALIAS)) continue;
+#endif
+    if (curfile->size < min_size || !S_ISREG(curfile->mode)) continue;
+    if (listcount == UINT32_MAX) break;
+    if ((listcount & 1023) == 0) {
+      list = (file_t **)realloc(list, sizeof(file_t *) * (listcount + 1024));
+      if (list == NULL) jc_oom("dedupeblocks() list");
+    }
+    list[listcount++] = curfile;
+    total_blocks += (uint64_t)(curfile->size / bs);
+  }
+  if (listcount < 2) goto finish;
+
+  /* Split the index into passes so that each one fits the memory budget */
+  max_entries = (BLOCKDEDUPE_MEMORY / 2) / sizeof(struct block_fp);
+  passes = (unsigned int)(total_blocks / max_entries) + 1;
+  fpalloc = (size_t)(total_blocks / passes) + 1024;
+  if (fpalloc > max_entries) fpalloc = max_entries;
+  fp = (struct block_fp *)malloc(sizeof(struct block_fp) * fpalloc);
+  buf_size = (READAHEAD_SIZE > blockdedupe_size) ? (READAHEAD_SIZE / blockdedupe_size) * blockdedupe_size : blockdedupe_size;
+  buf = (char *)malloc(buf_size);
+  if (fp == NULL || buf == NULL) jc_oom("dedupeblocks() index");
+  DBG(if (ISFLAG(flags, F_DEBUG)) fprintf(stderr, "dedupeblocks: %u files, %" PRIu64 " blocks, %u passes\n", listcount, total_blocks, passes);)
+
+  for (unsigned int pass = 0; pass < passes; pass++) {
+    fpcount = 0;
+    for (uint32_t i = 0; i < listcount; i++) {
+      if (interrupt) goto finish;
+      if (fingerprint_file(list[i], i, pass, passes, &fp, &fpcount, &fpalloc, buf, buf_size) != 0) {
+        fprintf(stderr, "dedupe: read failed (skipping): "); jc_fwprint(stderr, list[i]->d_name, 1);
+        exit_status = EXIT_FAILURE;
+      }
+      if (jc_alarm_ring != 0) {
+        jc_alarm_ring = 0;
+        fprintf(stderr, "\rFingerprinting blocks: pass %u/%u, file %" PRIu32 "/%" PRIu32 "   ", pass + 1, passes, i + 1, listcount);
+      }
+    }
+
+    /* Blocks with the same fingerprint are matched to the first one seen */
+    qsort(fp, fpcount, sizeof(struct block_fp), cmp_block_fp);
+    for (size_t i = 0; i < fpcount; ) {
+      size_t j;
+
+      for (j = i + 1; j < fpcount && fp[j].hash == fp[i].hash; j++) {
+        if (fp[j].file == fp[i].file) continue;
+        if (bmcount == bmalloc) {
+          /* Merging runs usually frees most of a full budget; if it does
+           * not, the runs found so far are deduped to make room */
+          if (bmalloc == bm_max) {
+            bmcount = merge_block_matches(bm, bmcount);
+            if (bmcount > bm_max / 2) {
+              dedupe_block_matches(bm, bmcount, list, &totals);
+              bmcount = 0;
+            }
+          } else {
+            bmalloc = (bmalloc == 0) ? 4096 : bmalloc * 2;
+            if (bmalloc > bm_max) bmalloc = bm_max;
+            bm = (struct block_match *)realloc(bm, sizeof(struct block_match) * bmalloc);
+            if (bm == NULL) jc_oom("dedupeblocks() matches");
+          }
+        }
+        bm[bmcount].src = fp[i].file;
+        bm[bmcount].dst = fp[j].file;
+        bm[bmcount].src_block = fp[i].block;
+        bm[bmcount].dst_block = fp[j].block;
+        bm[bmcount].blocks = 1;
+        bmcount++;
+      }
+      i = j;
+    }
+  }
+  free(fp); fp = NULL;
+  free(buf); buf = NULL;
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
+  if (bmcount == 0) goto finish;
+
+  /* Merge matched blocks into runs and dedupe each run */
+  bmcount = merge_block_matches(bm, bmcount);
+  dedupe_block_matches(bm, bmcount, list, &totals);
+
+finish:
+  if (!ISFLAG(flags, F_HIDEPROGRESS))
+    fprintf(stderr, "Block deduplication done (%" PRIu64 " of %" PRIu64 " matched bytes in %" PRIu64 " ranges across %" PRIu64 " file pairs)\n",
+        totals.deduped, totals.matched, totals.runs, totals.pairs);
+  free(fp);
+  free(buf);
+  free(bm);
+  free(list);
+  return;
+}
+#endif /* ENABLE_DEDUPE && __linux__ */
@@ -0,0 +1,33 @@
+/* jdupes action for block-level deduplication of partially identical files
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef ACT_DEDUPEBLOCKS_H
+#define ACT_DEDUPEBLOCKS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+/* Files smaller than this are not fingerprinted */
+#ifndef BLOCKDEDUPE_MIN_SIZE
+ #define BLOCKDEDUPE_MIN_SIZE 1048576
+#endif
+/* Largest block size accepted by --dedupe-blocks */
+#define BLOCKDEDUPE_MAX_SIZE 16777216
+/* Maximum memory used per pass by the block fingerprint index and the
+ * matched runs, which get half of it each */
+#ifndef BLOCKDEDUPE_MEMORY
+ #define BLOCKDEDUPE_MEMORY 268435456
+#endif
+
+extern size_t blockdedupe_size;
+
+void dedupeblocks(file_t * restrict files);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ACT_DEDUPEBLOCKS_H */
@@ -14,6 +14,10 @@
 #include <unistd.h>
 
 #include "act_dedupefiles.h"
+#include "interrupt.h"
+#ifndef NO_JOURNAL
+ #include "journal.h"
+#endif
 #include "libjodycode.h"
 
 #ifdef __linux__
@@ -29,7 +33,11 @@
   #warning Automatically enabled STATIC_DEDUPE_H due to insufficient header support
   #include "linux-dedupe-static.h"
  #endif /* FILE_DEDUPE_RANGE_SAME */
+ #include <linux/fiemap.h>
  #include <sys/ioctl.h>
+ #ifndef NO_THREADS
+  #include <pthread.h>
+ #endif
  #define JDUPES_DEDUPE_SUPPORTED 1
  #define KERNEL_DEDUP_MAX_SIZE 16777216
  /* Error messages */
@@ -49,122 +57,455 @@
 #error Dedupe is only supported on Linux and macOS
 #endif
 
-void dedupefiles(file_t * restrict files)
-{
 #ifdef __linux__
-  struct file_dedupe_range *fdr;
-  struct file_dedupe_range_info *fdri;
-  file_t *curfile, *curfile2, *dupefile;
-  int src_fd;
-  int err_twentytwo = 0, err_ninetyfive = 0;
-  uint64_t total_files = 0;
+/* The kernel refuses dedupe requests larger than one page */
+#define DEDUPE_MAX_DESTS ((4096 - sizeof(struct file_dedupe_range)) / sizeof(struct file_dedupe_range_info))
+/* Smallest range to try when a filesystem rejects larger ones */
+#define DEDUPE_MIN_RANGE 65536
+/* Destination error code for "contents differ" */
+#define DEDUPE_ERR_DIFFERS -1
 
-  LOUD(fprintf(stderr, "\ndedupefiles: %p\n", files);)
+/* Error types whose long explanation has been seen or already printed;
+ * DEDUPE_SEEN_FAILED marks any failure and has no explanation */
+#define DEDUPE_SEEN_EINVAL 0x1
+#define DEDUPE_SEEN_EOPNOTSUPP 0x2
+#define DEDUPE_SEEN_FAILED 0x4
+static int explained = 0;
 
-  fdr = (struct file_dedupe_range *)calloc(1,
-        sizeof(struct file_dedupe_range)
-      + sizeof(struct file_dedupe_range_info) + 1);
-  fdr->dest_count = 1;
-  fdri = &fdr->info[0];
-  for (curfile = files; curfile; curfile = curfile->next) {
-    /* Skip all files that have no duplicates */
-    if (!ISFLAG(curfile->flags, FF_HAS_DUPES)) continue;
-    CLEARFLAG(curfile->flags, FF_HAS_DUPES);
+#ifndef NO_THREADS
+/* Worker threads for deduplicating independent match sets; 0 = one per CPU */
+ #ifndef DEDUPE_THREADS
+  #define DEDUPE_THREADS 0
+ #endif
+ #define DEDUPE_MAX_THREADS 16
+/* Concurrent match sets allowed on a single filesystem */
+ #ifndef DEDUPE_DEVICE_THREADS
+  #define DEDUPE_DEVICE_THREADS 4
+ #endif
+#endif /* NO_THREADS */
 
-    /* For each duplicate list head, handle the duplicates in the list */
-    curfile2 = curfile;
-    src_fd = open(curfile->d_name, O_RDONLY);
-    /* If an open fails, keep going down the dupe list until it is exhausted */
-    while (src_fd == -1 && curfile2->duplicates && curfile2->duplicates->duplicates) {
-      fprintf(stderr, "dedupe: open failed (skipping): %s\n", curfile2->d_name);
-      exit_status = EXIT_FAILURE;
-      curfile2 = curfile2->duplicates;
-      src_fd = open(curfile2->d_name, O_RDONLY);
+/* One match set to dedupe; failed is set by the worker that ran it and
+ * turned into the exit status once all workers are done. pos is the set's
+ * place in the match list, which orders sets whose offsets are equal */
+struct dedupe_job {
+  file_t *head;
+  uint64_t physical;
+  size_t pos;
+  int failed;
+};
+
+/* The jobs for one filesystem and the number of workers running them */
+struct dedupe_dev {
+  dev_t device;
+  size_t next;
+  size_t end;
+  unsigned int active;
+};
+
+static struct dedupe_job *jobs = NULL;
+static struct dedupe_dev *devs = NULL;
+static unsigned int devcount = 0;
+static uint64_t total_files = 0;
+#ifndef NO_THREADS
+static pthread_mutex_t dedupe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dedupe_cond = PTHREAD_COND_INITIALIZER;
+static int threaded = 0;
+#endif
+
+
+/* Dedupe one source against a batch of destinations
+ *
+ * Every destination in the batch shares one ioctl per source range, so
+ * the source range is read and locked once per batch instead of once per
+ * destination. Destinations that fail drop out of the batch and get their
+ * error stored in errs[]; the others continue. The range length is halved
+ * if the filesystem rejects it or makes no progress. */
+static void dedupe_batch(const int src_fd, const off_t size, const int * const restrict fds,
+    int * const restrict errs, const unsigned int count, struct file_dedupe_range * const restrict fdr)
+{
+  unsigned int map[DEDUPE_MAX_DESTS];
+  uint64_t offset = 0, length = KERNEL_DEDUP_MAX_SIZE;
+
+  for (unsigned int i = 0; i < count; i++) errs[i] = 0;
+
+  while (offset < (uint64_t)size) {
+    uint64_t done;
+    unsigned int n = 0;
+
+    if (interrupt) {
+      for (unsigned int i = 0; i < count; i++) if (errs[i] == 0) errs[i] = EINTR;
+      return;
     }
-    if (src_fd == -1) continue;
-    printf("  [SRC] %s\n", curfile2->d_name);
 
-    /* Run dedupe for each set */
-    for (dupefile = curfile->duplicates; dupefile; dupefile = dupefile->duplicates) {
-      off_t remain;
-      int err;
+    /* Build the destination list from those that haven't failed yet */
+    for (unsigned int i = 0; i < count; i++) {
+      if (errs[i] != 0) continue;
+      memset(&fdr->info[n], 0, sizeof(struct file_dedupe_range_info));
+      fdr->info[n].dest_fd = fds[i];
+      fdr->info[n].dest_offset = offset;
+      map[n] = i;
+      n++;
+    }
+    if (n == 0) return;
+    fdr->dest_count = (uint16_t)n;
+    fdr->src_offset = offset;
+    fdr->src_length = ((uint64_t)size - offset <= length) ? (uint64_t)size - offset : length;
 
-      /* Don't pass hard links to dedupe */
-      if (dupefile->device == curfile->device && dupefile->inode == curfile->inode) {
-        printf("  -==-> %s\n", dupefile->d_name);
+    errno = 0;
+    if (ioctl(src_fd, FIDEDUPERANGE, fdr) != 0) {
+      if (errno == EINVAL && length > DEDUPE_MIN_RANGE) {
+        length >>= 1;
         continue;
       }
+      for (unsigned int i = 0; i < n; i++) errs[map[i]] = errno;
+      return;
+    }
 
-      /* Open destination file, skipping any that fail */
-      fdri->dest_fd = open(dupefile->d_name, O_RDONLY);
-      if (fdri->dest_fd == -1) {
-        fprintf(stderr, "dedupe: open failed (skipping): %s\n", dupefile->d_name);
-        exit_status = EXIT_FAILURE;
+    /* Advance by the smallest amount any destination accepted */
+    done = fdr->src_length;
+    for (unsigned int i = 0; i < n; i++) {
+      if (fdr->info[i].status < 0) errs[map[i]] = -fdr->info[i].status;
+      else if (fdr->info[i].status == FILE_DEDUPE_RANGE_DIFFERS) errs[map[i]] = DEDUPE_ERR_DIFFERS;
+      else if (fdr->info[i].bytes_deduped < done) done = fdr->info[i].bytes_deduped;
+    }
+    if (done == 0) {
+      if (length > DEDUPE_MIN_RANGE) {
+        length >>= 1;
         continue;
       }
+      for (unsigned int i = 0; i < n; i++) if (errs[map[i]] == 0) errs[map[i]] = EIO;
+      return;
+    }
+    offset += done;
+  }
+  return;
+}
 
-      /* Dedupe src <--> dest, 16 MiB or less at a time */
-      remain = dupefile->size;
-      fdri->status = FILE_DEDUPE_RANGE_SAME;
-      /* Consume data blocks until no data remains */
-      while (remain) {
-        errno = 0;
-        fdr->src_offset = (uint64_t)(dupefile->size - remain);
-        fdri->dest_offset = fdr->src_offset;
-        fdr->src_length = (uint64_t)(remain <= KERNEL_DEDUP_MAX_SIZE ? remain : KERNEL_DEDUP_MAX_SIZE);
-        ioctl(src_fd, FIDEDUPERANGE, fdr);
-        if (fdri->status < 0) break;
-        remain -= (off_t)fdr->src_length;
-      }
 
-      /* Handle any errors */
-      err = fdri->status;
-      if (err != FILE_DEDUPE_RANGE_SAME || errno != 0) {
-        printf("  -XX-> %s\n", dupefile->d_name);
-        fprintf(stderr, "error: ");
-        if (err == FILE_DEDUPE_RANGE_DIFFERS) {
-          fprintf(stderr, "not identical (files modified between scan and dedupe?)\n");
-          exit_status = EXIT_FAILURE;
-        } else if (err != 0) {
-          fprintf(stderr, "%s (%d)\n", strerror(-err), err);
-          exit_status = EXIT_FAILURE;
-        } else if (errno != 0) {
-          fprintf(stderr, "%s (%d)\n", strerror(errno), errno);
-          exit_status = EXIT_FAILURE;
+/* Report the result of deduplicating one destination file */
+static void dedupe_report(const file_t * const restrict dupefile, const int err, FILE * const out, FILE * const errout, int * const restrict seen)
+{
+  if (err == 0) {
+    fprintf(out, "  ====> %s\n", dupefile->d_name);
+    return;
+  }
+
+  fprintf(out, "  -XX-> %s\n", dupefile->d_name);
+  fprintf(errout, "error: ");
+  if (err == DEDUPE_ERR_DIFFERS) fprintf(errout, "not identical (files modified between scan and dedupe?)\n");
+  else fprintf(errout, "%s (%d)\n", strerror(err), err);
+  *seen |= DEDUPE_SEEN_FAILED;
+  if (err == 22) *seen |= DEDUPE_SEEN_EINVAL;
+  if (err == 95) *seen |= DEDUPE_SEEN_EOPNOTSUPP;
+  return;
+}
+
+
+/* Print the long description of each error type once per run */
+static void dedupe_explain(const int seen)
+{
+  if (ISFLAG(seen, DEDUPE_SEEN_EINVAL) && !ISFLAG(explained, DEDUPE_SEEN_EINVAL)) {
+    fprintf(stderr, "       One or more files being deduped are read-only or hard linked.\n");
+    fprintf(stderr, "       Read-only files can only be deduped by the root user.\n");
+    fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
+    fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
+  }
+  if (ISFLAG(seen, DEDUPE_SEEN_EOPNOTSUPP) && !ISFLAG(explained, DEDUPE_SEEN_EOPNOTSUPP)) {
+    fprintf(stderr, "       One or more files is on a filesystem that does not support\n");
+    fprintf(stderr, "       block-level deduplication or are on different filesystems.\n");
+    fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
+    fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
+  }
+  explained |= seen;
+  return;
+}
+
+
+/* Run a full batch of destinations, report them, and close them */
+static uint64_t dedupe_flush(const int src_fd, const file_t * const restrict src, file_t ** const restrict dests,
+    int * const restrict fds, int * const restrict errs, const unsigned int count,
+    struct file_dedupe_range * const restrict fdr, FILE * const out, FILE * const errout, int * const restrict seen)
+{
+  uint64_t deduped = 0;
+
+  if (count == 0) return 0;
+  dedupe_batch(src_fd, src->size, fds, errs, count, fdr);
+  for (unsigned int i = 0; i < count; i++) {
+    dedupe_report(dests[i], errs[i], out, errout, seen);
+    if (errs[i] == 0) {
+      deduped++;
+#ifndef NO_JOURNAL
+ #ifndef NO_THREADS
+      if (threaded) pthread_mutex_lock(&dedupe_lock);
+ #endif
+      journal_add(JOURNAL_DEDUPE, src->d_name, dests[i]->d_name);
+ #ifndef NO_THREADS
+      if (threaded) pthread_mutex_unlock(&dedupe_lock);
+ #endif
+#endif /* NO_JOURNAL */
+    }
+    close(fds[i]);
+  }
+  return deduped;
+}
+
+
+/* Dedupe every file in one match set against the first one that opens
+ * Output goes to out and errout so concurrent sets don't interleave.
+ * Returns the number of files processed. */
+static uint64_t dedupe_set(file_t * const restrict curfile, struct file_dedupe_range * const restrict fdr,
+    FILE * const out, FILE * const errout, int * const restrict seen)
+{
+  file_t *dests[DEDUPE_MAX_DESTS];
+  int fds[DEDUPE_MAX_DESTS], errs[DEDUPE_MAX_DESTS];
+  file_t *curfile2, *dupefile;
+  unsigned int count = 0;
+  uint64_t processed = 0;
+  int src_fd;
+
+  /* For each duplicate list head, handle the duplicates in the list */
+  curfile2 = curfile;
+  src_fd = open(curfile->d_name, O_RDONLY);
+  /* If an open fails, keep going down the dupe list until it is exhausted */
+  while (src_fd == -1 && curfile2->duplicates && curfile2->duplicates->duplicates) {
+    fprintf(errout, "dedupe: open failed (skipping): %s\n", curfile2->d_name);
+    *seen |= DEDUPE_SEEN_FAILED;
+    curfile2 = curfile2->duplicates;
+    src_fd = open(curfile2->d_name, O_RDONLY);
+  }
+  if (src_fd == -1) return 0;
+  fprintf(out, "  [SRC] %s\n", curfile2->d_name);
+
+  /* Collect destinations into batches that share each source range */
+  for (dupefile = curfile->duplicates; dupefile; dupefile = dupefile->duplicates) {
+    /* Don't pass hard links to dedupe */
+    if (dupefile->device == curfile->device && dupefile->inode == curfile->inode) {
+      fprintf(out, "  -==-> %s\n", dupefile->d_name);
+      continue;
+    }
+
+    /* Open destination file, skipping any that fail */
+    fds[count] = open(dupefile->d_name, O_RDONLY);
+    if (fds[count] == -1) {
+      fprintf(errout, "dedupe: open failed (skipping): %s\n", dupefile->d_name);
+      *seen |= DEDUPE_SEEN_FAILED;
+      continue;
+    }
+    dests[count] = dupefile;
+    count++;
+    if (count == DEDUPE_MAX_DESTS) {
+      processed += dedupe_flush(src_fd, curfile2, dests, fds, errs, count, fdr, out, errout, seen);
+      count = 0;
+    }
+  }
+  processed += dedupe_flush(src_fd, curfile2, dests, fds, errs, count, fdr, out, errout, seen);
+
+  fprintf(out, "\n");
+  close(src_fd);
+  return processed + 1;
+}
+
+
+/* Get the physical location of the start of a file for ordering work */
+static uint64_t physical_offset(const char * const restrict path)
+{
+  struct {
+    struct fiemap fm;
+    struct fiemap_extent fe;
+  } map;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1) return 0;
+  memset(&map, 0, sizeof(map));
+  map.fm.fm_length = FIEMAP_MAX_OFFSET;
+  map.fm.fm_extent_count = 1;
+  if (ioctl(fd, FS_IOC_FIEMAP, &map.fm) != 0 || map.fm.fm_mapped_extents == 0) map.fe.fe_physical = 0;
+  close(fd);
+  return map.fe.fe_physical;
+}
+
+
+static int cmp_dedupe_job(const void *a, const void *b)
+{
+  const struct dedupe_job * const restrict ja = (const struct dedupe_job *)a;
+  const struct dedupe_job * const restrict jb = (const struct dedupe_job *)b;
+
+  if (ja->head->device != jb->head->device) return (ja->head->device < jb->head->device) ? -1 : 1;
+  if (ja->physical != jb->physical) return (ja->physical < jb->physical) ? -1 : 1;
+  /* qsort() is not stable and offsets are all 0 where FIEMAP fails */
+  return (ja->pos < jb->pos) ? -1 : (ja->pos > jb->pos);
+}
+
+
+#ifndef NO_THREADS
+/* Take match sets from the queues of filesystems that have room for
+ * another worker, buffering each set's output and printing it whole */
+static void *dedupe_worker(void *arg)
+{
+  struct file_dedupe_range *fdr;
+  unsigned int rr = (unsigned int)(uintptr_t)arg;
+
+  fdr = (struct file_dedupe_range *)calloc(1,
+        sizeof(struct file_dedupe_range)
+      + sizeof(struct file_dedupe_range_info) * DEDUPE_MAX_DESTS);
+  if (fdr == NULL) jc_oom("dedupe_worker()");
+
+  while (1) {
+    struct dedupe_dev *dev = NULL;
+    struct dedupe_job *job;
+    FILE *out, *errout;
+    char *outbuf = NULL, *errbuf = NULL;
+    size_t outlen = 0, errlen = 0;
+    uint64_t processed;
+    int seen = 0;
+
+    pthread_mutex_lock(&dedupe_lock);
+    while (dev == NULL) {
+      int remaining = 0;
+
+      for (unsigned int i = 0; i < devcount; i++) {
+        struct dedupe_dev * const d = &devs[(rr + i) % devcount];
+        if (d->next == d->end || interrupt) continue;
+        remaining = 1;
+        if (d->active < DEDUPE_DEVICE_THREADS) {
+          dev = d;
+          break;
         }
-        if ((err == -22 || errno == 22) && err_twentytwo == 0) {
-          fprintf(stderr, "       One or more files being deduped are read-only or hard linked.\n");
-          fprintf(stderr, "       Read-only files can only be deduped by the root user.\n");
-          fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
-          fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
-          err_twentytwo = 1;
-	}
-        if ((err == -95 || errno == 95) && err_ninetyfive == 0) {
-          fprintf(stderr, "       One or more files is on a filesystem that does not support\n");
-          fprintf(stderr, "       block-level deduplication or are on different filesystems.\n");
-          fprintf(stderr, "       %s\n", s_err_dedupe_notabug);
-          fprintf(stderr, "       %s\n", s_err_dedupe_repeated);
-          err_ninetyfive = 1;
-	}
-      } else {
-        /* Dedupe OK; report to the user and add to file count */
-        printf("  ====> %s\n", dupefile->d_name);
-        total_files++;
       }
-      close((int)fdri->dest_fd);
+      if (dev != NULL) break;
+      if (remaining == 0) {
+        pthread_mutex_unlock(&dedupe_lock);
+        free(fdr);
+        return NULL;
+      }
+      pthread_cond_wait(&dedupe_cond, &dedupe_lock);
     }
-    printf("\n");
-    close(src_fd);
-    total_files++;
+    job = &jobs[dev->next++];
+    dev->active++;
+    rr++;
+    pthread_mutex_unlock(&dedupe_lock);
+
+    out = open_memstream(&outbuf, &outlen);
+    errout = open_memstream(&errbuf, &errlen);
+    if (out == NULL || errout == NULL) jc_oom("dedupe_worker() output");
+    processed = dedupe_set(job->head, fdr, out, errout, &seen);
+    if (seen & DEDUPE_SEEN_FAILED) job->failed = 1;
+    fclose(out);
+    fclose(errout);
+
+    pthread_mutex_lock(&dedupe_lock);
+    fwrite(errbuf, 1, errlen, stderr);
+    dedupe_explain(seen);
+    fwrite(outbuf, 1, outlen, stdout);
+    total_files += processed;
+    dev->active--;
+    pthread_cond_broadcast(&dedupe_cond);
+    pthread_mutex_unlock(&dedupe_lock);
+    free(outbuf);
+    free(errbuf);
   }
+}
+#endif /* NO_THREADS */
+#endif /* __linux__ */
+
+
+void dedupefiles(file_t * restrict files)
+{
+#ifdef __linux__
+  file_t *curfile;
+  size_t jobcount = 0, joballoc = 0;
+#ifndef NO_THREADS
+  unsigned int threads = 1;
+#endif
 
-  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Deduplication done (%" PRIuMAX " files processed)\n", total_files);
-  free(fdr);
+  LOUD(fprintf(stderr, "\ndedupefiles: %p\n", files);)
+
+  /* Gather the match sets and group them by filesystem in disk order */
+  for (curfile = files; curfile; curfile = curfile->next) {
+    /* Skip all files that have no duplicates */
+    if (!ISFLAG(curfile->flags, FF_HAS_DUPES)) continue;
+    CLEARFLAG(curfile->flags, FF_HAS_DUPES);
+    if (jobcount == joballoc) {
+      joballoc = (joballoc == 0) ? 1024 : joballoc * 2;
+      jobs = (struct dedupe_job *)realloc(jobs, sizeof(struct dedupe_job) * joballoc);
+      if (jobs == NULL) jc_oom("dedupefiles() jobs");
+    }
+    jobs[jobcount].head = curfile;
+    jobs[jobcount].physical = physical_offset(curfile->d_name);
+    jobs[jobcount].pos = jobcount;
+    jobs[jobcount].failed = 0;
+    jobcount++;
+  }
+  qsort(jobs, jobcount, sizeof(struct dedupe_job), cmp_dedupe_job);
+  for (size_t i = 0; i < jobcount; i++) {
+    if (i > 0 && jobs[i].head->device == jobs[i - 1].head->device) {
+      devs[devcount - 1].end = i + 1;
+      continue;
+    }
+    devs = (struct dedupe_dev *)realloc(devs, sizeof(struct dedupe_dev) * (devcount + 1));
+    if (devs == NULL) jc_oom("dedupefiles() devs");
+    devs[devcount].device = jobs[i].head->device;
+    devs[devcount].next = i;
+    devs[devcount].end = i + 1;
+    devs[devcount].active = 0;
+    devcount++;
+  }
+
+#ifndef NO_THREADS
+  threads = DEDUPE_THREADS;
+  if (threads == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = (cpus > 0) ? (unsigned int)cpus : 1;
+  }
+  if (threads > DEDUPE_MAX_THREADS) threads = DEDUPE_MAX_THREADS;
+  if (threads > jobcount) threads = (unsigned int)jobcount;
+  if (threads > devcount * DEDUPE_DEVICE_THREADS) threads = devcount * DEDUPE_DEVICE_THREADS;
+  if (threads > 1) {
+    pthread_t tid[DEDUPE_MAX_THREADS];
+    unsigned int started;
+
+    threaded = 1;
+    LOUD(fprintf(stderr, "dedupefiles: %u worker threads for %" PRIuMAX " sets on %u filesystems\n", threads, (uintmax_t)jobcount, devcount);)
+    for (started = 0; started < threads; started++)
+      if (pthread_create(&tid[started], NULL, dedupe_worker, (void *)(uintptr_t)started) != 0) break;
+    /* If no thread could be started, this thread does all of the work */
+    if (started == 0) dedupe_worker(NULL);
+    for (unsigned int i = 0; i < started; i++) pthread_join(tid[i], NULL);
+    for (size_t i = 0; i < jobcount; i++) if (jobs[i].failed) exit_status = EXIT_FAILURE;
+    goto dedupe_done;
+  }
+#endif /* NO_THREADS */
+
+  /* Single-threaded: run each set in order with direct output */
+  {
+    struct file_dedupe_range *fdr;
+
+    fdr = (struct file_dedupe_range *)calloc(1,
+          sizeof(struct file_dedupe_range)
+        + sizeof(struct file_dedupe_range_info) * DEDUPE_MAX_DESTS);
+    if (fdr == NULL) jc_oom("dedupefiles()");
+    for (size_t i = 0; i < jobcount; i++) {
+      int seen = 0;
+
+      total_files += dedupe_set(jobs[i].head, fdr, stdout, stderr, &seen);
+      if (seen & DEDUPE_SEEN_FAILED) exit_status = EXIT_FAILURE;
+      dedupe_explain(seen);
+    }
+    free(fdr);
+  }
+
+#ifndef NO_THREADS
+dedupe_done:
+#endif
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Deduplication done (%" PRIuMAX " files processed)\n", (uintmax_t)total_files);
+  free(jobs);
+  free(devs);
 #endif /* __linux__ */
 
 /* On macOS, clonefile() is basically a "hard link" function, so linkfiles will do the work. */
 #ifdef __APPLE__
-  linkfiles(files, 2, 0);
+  linkfiles(files, LINK_CLONEFILE, 0);
 #endif /* __APPLE__ */
   return;
 }
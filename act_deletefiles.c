@@ -14,6 +14,7 @@
 #include "likely_unlikely.h"
 #include "act_deletefiles.h"
 #include "act_linkfiles.h"
+#include "actionpool.h"
 #ifndef NO_HASHDB
  #include "hashdb.h"
 #endif
@@ -62,6 +63,13 @@ void deletefiles(file_t *files, int prompt, FILE *tty)
   size_t i;
 
   LOUD(fprintf(stderr, "deletefiles: %p, %d, %p\n", files, prompt, tty));
+#ifdef ENABLE_ACTIONPOOL
+  /* Deleting without prompting is done by the worker pool */
+  if (!prompt) {
+    actionpool_run(files, ACTION_DELETE);
+    return;
+  }
+#endif
 
   groups = get_max_dupes(files, &max);
 
@@ -177,10 +185,10 @@ void deletefiles(file_t *files, int prompt, FILE *tty)
           if (*token == 'n' || *token == 'N') goto stop_scanning;
           /* If requested, link this set instead */
 #ifndef NO_HARDLINKS
-          if (*token == 'l' || *token == 'L') linktype = 1; /* hard link */
+          if (*token == 'l' || *token == 'L') linktype = LINK_HARDLINK;
 #endif
 #ifndef NO_SYMLINKS
-          if (*token == 's' || *token == 'S') linktype = 0; /* symlink */
+          if (*token == 's' || *token == 'S') linktype = LINK_SYMLINK;
 #endif
 #if defined NO_HARDLINKS && defined NO_SYMLINKS
           /* no linking calls */
@@ -1,6 +1,11 @@
 /* Hard link or symlink files
  * This file is part of jdupes; see jdupes.c for license information */
 
+/* O_PATH is a GNU extension on glibc */
+#ifndef _GNU_SOURCE
+ #define _GNU_SOURCE
+#endif
+
 #include "jdupes.h"
 
 /* Compile out the code if no linking support is built in */
@@ -13,9 +18,15 @@
 
 #include <libjodycode.h>
 #include "act_linkfiles.h"
+#include "actionpool.h"
+#include "filestat.h"
+#include "match.h"
 #ifndef NO_HASHDB
  #include "hashdb.h"
 #endif
+#ifndef NO_JOURNAL
+ #include "journal.h"
+#endif
 
 /* Apple clonefile() is basically a hard link */
 #ifdef ENABLE_DEDUPE
@@ -30,8 +41,102 @@
    #define ENABLE_CLONEFILE_LINK 1
   #endif /* NO_CLONEFILE */
  #endif /* __APPLE__ */
+ /* Linux reflink replacement uses FICLONE into a temporary file */
+ #if defined __linux__ && !defined NO_HARDLINKS
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/ioctl.h>
+  #include <sys/stat.h>
+  #include <sys/xattr.h>
+  #include <linux/fs.h>
+  #ifndef FICLONE
+   #define FICLONE _IOW(0x94, 9, int)
+  #endif
+  #define ENABLE_REFLINK 1
+ #endif /* __linux__ */
 #endif /* ENABLE_DEDUPE */
 
+/* Linux hard links are made from the source file held open by the check */
+#if defined __linux__ && !defined NO_HARDLINKS
+ #include <fcntl.h>
+ #include <unistd.h>
+ #include <sys/stat.h>
+#endif
+
+/* Linux hard links and symlinks are made under a temporary name and
+ * atomically renamed over the target, relative to an open directory */
+#if defined __linux__ && !defined NO_ATOMIC_LINK
+ #include <fcntl.h>
+ #include <unistd.h>
+ #define ENABLE_ATOMIC_LINK 1
+#endif
+
+
+#ifdef ENABLE_ATOMIC_LINK
+/* Directory of the current link target, held open for the *at() calls */
+static int link_dirfd = -1;
+static char link_dir[PATHBUF_SIZE];
+/* The current link source, held open so it is only looked up once */
+static int link_srcfd = -1;
+static const file_t *link_srcfile = NULL;
+
+
+/* Open (or keep using) the directory containing a path; returns the
+ * offset of the file name within the path or -1 on error */
+static int open_link_dir(const char * const restrict path)
+{
+  const char *slash = strrchr(path, '/');
+  char dir[PATHBUF_SIZE];
+  size_t dirlen;
+
+  if (slash == NULL) strcpy(dir, ".");
+  else {
+    dirlen = (slash == path) ? 1 : (size_t)(slash - path);
+    memcpy(dir, path, dirlen);
+    dir[dirlen] = '\0';
+  }
+  if (link_dirfd == -1 || strcmp(dir, link_dir) != 0) {
+    if (link_dirfd != -1) close(link_dirfd);
+    link_dirfd = open(dir, O_PATH | O_DIRECTORY);
+    if (link_dirfd == -1) return -1;
+    strcpy(link_dir, dir);
+  }
+  return (slash == NULL) ? 0 : (int)(slash - path + 1);
+}
+
+
+/* Check the link source for changes; the first check for a new source
+ * is a full file_has_changed(), later ones are fstat() on a held fd */
+static int src_has_changed(file_t * const restrict srcfile)
+{
+  int i;
+
+  if (ISFLAG(flags, F_NOCHANGECHECK)) return 0;
+  if (srcfile != link_srcfile) {
+    if (link_srcfd != -1) close(link_srcfd);
+    link_srcfd = -1;
+    link_srcfile = NULL;
+    i = file_has_changed(srcfile);
+    if (i != 0) return i;
+    link_srcfd = open(srcfile->d_name, O_PATH);
+    if (link_srcfd == -1) return -2;
+    link_srcfile = srcfile;
+  }
+  return file_has_changed_at(srcfile, link_srcfd, NULL);
+}
+
+
+static void close_link_fds(void)
+{
+  if (link_dirfd != -1) close(link_dirfd);
+  if (link_srcfd != -1) close(link_srcfd);
+  link_dirfd = -1;
+  link_srcfd = -1;
+  link_srcfile = NULL;
+  return;
+}
+#endif /* ENABLE_ATOMIC_LINK */
+
 
 #ifdef ENABLE_CLONEFILE_LINK
 static void clonefile_error(const char * const restrict func, const char * const restrict name)
@@ -64,7 +169,219 @@ static void revert_failed(const char * const restrict orig, const char * const r
 }
 
 
-/* linktype: 0=symlink, 1=hardlink, 2=clonefile() */
+#ifndef NO_HARDLINKS
+struct link_member {
+  file_t *file;
+  unsigned int pos;
+};
+
+
+static int cmp_link_member(const void *a, const void *b)
+{
+  const struct link_member * const restrict ma = (const struct link_member *)a;
+  const struct link_member * const restrict mb = (const struct link_member *)b;
+
+  if (ma->file->device != mb->file->device) return (ma->file->device < mb->file->device) ? -1 : 1;
+  if (ma->file->inode != mb->file->inode) return (ma->file->inode < mb->file->inode) ? -1 : 1;
+  return (ma->pos < mb->pos) ? -1 : (ma->pos > mb->pos);
+}
+
+
+/* Choose the hard link source for a match set: a file of the inode that
+ * already has the most links in the set, so the fewest files need to be
+ * relinked. Ties go to the inode with more links overall, then to the
+ * earlier file. With -O only files from the first file's parameter can
+ * be chosen. */
+file_t *elect_link_source(file_t * const restrict head)
+{
+  struct link_member *list;
+  file_t *cur, *best = NULL;
+  unsigned int count = 0, bestcount = 0, bestpos = 0, i, end;
+  int clustered = 0;
+
+  for (cur = head; cur != NULL; cur = cur->duplicates) {
+    count++;
+    if (cur->nlink > 1) clustered = 1;
+  }
+  /* Without existing hard links every choice costs the same */
+  if (clustered == 0) return head;
+
+  list = (struct link_member *)malloc(sizeof(struct link_member) * count);
+  if (list == NULL) jc_oom("elect_link_source()");
+  for (cur = head, i = 0; cur != NULL; cur = cur->duplicates, i++) {
+    list[i].file = cur;
+    list[i].pos = i;
+  }
+  qsort(list, count, sizeof(struct link_member), cmp_link_member);
+
+  for (i = 0; i < count; i = end) {
+    unsigned int pick = i;
+
+    for (end = i + 1; end < count && list[end].file->device == list[i].file->device
+        && list[end].file->inode == list[i].file->inode; end++);
+#ifndef NO_USER_ORDER
+    if (ISFLAG(flags, F_USEPARAMORDER)) {
+      while (pick < end && list[pick].file->user_order != head->user_order) pick++;
+      if (pick == end) continue;
+    }
+#endif
+    if (best == NULL || end - i > bestcount || (end - i == bestcount
+        && (list[pick].file->nlink > best->nlink
+        || (list[pick].file->nlink == best->nlink && list[pick].pos < bestpos)))) {
+      best = list[pick].file;
+      bestcount = end - i;
+      bestpos = list[pick].pos;
+    }
+  }
+  free(list);
+  LOUD(fprintf(stderr, "elect_link_source: %u files, chose '%s' with %u links in set\n", count, best->d_name, bestcount);)
+  return best;
+}
+
+
+ #ifdef __linux__
+/* Hard link the source held open as srcfd (-1 if none) to name in dirfd,
+ * so the file that passed the change check is linked even if its path
+ * has been replaced since. The fd is linked through /proc since
+ * AT_EMPTY_PATH needs privileges; without /proc the path is compared to
+ * the fd just before linking it. A symlink is linked by path as before. */
+int link_from_fd(const file_t * const restrict src, const int srcfd, const int dirfd, const char * const restrict name)
+{
+  char procname[32];
+  struct stat fs, ps;
+
+  if (srcfd == -1 || ISFLAG(src->flags, FF_IS_SYMLINK)) return linkat(AT_FDCWD, src->d_name, dirfd, name, 0);
+  snprintf(procname, sizeof(procname), "/proc/self/fd/%d", srcfd);
+  if (linkat(AT_FDCWD, procname, dirfd, name, AT_SYMLINK_FOLLOW) == 0) return 0;
+  if (errno != ENOENT || access("/proc/self/fd", F_OK) == 0) return -1;
+  if (fstat(srcfd, &fs) != 0 || lstat(src->d_name, &ps) != 0) return -1;
+  if (fs.st_dev != ps.st_dev || fs.st_ino != ps.st_ino) {
+    errno = ESTALE;
+    return -1;
+  }
+  return linkat(AT_FDCWD, src->d_name, dirfd, name, 0);
+}
+ #endif /* __linux__ */
+#endif /* NO_HARDLINKS */
+
+
+#ifdef ENABLE_REFLINK
+/* Copy every extended attribute (including ACLs) between open files */
+static int copy_xattrs(const int from, const int to)
+{
+  char *names = NULL, *value = NULL;
+  ssize_t len, vlen;
+  size_t valloc = 0;
+
+  len = flistxattr(from, NULL, 0);
+  if (len == 0 || (len < 0 && errno == ENOTSUP)) return 0;
+  if (len < 0) return -1;
+  names = (char *)malloc((size_t)len);
+  if (names == NULL) jc_oom("copy_xattrs()");
+  len = flistxattr(from, names, (size_t)len);
+  if (len < 0) goto error_xattr;
+
+  for (char *name = names; name < names + len; name += strlen(name) + 1) {
+    vlen = fgetxattr(from, name, NULL, 0);
+    if (vlen < 0) goto error_xattr;
+    if ((size_t)vlen > valloc) {
+      valloc = (size_t)vlen;
+      value = (char *)realloc(value, valloc);
+      if (value == NULL) jc_oom("copy_xattrs() value");
+    }
+    vlen = fgetxattr(from, name, value, valloc);
+    if (vlen < 0) goto error_xattr;
+    if (fsetxattr(to, name, value, (size_t)vlen, 0) != 0) goto error_xattr;
+  }
+  free(names);
+  free(value);
+  return 0;
+
+error_xattr:
+  free(names);
+  free(value);
+  return -1;
+}
+
+
+/* Replace dst with a reflink clone of src that keeps dst's metadata
+ *
+ * The clone is built under the temporary name next to dst and then
+ * renamed over it, so dst is never missing and is only replaced once
+ * every step has succeeded. The clone is metadata-only; no file data is
+ * read or compared. A dst with other hard links is skipped since the new
+ * inode would split it from them. Returns 0 on success or -1 with a
+ * warning printed. */
+static int reflink_replace(const char * const restrict src, const char * const restrict dst)
+{
+  struct stat ds, ts;
+  struct timespec times[2];
+  int srcfd = -1, dstfd = -1, tmpfd = -1;
+  int created = 0;
+  const char *step;
+
+  step = "open source";
+  srcfd = open(src, O_RDONLY);
+  if (srcfd == -1) goto error_reflink;
+  step = "open destination";
+  dstfd = open(dst, O_RDONLY);
+  if (dstfd == -1 || fstat(dstfd, &ds) != 0) goto error_reflink;
+  if (ds.st_nlink > 1) goto error_reflink_nlink;
+  step = "create temporary file";
+  tmpfd = open(tempname, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (tmpfd == -1) goto error_reflink;
+  created = 1;
+
+  step = "clone";
+  if (ioctl(tmpfd, FICLONE, srcfd) != 0) goto error_reflink;
+  /* Ownership can only be given away by root; that is fine if it already matches */
+  step = "set owner";
+  if (fchown(tmpfd, ds.st_uid, ds.st_gid) != 0) {
+    if (fstat(tmpfd, &ts) != 0 || ts.st_uid != ds.st_uid || ts.st_gid != ds.st_gid) goto error_reflink;
+  }
+  step = "set mode";
+  if (fchmod(tmpfd, ds.st_mode & 07777) != 0) goto error_reflink;
+  step = "copy extended attributes";
+  if (copy_xattrs(dstfd, tmpfd) != 0) goto error_reflink;
+  step = "set timestamps";
+  times[0] = ds.st_atim;
+  times[1] = ds.st_mtim;
+  if (futimens(tmpfd, times) != 0) goto error_reflink;
+
+  close(srcfd); srcfd = -1;
+  close(dstfd); dstfd = -1;
+  step = "close temporary file";
+  if (close(tmpfd) != 0) {
+    tmpfd = -1;
+    goto error_reflink;
+  }
+  tmpfd = -1;
+  step = "rename over destination";
+  if (jc_rename(tempname, dst) != 0) goto error_reflink;
+  return 0;
+
+error_reflink:
+  fprintf(stderr, "warning: reflink failed to %s (%s), not replacing:\n-//-> ", step, strerror(errno));
+  jc_fwprint(stderr, dst, 1);
+  exit_status = EXIT_FAILURE;
+  if (srcfd != -1) close(srcfd);
+  if (dstfd != -1) close(dstfd);
+  if (tmpfd != -1) close(tmpfd);
+  /* Only remove the temporary file if O_EXCL proved it was ours */
+  if (created) jc_remove(tempname);
+  return -1;
+error_reflink_nlink:
+  fprintf(stderr, "warning: reflink target has other hard links, not replacing:\n-//-> ");
+  jc_fwprint(stderr, dst, 1);
+  exit_status = EXIT_FAILURE;
+  close(srcfd);
+  close(dstfd);
+  return -1;
+}
+#endif /* ENABLE_REFLINK */
+
+
+/* linktype is one of the LINK_* types in act_linkfiles.h */
 void linkfiles(file_t *files, const int linktype, const int only_current)
 {
   static file_t *tmpfile;
@@ -76,6 +393,9 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
   static unsigned int x = 0;
   static size_t name_len = 0;
   static int i, success;
+#ifdef ENABLE_ATOMIC_LINK
+  static int base = 0;
+#endif
 #ifndef NO_SYMLINKS
   static unsigned int symsrc;
   static char rel_path[PATHBUF_SIZE];
@@ -91,6 +411,13 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
 #endif
 
   LOUD(fprintf(stderr, "linkfiles(%d): %p\n", linktype, files);)
+#if defined ENABLE_ACTIONPOOL && defined ENABLE_ATOMIC_LINK
+  /* Non-interactive hard and soft linking is done by the worker pool */
+  if (only_current == 0 && linktype < LINK_CLONEFILE) {
+    actionpool_run(files, linktype);
+    return;
+  }
+#endif
   curfile = files;
 
   /* Calculate a maximum */
@@ -127,12 +454,15 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
        tmpfile = tmpfile->duplicates;
       }
 
-      /* Link every file to the first file */
+      /* Link every file to the elected source, moved to the front */
 
-      if (linktype != 0) {
+      if (linktype != LINK_SYMLINK) {
 #ifndef NO_HARDLINKS
+        srcfile = elect_link_source(files);
+        for (x = 1; dupelist[x] != srcfile; x++);
+        memmove(&dupelist[2], &dupelist[1], sizeof(file_t *) * (x - 1));
+        dupelist[1] = srcfile;
         x = 2;
-        srcfile = dupelist[1];
 #else
         linkfiles_nosupport("hard", "hard link");
 #endif
@@ -156,7 +486,7 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
       if (!ISFLAG(flags, F_HIDEPROGRESS)) {
         printf("[SRC] "); jc_fwprint(stdout, srcfile->d_name, 1);
       }
-      if (linktype == 2) {
+      if (linktype == LINK_CLONEFILE) {
 #ifdef ENABLE_CLONEFILE_LINK
         if (jc_stat(srcfile->d_name, &s) != 0) {
           fprintf(stderr, "warning: stat() on source file failed, skipping:\n[SRC] ");
@@ -174,10 +504,11 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
 #endif
       }
       for (; x <= counter; x++) {
-        if (linktype == 1 || linktype == 2) {
-          /* Can't hard link files on different devices */
+        if (linktype != LINK_SYMLINK) {
+          /* Can't hard link or clone files on different devices */
           if (srcfile->device != dupelist[x]->device) {
-            fprintf(stderr, "warning: hard link target on different device, not linking:\n-//-> ");
+            if (linktype == LINK_REFLINK) fprintf(stderr, "warning: reflink target on different device, not cloning:\n-//-> ");
+            else fprintf(stderr, "warning: hard link target on different device, not linking:\n-//-> ");
             jc_fwprint(stderr, dupelist[x]->d_name, 1);
             exit_status = EXIT_FAILURE;
             continue;
@@ -203,12 +534,25 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
 #endif
         }
 
+#ifdef ENABLE_ATOMIC_LINK
+        if (linktype < LINK_CLONEFILE) {
+          base = open_link_dir(dupelist[x]->d_name);
+          if (base < 0) {
+            fprintf(stderr, "warning: cannot open link target directory, not linking:\n-//-> ");
+            jc_fwprint(stderr, dupelist[x]->d_name, 1);
+            exit_status = EXIT_FAILURE;
+            continue;
+          }
+          i = faccessat(link_dirfd, dupelist[x]->d_name + base, W_OK, 0);
+        } else
+#endif
+        i = jc_access(dupelist[x]->d_name, JC_W_OK);
         /* Do not attempt to hard link files for which we don't have write access */
 	if (
 #ifdef ON_WINDOWS
         !JC_S_ISRO(dupelist[x]->mode) &&
 #endif
-        (jc_access(dupelist[x]->d_name, JC_W_OK) != 0))
+        (i != 0))
         {
           fprintf(stderr, "warning: link target is a read-only file, not linking:\n-//-> ");
           jc_fwprint(stderr, dupelist[x]->d_name, 1);
@@ -217,6 +561,10 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
         }
         /* Check file pairs for modification before linking */
         /* Safe linking: don't actually delete until the link succeeds */
+#ifdef ENABLE_ATOMIC_LINK
+        if (linktype < LINK_CLONEFILE) i = src_has_changed(srcfile);
+        else
+#endif
         i = file_has_changed(srcfile);
         if (i) {
           fprintf(stderr, "warning: source file modified since scanned; changing source file:\n[SRC] ");
@@ -226,7 +574,12 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
           exit_status = EXIT_FAILURE;
           continue;
         }
-        if (file_has_changed(dupelist[x])) {
+#ifdef ENABLE_ATOMIC_LINK
+        if (linktype < LINK_CLONEFILE) i = file_has_changed_at(dupelist[x], link_dirfd, dupelist[x]->d_name + base);
+        else
+#endif
+        i = file_has_changed(dupelist[x]);
+        if (i) {
           fprintf(stderr, "warning: target file modified since scanned, not linking:\n-//-> ");
           jc_fwprint(stderr, dupelist[x]->d_name, 1);
           exit_status = EXIT_FAILURE;
@@ -257,7 +610,7 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
         }
 #endif
 #ifdef ENABLE_CLONEFILE_LINK
-        if (linktype == 2) {
+        if (linktype == LINK_CLONEFILE) {
           if (jc_stat(dupelist[x]->d_name, &s) != 0) {
             fprintf(stderr, "warning: stat() on destination file failed, skipping:\n-##-> ");
             jc_fwprint(stderr, dupelist[x]->d_name, 1);
@@ -283,6 +636,44 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
         /* Assemble a temporary file name */
         strcpy(tempname, dupelist[x]->d_name);
         strcat(tempname, ".__jdupes__.tmp");
+
+#ifdef ENABLE_REFLINK
+        if (linktype == LINK_REFLINK) {
+          /* Nothing will compare the data, so quick/partial matches must be confirmed */
+          if ((ISFLAG(flags, F_QUICKCOMPARE) || ISFLAG(flags, F_PARTIALONLY))
+              && confirmmatch(srcfile->d_name, dupelist[x]->d_name, srcfile->size) != 0) {
+            fprintf(stderr, "warning: files are not identical, not cloning:\n-//-> ");
+            jc_fwprint(stderr, dupelist[x]->d_name, 1);
+            exit_status = EXIT_FAILURE;
+            continue;
+          }
+          if (reflink_replace(srcfile->d_name, dupelist[x]->d_name) != 0) {
+            if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+              printf("-//-> "); jc_fwprint(stdout, dupelist[x]->d_name, 1);
+            }
+            continue;
+          }
+          if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+            printf("-##-> "); jc_fwprint(stdout, dupelist[x]->d_name, 1);
+          }
+ #ifndef NO_JOURNAL
+          journal_add(JOURNAL_CLONE, srcfile->d_name, dupelist[x]->d_name);
+ #endif
+ #ifndef NO_HASHDB
+          /* The clone is a new inode; drop the stale hashdb entry */
+          if (ISFLAG(flags, F_HASHDB)) {
+            dupelist[x]->mtime = 0;
+            add_hashdb_entry(NULL, 0, dupelist[x]);
+          }
+ #endif
+          continue;
+        }
+#endif /* ENABLE_REFLINK */
+#ifdef ENABLE_ATOMIC_LINK
+        /* The link is made under the temporary name and renamed over the
+         * target later, so the target never has to be moved out of the way */
+        if (linktype >= LINK_CLONEFILE) {
+#endif
         /* Rename the destination file to the temporary name */
         i = jc_rename(dupelist[x]->d_name, tempname);
         if (i != 0) {
@@ -293,14 +684,21 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
           jc_rename(tempname, dupelist[x]->d_name);
           continue;
         }
+#ifdef ENABLE_ATOMIC_LINK
+        }
+#endif
 
         /* Create the desired hard link with the original file's name */
         errno = 0;
         success = 0;
-        if (linktype == 1) {
+        if (linktype == LINK_HARDLINK) {
+#if defined ENABLE_ATOMIC_LINK && !defined NO_HARDLINKS
+          if (link_from_fd(srcfile, link_srcfd, link_dirfd, tempname + base) == 0) success = 1;
+#else
           if (jc_link(srcfile->d_name, dupelist[x]->d_name) == 0) success = 1;
+#endif
 #ifdef ENABLE_CLONEFILE_LINK
-        } else if (linktype == 2) {
+        } else if (linktype == LINK_CLONEFILE) {
           if (clonefile(srcfile->d_name, dupelist[x]->d_name, 0) == 0) {
             if (copyfile(tempname, dupelist[x]->d_name, NULL, COPYFILE_METADATA) == 0) {
               /* If the preserved flags match what we just copied from the original dupfile, we're done.
@@ -325,21 +723,38 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
             fprintf(stderr, "warning: make_relative_link_name() failed (%d)\n", i);
           } else if (i == 1) {
             fprintf(stderr, "warning: files to be linked have the same canonical path; not linking\n");
+#ifdef ENABLE_ATOMIC_LINK
+          } else if (symlinkat(rel_path, link_dirfd, tempname + base) == 0) success = 1;
+#else
           } else if (symlink(rel_path, dupelist[x]->d_name) == 0) success = 1;
+#endif
         }
 #endif /* NO_SYMLINKS */
+#ifdef ENABLE_ATOMIC_LINK
+        /* Atomically replace the target; if that fails, drop the new link */
+        if (success && linktype < LINK_CLONEFILE
+            && renameat(link_dirfd, tempname + base, link_dirfd, dupelist[x]->d_name + base) != 0) {
+          success = 0;
+          i = errno;
+          if (unlinkat(link_dirfd, tempname + base, 0) != 0) {
+            fprintf(stderr, "warning: couldn't remove temporary link: ");
+            jc_fwprint(stderr, tempname, 1);
+          }
+          errno = i;
+        }
+#endif
         if (success) {
           if (!ISFLAG(flags, F_HIDEPROGRESS)) {
             switch (linktype) {
-              case 0: /* symlink */
+              case LINK_SYMLINK:
                 printf("-@@-> ");
                 break;
               default:
-              case 1: /* hardlink */
+              case LINK_HARDLINK:
                 printf("----> ");
                 break;
 #ifdef ENABLE_CLONEFILE_LINK
-              case 2: /* clonefile */
+              case LINK_CLONEFILE:
                 printf("-##-> ");
                 break;
 #endif
@@ -348,7 +763,7 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
           }
 #ifndef NO_HASHDB
           /* Delete the hashdb entry for new hard/symbolic links */
-          if (linktype != 2 && ISFLAG(flags, F_HASHDB)) {
+          if (linktype != LINK_CLONEFILE && ISFLAG(flags, F_HASHDB)) {
             dupelist[x]->mtime = 0;
             add_hashdb_entry(NULL, 0, dupelist[x]);
           }
@@ -362,11 +777,20 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
           fprintf(stderr, "warning: unable to link '"); jc_fwprint(stderr, dupelist[x]->d_name, 0);
           fprintf(stderr, "' -> '"); jc_fwprint(stderr, srcfile->d_name, 0);
           fprintf(stderr, "': %s\n", strerror(errno));
+#ifdef ENABLE_ATOMIC_LINK
+          /* The target was never moved for an atomic link */
+          if (linktype < LINK_CLONEFILE) continue;
+#endif
           i = jc_rename(tempname, dupelist[x]->d_name);
           if (i != 0) revert_failed(dupelist[x]->d_name, tempname);
           continue;
         }
 
+#ifdef ENABLE_ATOMIC_LINK
+        /* Nothing is left under the temporary name after an atomic link */
+        if (linktype < LINK_CLONEFILE) i = 0;
+        else
+#endif
         /* Remove temporary file to clean up; if we can't, reverse the linking */
         i = jc_remove(tempname);
         if (i != 0) {
@@ -383,6 +807,10 @@ void linkfiles(file_t *files, const int linktype, const int only_current)
             if (i != 0) revert_failed(dupelist[x]->d_name, tempname);
           }
         }
+#ifndef NO_JOURNAL
+        else journal_add((linktype == LINK_SYMLINK) ? JOURNAL_SYMLINK : ((linktype == LINK_HARDLINK) ? JOURNAL_HARDLINK : JOURNAL_CLONE),
+            srcfile->d_name, dupelist[x]->d_name);
+#endif
       }
       if (!ISFLAG(flags, F_HIDEPROGRESS)) printf("\n");
     }
@@ -395,6 +823,9 @@ linkfile_loop:
 
   if (counter == 0) printf("%s", s_no_dupes);
 
+#ifdef ENABLE_ATOMIC_LINK
+  close_link_fds();
+#endif
   free(dupelist);
   return;
 }
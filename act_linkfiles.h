@@ -1,8 +1,6 @@
 /* jdupes action for hard and soft file linking
  * This file is part of jdupes; see jdupes.c for license information */
 
-#if !(defined NO_HARDLINKS && defined NO_SYMLINKS)
-
 #ifndef ACT_LINKFILES_H
 #define ACT_LINKFILES_H
 
@@ -11,12 +9,26 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+
+/* Link types for linkfiles(); symbolic and hard links come before the
+ * clone types and match ACTION_SYMLINK and ACTION_HARDLINK in actionpool.h */
+#define LINK_SYMLINK   0
+#define LINK_HARDLINK  1
+#define LINK_CLONEFILE 2  /* clonefile() on macOS */
+#define LINK_REFLINK   3  /* FICLONE on Linux */
+
+#if !(defined NO_HARDLINKS && defined NO_SYMLINKS)
 void linkfiles(file_t *files, const int linktype, const int only_current);
+#ifndef NO_HARDLINKS
+file_t *elect_link_source(file_t * const restrict head);
+ #ifdef __linux__
+int link_from_fd(const file_t * const restrict src, const int srcfd, const int dirfd, const char * const restrict name);
+ #endif
+#endif
+#endif /* NO_*LINKS */
 
 #ifdef __cplusplus
 }
 #endif
 
 #endif /* ACT_LINKFILES_H */
-
-#endif /* NO_*LINKS */
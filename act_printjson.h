@@ -11,6 +11,7 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+void printjson_set(const file_t * restrict head);
 void printjson(file_t * restrict files, const int argc, char ** const restrict argv);
 
 #ifdef __cplusplus
@@ -3,14 +3,41 @@
 
 #include <stdio.h>
 #include <stdint.h>
-#include <inttypes.h>
 #include "jdupes.h"
 #include <libjodycode.h>
+#include "output.h"
 #include "act_printmatches.h"
 
+
+static void print_size(const off_t size)
+{
+  output_intmax((intmax_t)size);
+  output_str((size != 1) ? " bytes each:\n" : " byte  each:\n");
+  return;
+}
+
+
+/* Print the files of one match set; the caller separates the sets and
+ * wraps the printing in output_begin() and output_flush() */
+void printmatchset(const file_t * restrict head, const int cr)
+{
+  const file_t * restrict tmpfile;
+
+  if (!ISFLAG(a_flags, FA_OMITFIRST)) {
+    if (ISFLAG(a_flags, FA_SHOWSIZE)) print_size(head->size);
+    output_path(head->d_name, cr);
+  }
+  tmpfile = head->duplicates;
+  while (tmpfile != NULL) {
+    output_path(tmpfile->d_name, cr);
+    tmpfile = tmpfile->duplicates;
+  }
+  return;
+}
+
+
 void printmatches(file_t * restrict files)
 {
-  file_t * restrict tmpfile;
   int printed = 0;
   int cr = 1;
 
@@ -18,27 +45,20 @@ void printmatches(file_t * restrict files)
 
   if (ISFLAG(a_flags, FA_PRINTNULL)) cr = 2;
 
+  output_begin();
   while (files != NULL) {
     if (ISFLAG(files->flags, FF_HAS_DUPES)) {
       printed = 1;
-      if (!ISFLAG(a_flags, FA_OMITFIRST)) {
-        if (ISFLAG(a_flags, FA_SHOWSIZE)) printf("%" PRIdMAX " byte%c each:\n", (intmax_t)files->size,
-            (files->size != 1) ? 's' : ' ');
-        jc_fwprint(stdout, files->d_name, cr);
-      }
-      tmpfile = files->duplicates;
-      while (tmpfile != NULL) {
-        jc_fwprint(stdout, tmpfile->d_name, cr);
-        tmpfile = tmpfile->duplicates;
-      }
-      if (files->next != NULL) jc_fwprint(stdout, "", cr);
+      printmatchset(files, cr);
+      if (files->next != NULL) output_path("", cr);
 
     }
 
     files = files->next;
   }
 
-  if (printed == 0) printf("%s", s_no_dupes);
+  if (printed == 0) output_str(s_no_dupes);
+  output_flush();
 
   return;
 }
@@ -67,15 +87,16 @@ void printunique(file_t *files)
     scan = scan->next;
   }
 
+  output_begin();
   while (files != NULL) {
     if (!ISFLAG(files->flags, FF_NOT_UNIQUE)) {
       printed = 1;
-      if (ISFLAG(a_flags, FA_SHOWSIZE)) printf("%" PRIdMAX " byte%c each:\n", (intmax_t)files->size,
-          (files->size != 1) ? 's' : ' ');
-      jc_fwprint(stdout, files->d_name, cr);
+      if (ISFLAG(a_flags, FA_SHOWSIZE)) print_size(files->size);
+      output_path(files->d_name, cr);
     }
     files = files->next;
   }
+  output_flush();
 
   if (printed == 0) jc_fwprint(stderr, "No unique files found.", 1);
 
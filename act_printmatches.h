@@ -9,6 +9,7 @@ extern "C" {
 #endif
 
 #include "jdupes.h"
+void printmatchset(const file_t * restrict head, const int cr);
 void printmatches(file_t * restrict files);
 void printunique(file_t *files);
 
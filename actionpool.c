@@ -0,0 +1,812 @@
+/* Concurrent executor for non-interactive link and delete actions
+ * This file is part of jdupes; see jdupes.c for license information
+ *
+ * Every operation is planned on the main thread first, in the same order
+ * and with the same checks as the serial code. The operations are then
+ * grouped by the directory they modify and the groups are handed out to
+ * a pool of worker threads. All operations on one directory are done by
+ * one worker in their original order, so threads never contend for the
+ * same directory. Results are printed per match set in the usual order
+ * and format once all workers are done; the hash database and journal
+ * are only updated from the main thread. */
+
+/* O_PATH is a GNU extension on glibc */
+#ifndef _GNU_SOURCE
+ #define _GNU_SOURCE
+#endif
+
+#include "jdupes.h"
+#include "actionpool.h"
+
+#ifdef ENABLE_ACTIONPOOL
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libjodycode.h>
+#include "act_linkfiles.h"
+#include "filestat.h"
+#include "interrupt.h"
+#include "uring.h"
+#ifndef NO_HASHDB
+ #include "hashdb.h"
+#endif
+#ifndef NO_JOURNAL
+ #include "journal.h"
+#endif
+
+/* Operation status */
+#define OP_PENDING 0      /* waiting for a worker */
+#define OP_DONE 1
+#define OP_FAILED 2       /* err is the errno value */
+#define OP_FAILED_TEMP 3  /* failed and the temporary link could not be removed */
+#define OP_RELPATH 4      /* err is the jc_make_relative_link_name() result */
+#define OP_READONLY 5
+#define OP_SRC_CHANGED 6
+#define OP_DST_CHANGED 7
+#define OP_NODIR 8
+#define OP_OTHERDEV 9
+#define OP_SAMEINODE 10
+#define OP_NEWSRC 11      /* the source had changed; this file became the source */
+#define OP_KEEP 12        /* the preserved file of a delete set */
+#define OP_SKIP 13        /* skipped without a message */
+
+#define TEMP_SUFFIX ".__jdupes__.tmp"
+
+/* One file to link or delete */
+struct action_op {
+  file_t *src;
+  file_t *dst;
+  uint32_t base;    /* offset of the file name in dst->d_name */
+  int err;
+  uint8_t status;
+  uint8_t setstart;
+};
+
+static struct action_op *ops = NULL;
+static size_t opcount = 0, opalloc = 0;
+/* Pending operations sorted by directory, and where each directory starts */
+static size_t *order = NULL;
+static size_t *groups = NULL;
+static size_t groupcount = 0, next_group = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static struct action_op *new_op(file_t * const restrict src, file_t * const restrict dst, const int setstart)
+{
+  struct action_op *op;
+  const char *slash;
+
+  if (opcount == opalloc) {
+    opalloc = (opalloc == 0) ? 4096 : opalloc * 2;
+    ops = (struct action_op *)realloc(ops, sizeof(struct action_op) * opalloc);
+    if (ops == NULL) jc_oom("actionpool new_op()");
+  }
+  op = &ops[opcount++];
+  op->src = src;
+  op->dst = dst;
+  slash = strrchr(dst->d_name, '/');
+  op->base = (slash == NULL) ? 0 : (uint32_t)(slash - dst->d_name + 1);
+  op->err = 0;
+  op->status = OP_PENDING;
+  op->setstart = (uint8_t)setstart;
+  return op;
+}
+
+
+/* Plan link operations exactly as linkfiles() would do them */
+static void plan_links(file_t *files, const int action)
+{
+  for (; files != NULL; files = files->next) {
+    file_t *src, *cur;
+    int setstart = 1, srcchecked = 0, i;
+
+    if (!ISFLAG(files->flags, FF_HAS_DUPES)) continue;
+    if (action == ACTION_HARDLINK) {
+#ifndef NO_HARDLINKS
+      src = elect_link_source(files);
+#else
+      src = files;
+#endif
+    } else {
+      /* Symlinks should target a normal file if one exists */
+      for (src = files; src != NULL; src = src->duplicates)
+        if (!ISFLAG(src->flags, FF_IS_SYMLINK)) break;
+      if (src == NULL) continue;
+    }
+
+    /* Every other file in set order is linked to the source */
+    for (cur = files; cur != NULL; cur = cur->duplicates) {
+      struct action_op *op;
+
+      /* Do not attempt to link a file to itself */
+      if (cur == src) continue;
+      op = new_op(src, cur, setstart);
+      setstart = 0;
+      if (action == ACTION_HARDLINK) {
+        /* Can't hard link files on different devices */
+        if (src->device != cur->device) {
+          op->status = OP_OTHERDEV;
+          continue;
+        }
+        /* Skip anything that is already hard linked (-L and -H both set) */
+        if (src->inode == cur->inode) {
+          op->status = OP_SAMEINODE;
+          continue;
+        }
+      }
+      if (strlen(cur->d_name) + sizeof(TEMP_SUFFIX) > PATHBUF_SIZE) {
+        op->status = OP_SKIP;
+        continue;
+      }
+      /* A source that changed before linking started is replaced by the next
+       * file; workers check the source again but can't replace it anymore */
+      if (srcchecked == 0) {
+        i = file_has_changed(src);
+        if (i) {
+          LOUD(fprintf(stderr, "file_has_changed: %d\n", i);)
+          op->status = OP_NEWSRC;
+          src = cur;
+          continue;
+        }
+        srcchecked = 1;
+      }
+    }
+  }
+  return;
+}
+
+
+/* Plan deletions exactly as non-interactive deletefiles() would do them */
+static void plan_deletes(file_t *files)
+{
+  for (; files != NULL; files = files->next) {
+    if (!ISFLAG(files->flags, FF_HAS_DUPES)) continue;
+    /* Preserve only the first file */
+    new_op(NULL, files, 1)->status = OP_KEEP;
+    for (file_t *cur = files->duplicates; cur != NULL; cur = cur->duplicates) new_op(NULL, cur, 0);
+  }
+  return;
+}
+
+
+static int cmp_op_dir(const void *a, const void *b)
+{
+  const struct action_op * const restrict oa = &ops[*(const size_t *)a];
+  const struct action_op * const restrict ob = &ops[*(const size_t *)b];
+  int cmp;
+
+  if (oa->base != ob->base) return (oa->base < ob->base) ? -1 : 1;
+  cmp = memcmp(oa->dst->d_name, ob->dst->d_name, oa->base);
+  if (cmp != 0) return cmp;
+  /* Keep the original order within each directory */
+  return (*(const size_t *)a < *(const size_t *)b) ? -1 : 1;
+}
+
+
+/* Check that an operation can still go ahead; returns 0 if it can. A
+ * hard link source is checked through an fd left in srcfd (or -1) for
+ * link_from_fd(), so the file that was checked is the one linked. */
+static int check_op(struct action_op * const restrict op, const int dirfd, const int action, int * const restrict srcfd)
+{
+  const char * const name = op->dst->d_name + op->base;
+
+  *srcfd = -1;
+  if (action != ACTION_DELETE) {
+    /* Do not attempt to link files for which we don't have write access */
+    if (faccessat(dirfd, name, W_OK, 0) != 0) {
+      op->status = OP_READONLY;
+      return -1;
+    }
+    if (action == ACTION_HARDLINK && !ISFLAG(flags, F_NOCHANGECHECK) && !ISFLAG(op->src->flags, FF_IS_SYMLINK)) {
+      *srcfd = open(op->src->d_name, O_PATH);
+      if (*srcfd == -1 || file_has_changed_at(op->src, *srcfd, NULL)) {
+        op->status = OP_SRC_CHANGED;
+        goto error_check;
+      }
+    } else if (file_has_changed(op->src)) {
+      op->status = OP_SRC_CHANGED;
+      return -1;
+    }
+  }
+  if (file_has_changed_at(op->dst, dirfd, name)) {
+    op->status = OP_DST_CHANGED;
+    goto error_check;
+  }
+  return 0;
+
+error_check:
+  if (*srcfd != -1) close(*srcfd);
+  *srcfd = -1;
+  return -1;
+}
+
+
+#ifndef NO_SYMLINKS
+/* Work out the relative contents of a new symlink; returns 0 on success */
+static int symlink_target(struct action_op * const restrict op, char * const restrict rel_path)
+{
+  int i;
+
+  /* libjodycode makes no promise that this is thread-safe */
+  pthread_mutex_lock(&pool_lock);
+  i = jc_make_relative_link_name(op->src->d_name, op->dst->d_name, rel_path);
+  pthread_mutex_unlock(&pool_lock);
+  LOUD(fprintf(stderr, "symlink MRLN: %s to %s = %s\n", op->src->d_name, op->dst->d_name, rel_path));
+  if (i != 0) {
+    op->err = i;
+    op->status = OP_RELPATH;
+    return -1;
+  }
+  return 0;
+}
+#endif
+
+
+/* Link or delete one file relative to its open directory */
+static void run_op(struct action_op * const restrict op, const int dirfd, const int action)
+{
+  const char * const name = op->dst->d_name + op->base;
+  char tmpname[PATHBUF_SIZE];
+#ifndef NO_SYMLINKS
+  char rel_path[PATHBUF_SIZE];
+#endif
+  int i = -1, srcfd;
+
+  if (check_op(op, dirfd, action, &srcfd) != 0) return;
+  if (action == ACTION_DELETE) {
+    if (unlinkat(dirfd, name, 0) == 0) op->status = OP_DONE;
+    else {
+      op->err = errno;
+      op->status = OP_FAILED;
+    }
+    return;
+  }
+
+  /* Make the link under a temporary name and rename it over the target */
+  strcpy(tmpname, name);
+  strcat(tmpname, TEMP_SUFFIX);
+  errno = 0;
+#ifndef NO_HARDLINKS
+  if (action == ACTION_HARDLINK) {
+    i = link_from_fd(op->src, srcfd, dirfd, tmpname);
+    if (srcfd != -1) {
+      const int err = errno;
+
+      close(srcfd);
+      errno = err;
+    }
+  }
+#endif
+#ifndef NO_SYMLINKS
+  if (action == ACTION_SYMLINK) {
+    if (symlink_target(op, rel_path) != 0) return;
+    i = symlinkat(rel_path, dirfd, tmpname);
+  }
+#endif
+  if (i != 0) {
+    op->err = errno;
+    op->status = OP_FAILED;
+    return;
+  }
+  if (renameat(dirfd, tmpname, dirfd, name) != 0) {
+    op->err = errno;
+    op->status = (unlinkat(dirfd, tmpname, 0) == 0) ? OP_FAILED : OP_FAILED_TEMP;
+    return;
+  }
+  op->status = OP_DONE;
+  return;
+}
+
+
+/* Open the directory of a group; if that fails, every operation in it fails */
+static int open_group_dir(const size_t group)
+{
+  const size_t start = groups[group], end = groups[group + 1];
+  const struct action_op * const first = &ops[order[start]];
+  char dir[PATHBUF_SIZE];
+  int dirfd;
+
+  if (first->base == 0) strcpy(dir, ".");
+  else if (first->base == 1) strcpy(dir, "/");
+  else {
+    memcpy(dir, first->dst->d_name, first->base - 1);
+    dir[first->base - 1] = '\0';
+  }
+  dirfd = open(dir, O_PATH | O_DIRECTORY);
+  if (dirfd == -1) {
+    for (size_t i = start; i < end; i++) {
+      ops[order[i]].err = errno;
+      ops[order[i]].status = OP_NODIR;
+    }
+  }
+  return dirfd;
+}
+
+
+/* Run every operation on one directory in order */
+static void run_group(const size_t group, const int action)
+{
+  const int dirfd = open_group_dir(group);
+
+  if (dirfd == -1) return;
+  for (size_t i = groups[group]; i < groups[group + 1]; i++) run_op(&ops[order[i]], dirfd, action);
+  close(dirfd);
+  return;
+}
+
+
+#ifdef ENABLE_IO_URING
+/* Directories held open for queued operations until they are reaped */
+#define URING_MAX_DIRS 64
+
+/* An operation whose link and rename (or unlink) is in the ring; renaming
+ * tells which of its two stages the next completion belongs to */
+struct uring_slot {
+  struct action_op *op;
+  char *tmpname;
+  char *target;
+  int dirfd;
+  int srcfd;
+  int renaming;
+};
+
+/* Batched submission state of one worker */
+struct uring_batch {
+  struct uring ring;
+  struct uring_slot *slots;
+  unsigned int slotcount;
+  unsigned int cqe_pending;
+  int dirfds[URING_MAX_DIRS];
+  unsigned int dircount;
+};
+
+
+static int uring_batch_init(struct uring_batch * const restrict b)
+{
+  if (uring_init(&b->ring, URING_ENTRIES) != 0) return -1;
+  b->slots = (struct uring_slot *)malloc(sizeof(struct uring_slot) * b->ring.sq_entries);
+  if (b->slots == NULL) jc_oom("uring_batch_init()");
+  b->slotcount = 0;
+  b->cqe_pending = 0;
+  b->dircount = 0;
+  return 0;
+}
+
+
+/* First stage: an unlink is finished; a new link gets its rename queued */
+static void uring_first_done(struct uring_batch * const restrict b, struct uring_slot * const restrict s, const int res)
+{
+  struct io_uring_sqe *sqe;
+
+  if (res < 0) {
+    s->op->err = -res;
+    s->op->status = OP_FAILED;
+    return;
+  }
+  if (s->tmpname == NULL) {
+    s->op->status = OP_DONE;
+    return;
+  }
+  /* There is one entry per slot, so the ring can't be full here */
+  sqe = uring_get_sqe(&b->ring);
+  sqe->opcode = IORING_OP_RENAMEAT;
+  sqe->fd = s->dirfd;
+  sqe->addr = (uintptr_t)s->tmpname;
+  sqe->len = (uint32_t)s->dirfd;
+  sqe->addr2 = (uintptr_t)(s->op->dst->d_name + s->op->base);
+  sqe->user_data = (uint64_t)(s - b->slots);
+  s->renaming = 1;
+  b->cqe_pending++;
+  return;
+}
+
+
+/* Second stage: the rename over the target is finished */
+static void uring_rename_done(struct uring_slot * const restrict s, const int res)
+{
+  if (res == 0) s->op->status = OP_DONE;
+  else {
+    /* Remove the new link again; the target was never touched */
+    s->op->err = -res;
+    s->op->status = (unlinkat(s->dirfd, s->tmpname, 0) == 0) ? OP_FAILED : OP_FAILED_TEMP;
+  }
+  return;
+}
+
+
+/* Submit everything queued and reap completions until every operation
+ * has finished. Each completion is handled by the stage of its own slot,
+ * since renames are submitted while other links are still in flight and
+ * completions of both stages can come back in any order. Returns 0 or
+ * -errno if the ring itself failed. */
+static int uring_reap(struct uring_batch * const restrict b)
+{
+  struct io_uring_cqe *cqe;
+  struct uring_slot *s;
+  int ret, res;
+
+  ret = uring_submit_and_wait(&b->ring, b->cqe_pending);
+  while (ret == 0 && b->cqe_pending > 0) {
+    cqe = uring_peek_cqe(&b->ring);
+    if (cqe == NULL) {
+      /* This also submits the renames queued since the last call */
+      ret = uring_submit_and_wait(&b->ring, b->cqe_pending);
+      continue;
+    }
+    s = &b->slots[cqe->user_data];
+    res = cqe->res;
+    uring_cqe_seen(&b->ring);
+    b->cqe_pending--;
+    if (s->renaming) uring_rename_done(s, res);
+    else uring_first_done(b, s, res);
+  }
+  b->cqe_pending = 0;
+  return ret;
+}
+
+
+/* Run everything queued: all links (or unlinks) are submitted together,
+ * and the rename of each link that was made is queued as its link
+ * completes. The rename is not tied to the link with IOSQE_IO_LINK
+ * because not every kernel cancels the rest of a chain when a link fails,
+ * and a stale temporary file would then be renamed over the target.
+ * Finished directories are closed afterwards. */
+static void uring_flush(struct uring_batch * const restrict b)
+{
+  int ret = 0;
+
+  if (b->slotcount > 0) {
+    b->cqe_pending = b->slotcount;
+    ret = uring_reap(b);
+  }
+  /* Only a broken ring leaves operations unfinished */
+  if (ret != 0) {
+    for (unsigned int i = 0; i < b->slotcount; i++) {
+      if (b->slots[i].op->status != OP_PENDING) continue;
+      b->slots[i].op->err = -ret;
+      b->slots[i].op->status = OP_FAILED;
+    }
+  }
+
+  for (unsigned int i = 0; i < b->slotcount; i++) {
+    free(b->slots[i].tmpname);
+    free(b->slots[i].target);
+    if (b->slots[i].srcfd != -1) close(b->slots[i].srcfd);
+  }
+  b->slotcount = 0;
+  for (unsigned int i = 0; i < b->dircount; i++) close(b->dirfds[i]);
+  b->dircount = 0;
+  return;
+}
+
+
+/* Queue one link to a temporary name (or one unlink) */
+static void uring_queue(struct uring_batch * const restrict b, struct action_op * const restrict op,
+    const int dirfd, const int action)
+{
+  const char * const name = op->dst->d_name + op->base;
+  struct uring_slot *s;
+  struct io_uring_sqe *sqe;
+#ifndef NO_SYMLINKS
+  char rel_path[PATHBUF_SIZE];
+#endif
+  char procname[32];
+  int srcfd;
+
+  if (check_op(op, dirfd, action, &srcfd) != 0) return;
+#ifndef NO_SYMLINKS
+  if (action == ACTION_SYMLINK && symlink_target(op, rel_path) != 0) return;
+#endif
+  if (b->slotcount == b->ring.sq_entries) uring_flush(b);
+
+  s = &b->slots[b->slotcount];
+  s->op = op;
+  s->dirfd = dirfd;
+  s->srcfd = srcfd;
+  s->renaming = 0;
+  s->tmpname = NULL;
+  s->target = NULL;
+  sqe = uring_get_sqe(&b->ring);
+  sqe->user_data = b->slotcount;
+  b->slotcount++;
+  if (action == ACTION_DELETE) {
+    sqe->opcode = IORING_OP_UNLINKAT;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t)name;
+    return;
+  }
+
+  s->tmpname = (char *)malloc(strlen(name) + sizeof(TEMP_SUFFIX));
+  if (s->tmpname == NULL) jc_oom("uring_queue()");
+  strcpy(s->tmpname, name);
+  strcat(s->tmpname, TEMP_SUFFIX);
+  if (action == ACTION_HARDLINK) {
+    sqe->opcode = IORING_OP_LINKAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)op->src->d_name;
+    sqe->len = (uint32_t)dirfd;
+    sqe->addr2 = (uintptr_t)s->tmpname;
+    /* Link the checked source through its fd as link_from_fd() does */
+    if (srcfd != -1) {
+      snprintf(procname, sizeof(procname), "/proc/self/fd/%d", srcfd);
+      s->target = strdup(procname);
+      if (s->target == NULL) jc_oom("uring_queue() link");
+      sqe->addr = (uintptr_t)s->target;
+      sqe->hardlink_flags = AT_SYMLINK_FOLLOW;
+    }
+  }
+#ifndef NO_SYMLINKS
+  else {
+    s->target = strdup(rel_path);
+    if (s->target == NULL) jc_oom("uring_queue() symlink");
+    sqe->opcode = IORING_OP_SYMLINKAT;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t)s->target;
+    sqe->addr2 = (uintptr_t)s->tmpname;
+  }
+#endif
+  return;
+}
+
+
+/* Queue every operation on one directory */
+static void run_group_uring(struct uring_batch * const restrict b, const size_t group, const int action)
+{
+  const int dirfd = open_group_dir(group);
+
+  if (dirfd == -1) return;
+  for (size_t i = groups[group]; i < groups[group + 1]; i++) uring_queue(b, &ops[order[i]], dirfd, action);
+  /* The directory stays open until its operations have been reaped */
+  if (b->dircount == URING_MAX_DIRS) uring_flush(b);
+  b->dirfds[b->dircount++] = dirfd;
+  return;
+}
+#endif /* ENABLE_IO_URING */
+
+
+static void *pool_worker(void *arg)
+{
+  const int action = (int)(intptr_t)arg;
+#ifdef ENABLE_IO_URING
+  struct uring_batch batch;
+  /* Without a usable io_uring every operation is a plain syscall; queued
+   * hard links need /proc to link from the checked fd */
+  const int batched = (action != ACTION_HARDLINK || access("/proc/self/fd", F_OK) == 0)
+      && uring_batch_init(&batch) == 0;
+
+  LOUD(fprintf(stderr, "pool_worker: io_uring %s\n", batched ? "batching enabled" : "not available");)
+#endif
+
+  while (1) {
+    size_t group;
+
+    pthread_mutex_lock(&pool_lock);
+    group = next_group++;
+    pthread_mutex_unlock(&pool_lock);
+    if (group >= groupcount || interrupt) break;
+#ifdef ENABLE_IO_URING
+    if (batched) run_group_uring(&batch, group, action);
+    else
+#endif
+    run_group(group, action);
+  }
+#ifdef ENABLE_IO_URING
+  if (batched) {
+    uring_flush(&batch);
+    free(batch.slots);
+    uring_exit(&batch.ring);
+  }
+#endif
+  return NULL;
+}
+
+
+static void print_link_result(const struct action_op * const restrict op, const int action)
+{
+  file_t * const dst = op->dst;
+
+  switch (op->status) {
+    case OP_DONE:
+      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+        printf((action == ACTION_SYMLINK) ? "-@@-> " : "----> ");
+        jc_fwprint(stdout, dst->d_name, 1);
+      }
+#ifndef NO_HASHDB
+      /* Delete the hashdb entry for new hard/symbolic links */
+      if (ISFLAG(flags, F_HASHDB)) {
+        dst->mtime = 0;
+        add_hashdb_entry(NULL, 0, dst);
+      }
+#endif
+#ifndef NO_JOURNAL
+      journal_add((action == ACTION_SYMLINK) ? JOURNAL_SYMLINK : JOURNAL_HARDLINK, op->src->d_name, dst->d_name);
+#endif
+      break;
+    case OP_FAILED_TEMP:
+    case OP_FAILED:
+    case OP_RELPATH:
+      exit_status = EXIT_FAILURE;
+      if (op->status == OP_FAILED_TEMP) {
+        fprintf(stderr, "warning: couldn't remove temporary link: ");
+        jc_fwprint(stderr, dst->d_name, 0);
+        fprintf(stderr, "%s\n", TEMP_SUFFIX);
+      }
+      if (op->status == OP_RELPATH) {
+        if (op->err < 0) fprintf(stderr, "warning: make_relative_link_name() failed (%d)\n", op->err);
+        else fprintf(stderr, "warning: files to be linked have the same canonical path; not linking\n");
+      }
+      if (!ISFLAG(flags, F_HIDEPROGRESS)) {
+        printf("-//-> "); jc_fwprint(stdout, dst->d_name, 1);
+      }
+      fprintf(stderr, "warning: unable to link '"); jc_fwprint(stderr, dst->d_name, 0);
+      fprintf(stderr, "' -> '"); jc_fwprint(stderr, op->src->d_name, 0);
+      fprintf(stderr, "': %s\n", strerror((op->status == OP_RELPATH) ? 0 : op->err));
+      break;
+    case OP_READONLY:
+      fprintf(stderr, "warning: link target is a read-only file, not linking:\n-//-> ");
+      jc_fwprint(stderr, dst->d_name, 1);
+      exit_status = EXIT_FAILURE;
+      break;
+    case OP_SRC_CHANGED:
+      fprintf(stderr, "warning: source file modified since scanned, not linking:\n-//-> ");
+      jc_fwprint(stderr, dst->d_name, 1);
+      exit_status = EXIT_FAILURE;
+      break;
+    case OP_DST_CHANGED:
+      fprintf(stderr, "warning: target file modified since scanned, not linking:\n-//-> ");
+      jc_fwprint(stderr, dst->d_name, 1);
+      exit_status = EXIT_FAILURE;
+      break;
+    case OP_NODIR:
+      fprintf(stderr, "warning: cannot open link target directory, not linking:\n-//-> ");
+      jc_fwprint(stderr, dst->d_name, 1);
+      exit_status = EXIT_FAILURE;
+      break;
+    case OP_OTHERDEV:
+      fprintf(stderr, "warning: hard link target on different device, not linking:\n-//-> ");
+      jc_fwprint(stderr, dst->d_name, 1);
+      exit_status = EXIT_FAILURE;
+      break;
+    case OP_SAMEINODE:
+      /* Don't show == arrows when not matching against other hard links */
+      if (ISFLAG(flags, F_CONSIDERHARDLINKS) && !ISFLAG(flags, F_HIDEPROGRESS)) {
+        printf("-==-> "); jc_fwprint(stdout, dst->d_name, 1);
+      }
+      break;
+    case OP_NEWSRC:
+      fprintf(stderr, "warning: source file modified since scanned; changing source file:\n[SRC] ");
+      jc_fwprint(stderr, dst->d_name, 1);
+      exit_status = EXIT_FAILURE;
+      break;
+    case OP_PENDING:
+    case OP_KEEP:
+    case OP_SKIP:
+    default:
+      break;
+  }
+  return;
+}
+
+
+static void print_delete_result(const struct action_op * const restrict op)
+{
+  file_t * const dst = op->dst;
+
+  switch (op->status) {
+    case OP_KEEP:
+      printf("   [+] "); jc_fwprint(stdout, dst->d_name, 1);
+      break;
+    case OP_DONE:
+      printf("   [-] "); jc_fwprint(stdout, dst->d_name, 1);
+#ifndef NO_HASHDB
+      if (ISFLAG(flags, F_HASHDB)) {
+        dst->mtime = 0;
+        add_hashdb_entry(NULL, 0, dst);
+      }
+#endif
+      break;
+    case OP_DST_CHANGED:
+      printf("   [!] "); jc_fwprint(stdout, dst->d_name, 0);
+      printf("-- file changed since being scanned\n");
+      exit_status = EXIT_FAILURE;
+      break;
+    case OP_FAILED:
+    case OP_NODIR:
+      printf("   [!] "); jc_fwprint(stdout, dst->d_name, 0);
+      printf("-- unable to delete file\n");
+      exit_status = EXIT_FAILURE;
+      break;
+    case OP_PENDING:
+    case OP_FAILED_TEMP:
+    case OP_RELPATH:
+    case OP_READONLY:
+    case OP_SRC_CHANGED:
+    case OP_OTHERDEV:
+    case OP_SAMEINODE:
+    case OP_NEWSRC:
+    case OP_SKIP:
+    default:
+      break;
+  }
+  return;
+}
+
+
+/* Link or delete all duplicates of every match set without prompting */
+void actionpool_run(file_t *files, const int action)
+{
+  size_t pending = 0;
+  unsigned int threads;
+  pthread_t tid[ACTION_MAX_THREADS];
+  unsigned int started = 0;
+
+  LOUD(fprintf(stderr, "actionpool_run(%p, %d)\n", (void *)files, action);)
+
+  if (action == ACTION_DELETE) plan_deletes(files);
+  else plan_links(files, action);
+
+  /* Group the pending operations by directory */
+  order = (size_t *)malloc(sizeof(size_t) * (opcount + 1));
+  groups = (size_t *)malloc(sizeof(size_t) * (opcount + 1));
+  if (order == NULL || groups == NULL) jc_oom("actionpool_run()");
+  for (size_t i = 0; i < opcount; i++) if (ops[i].status == OP_PENDING) order[pending++] = i;
+  qsort(order, pending, sizeof(size_t), cmp_op_dir);
+  for (size_t i = 0; i < pending; i++) {
+    if (i > 0) {
+      const struct action_op * const a = &ops[order[i - 1]], * const b = &ops[order[i]];
+      if (a->base == b->base && memcmp(a->dst->d_name, b->dst->d_name, a->base) == 0) continue;
+    }
+    groups[groupcount++] = i;
+  }
+  groups[groupcount] = pending;
+
+  threads = ACTION_THREADS;
+  if (threads > ACTION_MAX_THREADS) threads = ACTION_MAX_THREADS;
+  if (threads > groupcount) threads = (unsigned int)groupcount;
+  LOUD(fprintf(stderr, "actionpool_run: %" PRIuMAX " operations in %" PRIuMAX " directories, %u threads\n",
+        (uintmax_t)pending, (uintmax_t)groupcount, threads);)
+  if (threads > 1)
+    for (; started < threads; started++)
+      if (pthread_create(&tid[started], NULL, pool_worker, (void *)(intptr_t)action) != 0) break;
+  /* If no thread could be started, this thread does all of the work */
+  if (started == 0) pool_worker((void *)(intptr_t)action);
+  for (unsigned int i = 0; i < started; i++) pthread_join(tid[i], NULL);
+
+  /* Print the results of each match set together, in the usual order */
+  for (size_t i = 0; i < opcount; i++) {
+    if (action == ACTION_DELETE) {
+      if (ops[i].setstart) {
+        if (i > 0) printf("\n");
+        printf("\n");
+      }
+      print_delete_result(&ops[i]);
+    } else {
+      if (ops[i].setstart && !ISFLAG(flags, F_HIDEPROGRESS)) {
+        if (i > 0) printf("\n");
+        printf("[SRC] "); jc_fwprint(stdout, ops[i].src->d_name, 1);
+      }
+      print_link_result(&ops[i], action);
+    }
+  }
+  if (opcount > 0 && (action == ACTION_DELETE || !ISFLAG(flags, F_HIDEPROGRESS))) printf("\n");
+  if (opcount == 0 && action != ACTION_DELETE) printf("%s", s_no_dupes);
+
+  free(ops);
+  free(order);
+  free(groups);
+  ops = NULL;
+  order = NULL;
+  groups = NULL;
+  opcount = 0; opalloc = 0;
+  groupcount = 0; next_group = 0;
+  return;
+}
+
+#endif /* ENABLE_ACTIONPOOL */
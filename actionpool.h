@@ -0,0 +1,37 @@
+/* Concurrent executor for non-interactive link and delete actions
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_ACTIONPOOL_H
+#define JDUPES_ACTIONPOOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+#if defined __linux__ && !defined NO_THREADS
+ #define ENABLE_ACTIONPOOL 1
+#endif
+
+#ifdef ENABLE_ACTIONPOOL
+/* Actions; the link types are the same as for linkfiles() */
+#define ACTION_SYMLINK 0
+#define ACTION_HARDLINK 1
+#define ACTION_DELETE 4
+
+/* Worker threads; link and delete actions wait on metadata round trips
+ * much more than on the CPU, so this does not follow the CPU count */
+ #ifndef ACTION_THREADS
+  #define ACTION_THREADS 8
+ #endif
+ #define ACTION_MAX_THREADS 64
+
+extern void actionpool_run(file_t *files, const int action);
+#endif /* ENABLE_ACTIONPOOL */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_ACTIONPOOL_H */
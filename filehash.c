@@ -1,6 +1,11 @@
 /* jdupes file hashing function
  * This file is part of jdupes; see jdupes.c for license information */
 
+/* SEEK_DATA and SEEK_HOLE are GNU extensions on glibc */
+#ifndef _GNU_SOURCE
+ #define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,7 +34,83 @@ const char *hash_algo_list[2] = {
 };
 
 
-/* Hash part or all of a file
+/* Keep the kernel reading ahead of the current read position
+ *
+ * The prefetched region is kept between one and two windows ahead of pos
+ * so that the next window is being read from disk while the current one
+ * is hashed or compared. Returns the new end of the prefetched region. */
+off_t readahead_window(const int fd, const off_t pos, off_t ra_end, const off_t limit)
+{
+#ifdef __linux__
+  while (ra_end < limit && (ra_end - pos) <= READAHEAD_SIZE) {
+    const off_t len = ((limit - ra_end) > READAHEAD_SIZE) ? READAHEAD_SIZE : (limit - ra_end);
+    posix_fadvise(fd, ra_end, len, POSIX_FADV_WILLNEED);
+    ra_end += len;
+  }
+#else
+  (void)fd; (void)pos; (void)limit;
+#endif /* __linux__ */
+  return ra_end;
+}
+
+
+/* Find the data or hole region of a sparse file that contains pos
+ *
+ * Returns 1 if pos is inside a hole and 0 if it is inside data; the end of
+ * that region (clamped to limit) is stored in region_end. Filesystems and
+ * platforms without SEEK_DATA/SEEK_HOLE report everything as data. This
+ * moves the file descriptor offset, so stdio callers must seek afterwards. */
+int sparse_region(const int fd, const off_t pos, const off_t limit, off_t * const restrict region_end)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE) && !defined(NO_SPARSE)
+  off_t next;
+
+  next = lseek(fd, pos, SEEK_DATA);
+  if (next == -1) {
+    /* ENXIO means there is no more data: the rest of the file is a hole */
+    if (errno == ENXIO) {
+      *region_end = limit;
+      return 1;
+    }
+    *region_end = limit;
+    return 0;
+  }
+  if (next > pos) {
+    *region_end = (next > limit) ? limit : next;
+    return 1;
+  }
+  next = lseek(fd, pos, SEEK_HOLE);
+  if (next == -1 || next > limit) next = limit;
+  *region_end = next;
+  return 0;
+#else
+  (void)fd; (void)pos;
+  *region_end = limit;
+  return 0;
+#endif /* SEEK_DATA && SEEK_HOLE */
+}
+
+
+/* Start reading the beginning of the file that will be hashed next */
+static void prefetch_file(const file_t * const restrict file)
+{
+#ifdef __linux__
+  int fd;
+
+  LOUD(fprintf(stderr, "prefetch_file('%s')\n", file->d_name);)
+  fd = open(file->d_name, O_RDONLY);
+  if (fd == -1) return;
+  posix_fadvise(fd, 0, (file->size > READAHEAD_SIZE) ? READAHEAD_SIZE : file->size, POSIX_FADV_WILLNEED);
+  close(fd);
+#else
+  (void)file;
+#endif /* __linux__ */
+  return;
+}
+
+
+/* Hash part or all of a file; if next is given, it is prefetched when
+ * the end of this file approaches so its data is ready when it is hashed
  *
  *              READ THIS BEFORE CHANGING THE HASH FUNCTION!
  * The hash function is only used to do fast exclusion. There is not much
@@ -37,20 +118,21 @@ const char *hash_algo_list[2] = {
  * NOT accept any pull requests that change the hash function unless there
  * is an EXTREMELY compelling reason to do so. Do not waste your time with
  * swapping hash functions. If you want to do it for fun then that's fine. */
-uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max_read, int algo)
+uint64_t *get_filehash(const file_t * const restrict checkfile, const file_t * const restrict next, const size_t max_read, int algo)
 {
-  off_t fsize;
+  off_t fsize, offset = 0, ra_end, end;
   /* This is an array because we return a pointer to it */
   static uint64_t hash[1];
   static uint64_t *chunk = NULL;
   FILE *file = NULL;
   int hashing = 0;
+  int prefetched = 0;
+  int in_hole = 0, zeroed = 0;
+  off_t region_end;
 #ifndef NO_XXHASH2
   XXH64_state_t *xxhstate = NULL;
 #endif
-#ifdef __linux__
   int filenum;
-#endif
 
   if (unlikely(checkfile == NULL || checkfile->d_name == NULL)) jc_nullptr("get_filehash()");
   if (unlikely((algo > HASH_ALGO_COUNT - 1) || (algo < 0))) goto error_bad_hash_algo;
@@ -104,17 +186,21 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
       return NULL;
     }
     fsize -= PARTIAL_HASH_SIZE;
+    offset = PARTIAL_HASH_SIZE;
+  }
+  filenum = fileno(file);
 #ifdef __linux__
-    filenum = fileno(file);
-    posix_fadvise(filenum, PARTIAL_HASH_SIZE, fsize, POSIX_FADV_SEQUENTIAL);
-    posix_fadvise(filenum, PARTIAL_HASH_SIZE, fsize, POSIX_FADV_WILLNEED);
-#endif /* __linux__ */
-  } else {
-#ifdef __linux__
-    filenum = fileno(file);
-    posix_fadvise(filenum, 0, fsize, POSIX_FADV_SEQUENTIAL);
-    posix_fadvise(filenum, 0, fsize, POSIX_FADV_WILLNEED);
+  posix_fadvise(filenum, offset, fsize, POSIX_FADV_SEQUENTIAL);
 #endif /* __linux__ */
+  end = offset + fsize;
+  ra_end = readahead_window(filenum, offset, offset, end);
+
+  /* Sparse files: holes are hashed as zeroes without being read. Small
+   * reads are not worth the extra system calls, so treat them as data */
+  region_end = end;
+  if (fsize > (off_t)auto_chunk_size) {
+    in_hole = sparse_region(filenum, offset, end, &region_end);
+    if (unlikely(fseeko(file, offset, SEEK_SET) == -1)) goto error_reading_file;
   }
 
 /* WARNING: READ NOTICE ABOVE get_filehash() BEFORE CHANGING HASH FUNCTIONS! */
@@ -131,8 +217,28 @@ uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max
     size_t bytes_to_read;
 
     if (interrupt) return 0;
+    if (offset >= region_end) {
+      in_hole = sparse_region(filenum, offset, end, &region_end);
+      if (unlikely(fseeko(file, offset, SEEK_SET) == -1)) goto error_reading_file;
+    }
     bytes_to_read = (fsize >= (off_t)auto_chunk_size) ? auto_chunk_size : (size_t)fsize;
-    if (unlikely(fread((void *)chunk, bytes_to_read, 1, file) != 1)) goto error_reading_file;
+    if ((off_t)bytes_to_read > region_end - offset) bytes_to_read = (size_t)(region_end - offset);
+    if (in_hole) {
+      if (!zeroed) memset((void *)chunk, 0, auto_chunk_size);
+      zeroed = 1;
+    } else {
+      if (unlikely(fread((void *)chunk, bytes_to_read, 1, file) != 1)) goto error_reading_file;
+      zeroed = 0;
+    }
+    offset += (off_t)bytes_to_read;
+
+    /* Pipeline: the kernel reads the next window while this chunk is hashed,
+     * and the next file to be hashed starts loading as this one runs out */
+    if (!in_hole) ra_end = readahead_window(filenum, offset, (ra_end > offset) ? ra_end : offset, region_end);
+    if (next != NULL && prefetched == 0 && (end - offset) <= READAHEAD_SIZE) {
+      prefetch_file(next);
+      prefetched = 1;
+    }
 
   switch (algo) {
 #ifndef NO_XXHASH2
@@ -15,7 +15,9 @@ extern const char *hash_algo_list[HASH_ALGO_COUNT];
 
 #include "jdupes.h"
 
-uint64_t *get_filehash(const file_t * const restrict checkfile, const size_t max_read, int algo);
+int sparse_region(const int fd, const off_t pos, const off_t limit, off_t * const restrict region_end);
+off_t readahead_window(const int fd, const off_t pos, off_t ra_end, const off_t limit);
+uint64_t *get_filehash(const file_t * const restrict checkfile, const file_t * const restrict next, const size_t max_read, int algo);
 
 #ifdef __cplusplus
 }
@@ -20,9 +20,32 @@
    SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
 #include <stdio.h>
+#ifndef ON_WINDOWS
+ #include <fcntl.h>
+ #include <sys/stat.h>
+#endif
 #include <libjodycode.h>
 #include "jdupes.h"
 #include "likely_unlikely.h"
+#include "filestat.h"
+
+/* Compare fresh stat() info against what was recorded during the scan */
+static int stat_differs(const file_t * const restrict file, const struct JC_STAT * const restrict s)
+{
+  if (file->inode != s->st_ino) return 1;
+  if (file->size != s->st_size) return 1;
+  if (file->device != s->st_dev) return 1;
+  if (file->mode != s->st_mode) return 1;
+#ifndef NO_MTIME
+  if (file->mtime != s->st_mtime) return 1;
+#endif
+#ifndef NO_PERMS
+  if (file->uid != s->st_uid) return 1;
+  if (file->gid != s->st_gid) return 1;
+#endif
+  return 0;
+}
+
 
 /* Check file's stat() info to make sure nothing has changed
  * Returns 1 if changed, 0 if not changed, negative if error */
@@ -39,17 +62,7 @@ int file_has_changed(file_t * const restrict file)
   if (!ISFLAG(file->flags, FF_VALID_STAT)) return -66;
 
   if (jc_stat(file->d_name, &s) != 0) return -2;
-  if (file->inode != s.st_ino) return 1;
-  if (file->size != s.st_size) return 1;
-  if (file->device != s.st_dev) return 1;
-  if (file->mode != s.st_mode) return 1;
-#ifndef NO_MTIME
-  if (file->mtime != s.st_mtime) return 1;
-#endif
-#ifndef NO_PERMS
-  if (file->uid != s.st_uid) return 1;
-  if (file->gid != s.st_gid) return 1;
-#endif
+  if (stat_differs(file, &s)) return 1;
 #ifndef NO_SYMLINKS
   if (lstat(file->d_name, &s) != 0) return -3;
   if ((JC_S_ISLNK(s.st_mode) > 0) ^ ISFLAG(file->flags, FF_IS_SYMLINK)) return 1;
@@ -59,6 +72,38 @@ int file_has_changed(file_t * const restrict file)
 }
 
 
+#ifndef ON_WINDOWS
+/* Same as file_has_changed() for a name relative to an open directory,
+ * or for an open descriptor of the file itself if name is NULL, which
+ * avoids looking up the full path again */
+int file_has_changed_at(file_t * const restrict file, const int fd, const char * const restrict name)
+{
+  struct stat s;
+
+  if (ISFLAG(flags, F_NOCHANGECHECK)) return 0;
+
+  if (unlikely(file == NULL || file->d_name == NULL)) jc_nullptr("file_has_changed_at()");
+  LOUD(fprintf(stderr, "file_has_changed_at('%s', %d, '%s')\n", file->d_name, fd, name == NULL ? "(fd)" : name);)
+
+  if (!ISFLAG(file->flags, FF_VALID_STAT)) return -66;
+
+  if (name == NULL) {
+    if (fstat(fd, &s) != 0) return -2;
+  } else {
+ #ifndef NO_SYMLINKS
+    /* For anything but a symlink the lstat() result is the stat() result */
+    if (fstatat(fd, name, &s, AT_SYMLINK_NOFOLLOW) != 0) return -3;
+    if ((S_ISLNK(s.st_mode) > 0) ^ ISFLAG(file->flags, FF_IS_SYMLINK)) return 1;
+    if (ISFLAG(file->flags, FF_IS_SYMLINK) && fstatat(fd, name, &s, 0) != 0) return -2;
+ #else
+    if (fstatat(fd, name, &s, 0) != 0) return -2;
+ #endif
+  }
+  return stat_differs(file, &s);
+}
+#endif /* ON_WINDOWS */
+
+
 int getfilestats(file_t * const restrict file)
 {
   struct JC_STAT s;
@@ -1,43 +1,369 @@
 /* File hash database management
- * This file is part of jdupes; see jdupes.c for license information */
+ * This file is part of jdupes; see jdupes.c for license information
+ *
+ * v4 databases are binary: a header, fixed-width records, an open
+ * addressing index of record numbers keyed on the path hash, a directory
+ * table and a heap of strings, all in host byte order. Paths are split
+ * into a directory and a file name; each directory is stored once and
+ * records point at it. The file is mapped and searched in place, so
+ * loading costs nothing no matter how large it is. Changes made during a
+ * run go to an in-memory hash table, which is checked first and shadows
+ * the mapped records; saving merges both into a new file. v3 databases,
+ * which keep whole paths in the heap, are still used in place; v1/v2 text
+ * databases are loaded into the table.
+ *
+ * Every change is also appended to a journal next to the database and
+ * synced to disk at regular checkpoints, so an interrupted run keeps its
+ * work and a save only has to sync the journal. Loading replays the
+ * journal over the database; the database itself is only rewritten
+ * (compacted) once the journal grows past a fraction of its size. */
 
 #include <errno.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <time.h>
+#ifdef ON_WINDOWS
+ #include <io.h>
+ #include <sys/locking.h>
+#else
+ #include <fcntl.h>
+ #include <unistd.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+#endif
 #include "jdupes.h"
 #include "libjodycode.h"
 #include "likely_unlikely.h"
 #include "hashdb.h"
 
-#define HASHDB_VER 2
+#if defined __linux__ && !defined NO_THREADS
+ #define HASHDB_THREADS 1
+ #include <pthread.h>
+ #include <signal.h>
+#endif
+
+#define HASHDB_VER 4
 #define HASHDB_MIN_VER 1
-#define HASHDB_MAX_VER 2
+/* Newest text format; dump_hashdb() prints it */
+#define HASHDB_TEXT_VER 2
 #ifndef PH_SHIFT
  #define PH_SHIFT 12
 #endif
 #define SECS_TO_TIME(a,b) strftime(a, 32, "%Y-%m-%d %H:%M:%S", localtime(b));
 
+/* In-memory table: starting size, entries per slab, path arena size */
 #ifndef HT_SIZE
- #define HT_SIZE 131072
+ #define HT_SIZE 4096
+#endif
+#ifndef HASHDB_DIR_TABLE_SIZE
+ #define HASHDB_DIR_TABLE_SIZE 256
+#endif
+#ifndef HASHDB_SLAB_ENTRIES
+ #define HASHDB_SLAB_ENTRIES 4096
+#endif
+#ifndef HASHDB_ARENA_SIZE
+ #ifdef LOW_MEMORY
+  #define HASHDB_ARENA_SIZE 65536
+ #else
+  #define HASHDB_ARENA_SIZE 1048576
+ #endif
+#endif
+
+#define HASHDB3_MAGIC "jdupes hashdb:3\n"
+#define HASHDB4_MAGIC "jdupes hashdb:4\n"
+#define HASHDB3_BYTE_ORDER 0x01020304U
+#ifndef HASHDB3_IOBUF
+ #define HASHDB3_IOBUF 1048576
 #endif
-#define HT_MASK (HT_SIZE - 1)
 
-static hashdb_t *hashdb[HT_SIZE];
-static int hashdb_init = 0;
-static int hashdb_algo = 0;
-static int hashdb_dirty = 0;
-static int new_hashdb = 0;
+/* A sharded database is a directory holding a manifest and the shards;
+ * the first HASHDB_SHARD_DEPTH directories of a path pick its shard */
+#define HASHDB_MANIFEST "hashdb.manifest"
+#define HASHDB_MANIFEST_MAGIC "jdupes hashdb shards:1"
+#ifndef HASHDB_SHARD_DEPTH
+ #define HASHDB_SHARD_DEPTH 2
+#endif
+
+#define HASHDB_JOURNAL_MAGIC "jdupes hashdb journal:2\n"
+/* Version 1 journal records have no device */
+#define HASHDB_JOURNAL_MAGIC_V1 "jdupes hashdb journal:1\n"
+#define HASHDB_JOURNAL_SUFFIX ".journal"
+#define HASHDB_LOCK_SUFFIX ".lock"
+/* Compact once the journal is larger than 1/HASHDB_JOURNAL_RATIO of the db */
+#ifndef HASHDB_JOURNAL_RATIO
+ #define HASHDB_JOURNAL_RATIO 4
+#endif
+/* Sync the journal after this many changes or seconds, whichever is first */
+#ifndef HASHDB_CHECKPOINT_ENTRIES
+ #define HASHDB_CHECKPOINT_ENTRIES 16384
+#endif
+#ifndef HASHDB_CHECKPOINT_SECS
+ #define HASHDB_CHECKPOINT_SECS 10
+#endif
+
+#ifdef HASHDB_THREADS
+/* Threads parsing a text database; 0 = one per CPU */
+ #ifndef HASHDB_LOAD_THREADS
+  #define HASHDB_LOAD_THREADS 0
+ #endif
+#endif
+#define HASHDB_LOAD_MAX_THREADS 32
+#ifdef HASHDB_THREADS
+/* Threads checking files while pruning; they mostly wait on stat(), so
+ * there are more of them than CPUs */
+ #ifndef HASHDB_PRUNE_THREADS
+  #define HASHDB_PRUNE_THREADS 16
+ #endif
+#endif
+/* Text databases are split into pieces of at least this many bytes */
+#ifndef HASHDB_LOAD_MIN_BYTES
+ #define HASHDB_LOAD_MIN_BYTES 4194304
+#endif
 
-/* Pivot direction for rebalance */
-enum pivot { PIVOT_LEFT, PIVOT_RIGHT };
+/* The index stores record numbers for path hashes computed by
+ * get_path_hash(); path_check lets a build with a different block hash
+ * notice that it cannot use the index. v3 and v4 share the header; v3
+ * has no directory table. */
+struct hashdb3_header {
+  char magic[16];
+  uint32_t byte_order;
+  uint32_t hash_algo;
+  uint32_t record_size;
+  uint32_t reserved1;
+  uint64_t path_check;
+  uint64_t mtime;
+  uint64_t count;
+  uint64_t index_slots;
+  uint64_t records_off;
+  uint64_t index_off;
+  uint64_t heap_off;
+  uint64_t heap_size;
+  uint64_t inode_index_off;
+  uint64_t dirs_off;
+  uint64_t dir_count;
+  uint64_t reserved[1];
+};
+
+struct hashdb3_record {
+  uint64_t path_hash;
+  uint64_t partialhash;
+  uint64_t fullhash;
+  int64_t mtime;
+  int64_t size;
+  uint64_t inode;
+  uint64_t path_off;
+  union {
+    uint32_t path_len;  /* v3: length of the whole path */
+    uint32_t dir;       /* v4: directory table entry */
+  };
+  uint8_t hashcount;
+  uint8_t reserved[3];
+  uint64_t device;
+};
+
+/* Records written before the device was added end here. In v4 files
+ * path_off points at the NUL-terminated file name. */
+#define HASHDB3_MIN_RECORD_SIZE offsetof(struct hashdb3_record, device)
+
+/* A directory in the heap, including its final separator */
+struct hashdb4_dir {
+  uint64_t off;
+  uint32_t len;
+  uint32_t reserved;
+};
+
+struct hashdb_journal_header {
+  char magic[24];
+  uint32_t byte_order;
+  uint32_t hash_algo;
+};
+
+/* Followed by path_len bytes of path; the checksum covers everything
+ * after itself including the path, so a torn final write is detected */
+struct hashdb_journal_record {
+  uint64_t checksum;
+  uint64_t partialhash;
+  uint64_t fullhash;
+  int64_t mtime;
+  int64_t size;
+  uint64_t inode;
+  uint32_t path_len;
+  uint8_t hashcount;
+  uint8_t reserved[3];
+  uint64_t device;
+};
+
+/* A mapped database file; index slots hold record number + 1, 0 = empty.
+ * The inode index finds records by device, inode, size and mtime. */
+struct hashdb_map {
+  const char *base;
+  size_t size;
+  int mapped;
+  uint64_t count;
+  uint64_t slots;
+  size_t record_size;
+  const char *records;
+  const uint32_t *index;
+  const uint32_t *inode_index;
+  const char *heap;
+  uint64_t heap_size;
+  const struct hashdb4_dir *dirs;
+  uint64_t dir_count;
+};
+
+/* What tells a file apart from the one that replaces it by rename() */
+struct hashdb_fileid {
+  uint64_t dev;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime;
+};
+
+/* One database file and its journal. An ordinary database is a single
+ * shard with an empty prefix; a sharded database is a directory with a
+ * manifest and one shard per path prefix, each loaded on first use.
+ * Changes wait in jbuf until the next checkpoint appends them to the
+ * journal; journal_seen is how much of the journal has been applied. */
+struct hashdb_shard {
+  struct hashdb_map map;
+  char *name;
+  char *prefix;
+  size_t prefix_len;
+  uint32_t number;
+  int state;  /* 0 = not loaded, 1 = loaded, -1 = unusable */
+  int rewrite;
+  int dirty;
+  uint64_t base_size;
+  struct hashdb_fileid base_id;
+  char *journal_name;
+  char *lock_name;
+  char *jbuf;
+  size_t jbuf_len;
+  size_t jbuf_alloc;
+  size_t journal_recsize;
+  uint64_t journal_seen;
+  uint64_t journal_size;
+  uint64_t journal_appended;
+  unsigned int journal_pending;
+  time_t journal_synced;
+  int journal_failed;
+};
+
+/* Saving state shared by the walk_hashdb() callbacks; dirs lists the
+ * directories in the order they are written and dir_map caches them for
+ * the directories of a mapped v4 database */
+struct hashdb3_writer {
+  FILE *db;
+  struct hashdb_shard *shard;
+  uint32_t *index;
+  uint32_t *inode_index;
+  uint64_t mask;
+  uint64_t count;
+  uint64_t name_size;
+  struct hashdb_dir **dirs;
+  uint64_t dir_count;
+  uint64_t dir_alloc;
+  uint64_t dir_size;
+  struct hashdb_dir **dir_map;
+};
+
+/* Entries changed during this run live in slabs and their paths in arenas;
+ * a Robin Hood hash table keyed on the path hash points at them. Entries
+ * are only invalidated, except when another process rewrites their shard:
+ * then the table is rebuilt without them and they are marked invalid so
+ * walks over the slabs skip them. */
+struct hashdb_slab {
+  struct hashdb_slab *next;
+  unsigned int used;
+  hashdb_t entries[HASHDB_SLAB_ENTRIES];
+};
+
+struct hashdb_arena {
+  struct hashdb_arena *next;
+  size_t size;
+  size_t used;
+  char data[];
+};
+
+/* Each directory is kept once in an arena and entries point at it; canon
+ * is the shared copy once a loader thread's table is spliced, shard is
+ * the shard its entries are saved in and id is the directory's number in
+ * the file being written */
+struct hashdb_dir {
+  struct hashdb_dir *canon;
+  struct hashdb_shard *shard;
+  uint64_t hash;
+  uint32_t len;
+  uint32_t id;
+  char path[];
+};
+
+/* Text loading threads fill private slabs, arenas and directory tables
+ * which are then spliced onto the shared ones */
+struct hashdb_mem {
+  struct hashdb_slab *slab_head, *slab_tail;
+  struct hashdb_arena *arena_head;
+  struct hashdb_dir **dirs;
+  uint64_t dirs_size;
+  uint64_t dir_count;
+};
+
+/* The key is the path hash in the main table and the hash of device,
+ * inode, size and mtime in the table for finding moved files */
+struct hashdb_slot {
+  uint64_t key;
+  hashdb_t *entry;
+};
+
+static struct hashdb_slot *table = NULL;
+static uint64_t table_size = 0;
+static uint64_t table_count = 0;
+static struct hashdb_mem mem;
+/* Shards sorted by prefix; shard_dir is NULL for an ordinary database */
+static struct hashdb_shard **shards = NULL;
+static size_t shard_count = 0, shard_alloc = 0;
+static char *shard_dir = NULL;
+static unsigned int shard_depth = HASHDB_SHARD_DEPTH;
+static uint32_t shard_next = 1;
+static char path_check_str[] = "jdupes hashdb path hash check";
+/* Table entries by device, inode, size and mtime; built on first use */
+static struct hashdb_slot *itable = NULL;
+static uint64_t itable_size = 0;
+static uint64_t itable_count = 0;
+static int itable_built = 0;
+static int checkpoint_due = 0;
+/* Lookups made while the database loads in the background wait here */
+static file_t **pending = NULL;
+static size_t pending_cnt = 0, pending_alloc = 0;
+static int64_t load_result = 0;
+/* Command line roots; shards overlapping them are loaded up front */
+static char **load_roots = NULL;
+static int load_root_cnt = 0;
+#ifdef HASHDB_THREADS
+static pthread_t load_tid;
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static int load_running = 0;
+static int load_done = 0;
+#endif
+#ifdef DEBUG
+uint64_t hashdb_load_usec = 0;
+unsigned int hashdb_load_threads = 0;
+uint64_t hashdb_deferred = 0;
+uint64_t hashdb_moved = 0;
+uint64_t hashdb_merged = 0;
+size_t hashdb_shards_loaded = 0;
+size_t hashdb_shards = 0;
+#endif
 
-static int write_hashdb_entry(FILE *db, hashdb_t *cur, uint64_t *cnt, const int destroy);
-static int get_path_hash(char *path, uint64_t *path_hash);
+static int get_path_hash(const char * const restrict path, uint64_t *path_hash);
+static int64_t load_shard(struct hashdb_shard * const restrict shard);
+static int64_t load_hashdb_base(struct hashdb_shard * const restrict shard);
+static int sync_hashdb_shard(struct hashdb_shard * const restrict shard, uint64_t * const restrict cnt);
 
 
 #if 0
@@ -55,545 +381,3104 @@ void hd16(char *a) {
 #endif
 
 
-static hashdb_t *alloc_hashdb_node(const int pathlen)
+/* Place a slot, displacing entries that are closer to their home slot */
+static void insert_hashdb_slot(struct hashdb_slot * const restrict tbl, const uint64_t mask, struct hashdb_slot cur)
 {
-  int allocsize;
+  uint64_t slot = cur.key & mask;
+  uint64_t dist = 0;
+
+  while (tbl[slot].entry != NULL) {
+    const uint64_t slotdist = (slot - (tbl[slot].key & mask)) & mask;
 
-  allocsize = sizeof(hashdb_t) + pathlen + 1;
-  return (hashdb_t *)calloc(1, EXTEND64(allocsize));
+    if (slotdist < dist) {
+      const struct hashdb_slot temp = tbl[slot];
+      tbl[slot] = cur;
+      cur = temp;
+      dist = slotdist;
+    }
+    slot = (slot + 1) & mask;
+    dist++;
+  }
+  tbl[slot] = cur;
+  return;
 }
 
 
-/* destroy = 1 will free() all nodes while saving */
-int save_hash_database(const char * const restrict dbname, const int destroy)
+/* Make room for at least 'want' entries at no more than 7/8 load */
+static void grow_hashdb_table(struct hashdb_slot ** const restrict tbl, uint64_t * const restrict size, const uint64_t want)
 {
-  FILE *db = NULL;
-  uint64_t cnt = 0;
-  char *dbtemp;
+  struct hashdb_slot *newtable;
+  uint64_t newsize = (*size == 0) ? HT_SIZE : *size;
+
+  while (want > newsize - (newsize >> 3)) newsize <<= 1;
+  if (newsize == *size) return;
+  LOUD(fprintf(stderr, "grow_hashdb_table: %" PRIu64 " -> %" PRIu64 " slots\n", *size, newsize);)
+  newtable = (struct hashdb_slot *)calloc((size_t)newsize, sizeof(struct hashdb_slot));
+  if (newtable == NULL) jc_oom("grow_hashdb_table()");
+  for (uint64_t i = 0; i < *size; i++)
+    if ((*tbl)[i].entry != NULL) insert_hashdb_slot(newtable, newsize - 1, (*tbl)[i]);
+  free(*tbl);
+  *tbl = newtable;
+  *size = newsize;
+  return;
+}
 
-  if (dbname == NULL) goto error_hashdb_null;
-  LOUD(fprintf(stderr, "save_hash_database('%s') dirty = %d\n", dbname, hashdb_dirty);)
-  /* Don't save the hash database if it wasn't changed */
-  if (hashdb_dirty == 0 && destroy == 0) return 0;
-  if (hashdb_dirty == 1) {
-    errno = 0;
-    dbtemp = malloc(strlen(dbname) + 5);
-    if (dbtemp == NULL) goto error_hashdb_alloc;
-    strcpy(dbtemp, dbname);
-    strcat(dbtemp, ".tmp");
-    /* Try to remove any existing temporary database, ignoring errors */
-    jc_remove(dbtemp);
-    db = jc_fopen(dbtemp, JC_FILE_MODE_RW_SEQ);
-    if (db == NULL) goto error_hashdb_open;
-    if (write_hashdb_entry(db, NULL, &cnt, destroy) != 0) goto error_hashdb_write;
-    fclose(db);
-    if (new_hashdb == 0) {
-      jc_errno = 0;
-      if (jc_remove(dbname) != 0) {
-        if (jc_errno != ENOENT) goto error_hashdb_remove;
-      }
-    }
-    if (jc_rename(dbtemp, dbname) != 0) goto error_hashdb_rename;
-    LOUD(if (hashdb_dirty == 1) fprintf(stderr, "Wrote %" PRIu64 " items to hash databse '%s'\n", cnt, dbname);)
-    hashdb_dirty = 0;
-  }
 
-  return cnt;
+static char *alloc_hashdb_path(struct hashdb_mem * const restrict m, const size_t len)
+{
+  struct hashdb_arena *arena = m->arena_head;
+  char *path;
 
-error_hashdb_null:
-  fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
-  return -1;
-error_hashdb_open:
-  fprintf(stderr, "error: cannot open temp hashdb '%s' for writing: %s\n", dbtemp, strerror(errno));
-  return -2;
-error_hashdb_write:
-  fprintf(stderr, "error: write failed to temp hashdb '%s': %s\n", dbtemp, strerror(errno));
-  fclose(db);
-  return -3;
-error_hashdb_alloc:
-  fprintf(stderr, "error: cannot allocate memory for temporary hashdb name\n");
-  return -4;
-error_hashdb_remove:
-  fprintf(stderr, "error: cannot delete old hashdb '%s': %s\n", dbname, strerror(errno));
-  jc_remove(dbtemp);
-  return -5;
-error_hashdb_rename:
-  fprintf(stderr, "error: cannot rename temporary hashdb '%s' to '%s'; leaving it alone: %s\n", dbtemp, dbname, strerror(errno));
-  return -5;
+  if (arena == NULL || arena->size - arena->used < len) {
+    const size_t size = (len > HASHDB_ARENA_SIZE) ? len : HASHDB_ARENA_SIZE;
+
+    arena = (struct hashdb_arena *)malloc(sizeof(struct hashdb_arena) + size);
+    if (arena == NULL) return NULL;
+    arena->next = m->arena_head;
+    arena->size = size;
+    arena->used = 0;
+    m->arena_head = arena;
+  }
+  path = arena->data + arena->used;
+  arena->used += len;
+  return path;
 }
 
 
-static int write_hashdb_entry(FILE *db, hashdb_t *cur, uint64_t *cnt, const int destroy)
+static inline int is_path_sep(const char c)
 {
-  struct timeval tm;
-  int err = 0;
-  static char out[PATHBUF_SIZE + 128];
-
-  LOUD(fprintf(stderr, "write_hashdb_entry(%p, %p, %p, %d)", db, cur, cnt, destroy);)
-  /* Write header and traverse array on first call */
-  if (unlikely(cur == NULL)) {
-    gettimeofday(&tm, NULL);
-    snprintf(out, PATHBUF_SIZE + 127, "jdupes hashdb:%d,%d,%08lx\n", HASHDB_VER, hash_algo, (unsigned long)tm.tv_sec);
-    LOUD(fprintf(stderr, "write hashdb: %s", out);)
-    errno = 0;
-    if (db == NULL) printf("%s", out); else fputs(out, db);
-    if (errno != 0) return 1;
-    /* Write out each hash bucket, skipping empty buckets */
-    for (int i = 0; i < HT_SIZE; i++) {
-      if (hashdb[i] == NULL) continue;
-      err = write_hashdb_entry(db, hashdb[i], cnt, destroy);
-      if (err != 0) return err;
-    }
-    if (destroy == 1) {
-      memset(hashdb, 0, sizeof(hashdb_t *) * HT_SIZE);
-      hashdb_init = 0;
-    }
-    return 0;
-  }
+#ifdef ON_WINDOWS
+  if (c == '\\') return 1;
+#endif
+  return c == '/';
+}
 
-  /* Write out this node if it wasn't invalidated */
-  if (cur->hashcount != 0) {
-    snprintf(out, PATHBUF_SIZE + 127, "%u,%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%s\n",
-      cur->hashcount, cur->partialhash, cur->fullhash, (uint64_t)cur->mtime, (uint64_t)cur->size, (uint64_t)cur->inode, cur->path);
-    (*cnt)++;
-    LOUD(fprintf(stderr, "write hashdb: %s", out);)
-    errno = 0;
-    if (db == NULL) printf("%s", out); else fputs(out, db);
-    if (errno != 0) return 1;
-  }
 
-  /* Traverse the tree, propagating errors */
-  if (err == 0 && cur->left != NULL) err = write_hashdb_entry(db, cur->left, cnt, destroy);
-  if (err == 0 && cur->right != NULL) err = write_hashdb_entry(db, cur->right, cnt, destroy);
-  if (destroy == 1) free(cur);
-  return err;
+/* Length of the directory part of a path, including its final separator */
+static size_t path_dir_len(const char * const restrict path, size_t len)
+{
+  while (len > 0 && !is_path_sep(path[len - 1])) len--;
+  return len;
 }
 
 
-uint64_t dump_hashdb(void)
+/* FNV-1a; directories are short and hashed once per new entry */
+static uint64_t dir_hash(const char * const restrict dir, const size_t len)
 {
-  uint64_t cnt = 0;
+  uint64_t h = 0xcbf29ce484222325ULL;
 
-  fprintf(stderr, "Dumping hash database\n");
-  write_hashdb_entry(NULL, NULL, &cnt, 0);
-  return cnt;
+  for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)dir[i]) * 0x100000001b3ULL;
+  return h;
 }
 
 
-static void pivot_hashdb_tree(hashdb_t **parent, hashdb_t *cur, enum pivot direction)
+/* Slot holding a directory or the empty slot where it belongs */
+static struct hashdb_dir **find_dir_slot(struct hashdb_mem * const restrict m, const char * const restrict dir, const uint32_t len, const uint64_t hash)
 {
-  hashdb_t *temp;
+  uint64_t mask, slot;
+
+  if (m->dir_count + 1 > m->dirs_size - (m->dirs_size >> 3)) {
+    const uint64_t newsize = (m->dirs_size == 0) ? HASHDB_DIR_TABLE_SIZE : m->dirs_size << 1;
+    struct hashdb_dir **newdirs = (struct hashdb_dir **)calloc((size_t)newsize, sizeof(struct hashdb_dir *));
 
-  if (direction == PIVOT_LEFT) {
-    temp = cur->right;
-    cur->right = cur->right->left;
-    temp->left = cur;
-    *parent = temp;
-  } else {  // PIVOT_RIGHT
-    temp = cur->left;
-    cur->left = cur->left->right;
-    temp->right = cur;
-    *parent = temp;
+    if (newdirs == NULL) return NULL;
+    for (uint64_t i = 0; i < m->dirs_size; i++) {
+      if (m->dirs[i] == NULL) continue;
+      for (slot = m->dirs[i]->hash & (newsize - 1); newdirs[slot] != NULL; slot = (slot + 1) & (newsize - 1));
+      newdirs[slot] = m->dirs[i];
+    }
+    free(m->dirs);
+    m->dirs = newdirs;
+    m->dirs_size = newsize;
+  }
+  mask = m->dirs_size - 1;
+  for (slot = hash & mask; m->dirs[slot] != NULL; slot = (slot + 1) & mask) {
+    const struct hashdb_dir *d = m->dirs[slot];
+    if (d->hash == hash && d->len == len && memcmp(d->path, dir, len) == 0) break;
   }
+  return &m->dirs[slot];
+}
 
-  return;
+
+/* Find or add the one copy of a directory */
+static struct hashdb_dir *intern_hashdb_dir(struct hashdb_mem * const restrict m, const char * const restrict dir, const uint32_t len)
+{
+  const uint64_t hash = dir_hash(dir, len);
+  struct hashdb_dir **slot = find_dir_slot(m, dir, len, hash);
+  struct hashdb_dir *d;
+
+  if (slot == NULL) return NULL;
+  if (*slot != NULL) return *slot;
+  /* Keep the arena 8-byte aligned for the directory header */
+  if (m->arena_head != NULL) {
+    const size_t used = (m->arena_head->used + 7) & ~(size_t)7;
+    m->arena_head->used = (used < m->arena_head->size) ? used : m->arena_head->size;
+  }
+  d = (struct hashdb_dir *)(void *)alloc_hashdb_path(m, sizeof(struct hashdb_dir) + len + 1);
+  if (d == NULL) return NULL;
+  d->canon = d;
+  d->hash = hash;
+  d->len = len;
+  d->id = UINT32_MAX;
+  memcpy(d->path, dir, len);
+  d->path[len] = '\0';
+  *slot = d;
+  m->dir_count++;
+  return d;
 }
 
 
-static void rebalance_hashdb_tree(hashdb_t **parent)
+/* Allocate a zeroed entry holding a copy of path; it is not in the table.
+ * The directory part is shared with the other entries in it. */
+static hashdb_t *alloc_hashdb_node(struct hashdb_mem * const restrict m, const char * const restrict path, const int pathlen)
 {
-  const uint64_t center = 0x8000000000000000ULL;
-  hashdb_t *cur = *parent;
+  const size_t dirlen = path_dir_len(path, (size_t)pathlen);
+  hashdb_t *node;
 
-  if (unlikely(cur == NULL || parent == NULL)) return;
-  if (cur->left == NULL && cur->right == NULL) return;
+  if (m->slab_tail == NULL || m->slab_tail->used == HASHDB_SLAB_ENTRIES) {
+    struct hashdb_slab *slab = (struct hashdb_slab *)calloc(1, sizeof(struct hashdb_slab));
 
-  if (cur->left != NULL) rebalance_hashdb_tree(&(cur->left));
-  if (cur->right != NULL) rebalance_hashdb_tree(&(cur->right));
-  if (cur->path_hash > center) {
-    /* This node might be better off to the right */
-    if (cur->left != NULL && cur->left->path_hash > center) pivot_hashdb_tree(parent, cur, PIVOT_RIGHT);
-  } else if (cur->path_hash < center) {
-    /* This node might be better off to the left */
-    if (cur->right != NULL && cur->right->path_hash < center) pivot_hashdb_tree(parent, cur, PIVOT_LEFT);
+    if (slab == NULL) return NULL;
+    if (m->slab_tail == NULL) m->slab_head = slab;
+    else m->slab_tail->next = slab;
+    m->slab_tail = slab;
   }
-  return;
+  node = &m->slab_tail->entries[m->slab_tail->used];
+  node->dir = intern_hashdb_dir(m, path, (uint32_t)dirlen);
+  if (node->dir == NULL) return NULL;
+  node->name = alloc_hashdb_path(m, (size_t)pathlen - dirlen + 1);
+  if (node->name == NULL) return NULL;
+  memcpy(node->name, path + dirlen, (size_t)pathlen - dirlen);
+  node->name[(size_t)pathlen - dirlen] = '\0';
+  m->slab_tail->used++;
+  return node;
 }
 
 
-/* in_path allows use of a precomputed path length to avoid extra strlen() calls */
-hashdb_t *add_hashdb_entry(char *in_path, int pathlen, const file_t *check)
+/* Compare the path of an entry with a whole path */
+static inline int hashdb_path_eq(const hashdb_t * const restrict entry, const char * const restrict path)
 {
-  unsigned int bucket;
-  hashdb_t *file;
-  hashdb_t *cur;
-  uint64_t path_hash;
-  int exclude;
-  int difference;
-  char *path;
+  return strncmp(entry->dir->path, path, entry->dir->len) == 0 && strcmp(entry->name, path + entry->dir->len) == 0;
+}
+
+
+/* Put the path of an entry together in buf, which holds PATHBUF_SIZE + 1
+ * bytes, and return its length */
+static size_t hashdb_entry_path(const hashdb_t * const restrict entry, char * const restrict buf)
+{
+  const size_t namelen = strlen(entry->name);
 
-  /* Allocate hashdb on first use */
-  if (unlikely(hashdb_init == 0)) {
-    memset(hashdb, 0, sizeof(hashdb_t *) * HT_SIZE);
-    hashdb_init = 1;
+  memcpy(buf, entry->dir->path, entry->dir->len);
+  memcpy(buf + entry->dir->len, entry->name, namelen + 1);
+  return entry->dir->len + namelen;
+}
+
+
+static void free_hashdb_mem(struct hashdb_mem * const restrict m)
+{
+  while (m->slab_head != NULL) {
+    struct hashdb_slab *next = m->slab_head->next;
+    free(m->slab_head);
+    m->slab_head = next;
   }
+  while (m->arena_head != NULL) {
+    struct hashdb_arena *next = m->arena_head->next;
+    free(m->arena_head);
+    m->arena_head = next;
+  }
+  m->slab_tail = NULL;
+  free(m->dirs);
+  m->dirs = NULL;
+  m->dirs_size = 0;
+  m->dir_count = 0;
+  return;
+}
 
-  if (unlikely((in_path == NULL && check == NULL) || (check != NULL && check->d_name == NULL))) return NULL;
 
-  /* Get path hash and length from supplied path; use hash to choose the bucket */
-  if (in_path == NULL) path = check->d_name;
-  else path = in_path;
-  if (pathlen == 0) pathlen = strlen(path);
-  if (get_path_hash(path, &path_hash) != 0) return NULL;
-  bucket = path_hash & HT_MASK;
+/* Move every slab and arena of 'from' to the end of the shared ones; its
+ * entries are pointed at the shared copies of their directories */
+static int splice_hashdb_mem(struct hashdb_mem * const restrict from)
+{
+  struct hashdb_arena *last;
 
+  for (uint64_t i = 0; i < from->dirs_size; i++) {
+    struct hashdb_dir *d = from->dirs[i], **slot;
 
-  if (hashdb[bucket] == NULL) {
-    file = alloc_hashdb_node(pathlen);
-    if (file == NULL) return NULL;
-    file->path_hash = path_hash;
-    hashdb[bucket] = file;
-  } else {
-    cur = hashdb[bucket];
-    difference = 0;
-    while (1) {
-      /* If path is set then this entry may already exist and we need to check */
-      if (check != NULL && cur->path != NULL) {
-        if (cur->path_hash == path_hash && strcmp(cur->path, check->d_name) == 0) {
-          /* Should we invalidate this entry? */
-          exclude = 0;
-          if (cur->mtime != check->mtime) exclude |= 1;
-          if (cur->inode != check->inode) exclude |= 2;
-          if (cur->size  != check->size)  exclude |= 4;
-          if (exclude == 0) {
-            if (cur->hashcount == 1 && ISFLAG(check->flags, FF_HASH_FULL)) {
-              cur->hashcount = 2;
-              cur->fullhash = check->filehash;
-              hashdb_dirty = 1;
-            }
-            return cur;
-          } else {
-            /* Something changed; invalidate this entry */
-            cur->hashcount = 0;
-            hashdb_dirty = 1;
-            return NULL;
-          }
-        }
-      }
-      if (cur->path_hash >= path_hash) {
-        if (cur->left == NULL) {
-          file = alloc_hashdb_node(pathlen);
-          if (file == NULL) return NULL;
-          cur->left = file;
-          break;
-        } else {
-          cur = cur->left;
-          difference--;
-          continue;
-        }
-      } else {
-        if (cur->right == NULL) {
-          file = alloc_hashdb_node(pathlen);
-          if (file == NULL) return NULL;
-          cur->right = file;
-          break;
-        } else {
-          cur = cur->right;
-          difference++;
-          continue;
-        }
-      }
-    }
-    if (difference < 0) difference = -difference;
-    if (difference > 64) {
-      rebalance_hashdb_tree(&(hashdb[bucket]));
+    if (d == NULL) continue;
+    slot = find_dir_slot(&mem, d->path, d->len, d->hash);
+    if (slot == NULL) return 1;
+    if (*slot == NULL) {
+      *slot = d;
+      mem.dir_count++;
     }
+    d->canon = *slot;
   }
-
-  /* If a check entry was given then populate it */
-  if (check != NULL && check->d_name != NULL && ISFLAG(check->flags, FF_HASH_PARTIAL)) {
-    hashdb_dirty = 1;
-    file->path_hash = path_hash;
-    file->path = (char *)((uintptr_t)file + (uintptr_t)sizeof(hashdb_t));
-    memcpy(file->path, check->d_name, pathlen + 1);
-    *(file->path + pathlen) = '\0';
-    file->size = check->size;
-    file->inode = check->inode;
-    file->mtime = check->mtime;
-    file->partialhash = check->filehash_partial;
-    file->fullhash = check->filehash;
-    if (ISFLAG(check->flags, FF_HASH_FULL)) file->hashcount = 2;
-    else file->hashcount = 1;
-  } else {
-    /* No check entry? Populate from passed parameters */
-    file->path = (char *)((uintptr_t)file + (uintptr_t)sizeof(hashdb_t));
-    file->path_hash = path_hash;
+  for (struct hashdb_slab *slab = from->slab_head; slab != NULL; slab = slab->next)
+    for (unsigned int i = 0; i < slab->used; i++) slab->entries[i].dir = slab->entries[i].dir->canon;
+  if (from->slab_head != NULL) {
+    if (mem.slab_tail == NULL) mem.slab_head = from->slab_head;
+    else mem.slab_tail->next = from->slab_head;
+    mem.slab_tail = from->slab_tail;
   }
-  return file;
+  if (from->arena_head != NULL) {
+    for (last = from->arena_head; last->next != NULL; last = last->next);
+    last->next = mem.arena_head;
+    mem.arena_head = from->arena_head;
+  }
+  free(from->dirs);
+  memset(from, 0, sizeof(struct hashdb_mem));
+  return 0;
 }
 
 
-/* db header format: jdupes hashdb:dbversion,hashtype,update_mtime
- * db line format: hashcount,partial,full,mtime,size,inode,path */
-int64_t load_hash_database(const char * const restrict dbname)
+/* Allocate a zeroed entry holding a copy of path and add it to the table */
+static hashdb_t *new_hashdb_node(const char * const restrict path, const int pathlen, const uint64_t path_hash)
 {
-  FILE *db;
-  char line[PATHBUF_SIZE + 128];
-  char buf[PATHBUF_SIZE + 128];
-  char *field, *temp;
-  int db_ver;
-  unsigned int fixed_len;
-  int64_t linenum = 1;
-#ifdef LOUD_DEBUG
-  time_t db_mtime;
-  char date[32];
-#endif /* LOUD_DEBUG */
+  struct hashdb_slot slot;
+  hashdb_t *node;
+
+  node = alloc_hashdb_node(&mem, path, pathlen);
+  if (node == NULL) return NULL;
+  node->path_hash = path_hash;
+
+  grow_hashdb_table(&table, &table_size, table_count + 1);
+  slot.key = path_hash;
+  slot.entry = node;
+  insert_hashdb_slot(table, table_size - 1, slot);
+  table_count++;
+  return node;
+}
 
-  if (dbname == NULL) goto error_hashdb_null;
-  LOUD(fprintf(stderr, "load_hash_database('%s')\n", dbname);)
-  errno = 0;
-  db = jc_fopen(dbname, JC_FILE_MODE_RDONLY_SEQ);
-  if (db == NULL) goto warn_hashdb_open;
 
-  /* Read header line */
-  if ((fgets(buf, PATHBUF_SIZE + 127, db) == NULL) || (ferror(db) != 0)) {
-    if (errno == 0) goto warn_hashdb_open;  // empty file = make new DB
-    goto error_hashdb_read;
-  } else if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Loading hash database...");
-  field = strtok(buf, ":");
-  if (strcmp(field, "jdupes hashdb") != 0) goto error_hashdb_header;
-  field = strtok(NULL, ":");
-  temp = strtok(field, ",");
-  db_ver = (int)strtoul(temp, NULL, 10);
-  temp = strtok(NULL, ",");
-  hashdb_algo = (int)strtoul(temp, NULL, 10);
-  temp = strtok(NULL, ",");
-  /* Database mod time is currently set but not used */
-  LOUD(db_mtime = (int)strtoul(temp, NULL, 16);)
-  LOUD(SECS_TO_TIME(date, &db_mtime);)
-  LOUD(fprintf(stderr, "hashdb header: ver %u, algo %u, mod %s\n", db_ver, hashdb_algo, date);)
-  if (db_ver < HASHDB_MIN_VER || db_ver > HASHDB_MAX_VER) goto error_hashdb_version;
-  if (hashdb_algo != hash_algo) goto warn_hashdb_algo;
+/* Hash of what stays the same when a file is renamed or moved */
+static uint64_t inode_key(const uint64_t device, const uint64_t inode, const int64_t size, const int64_t mtime)
+{
+  uint64_t h = device * 0x9e3779b97f4a7c15ULL;
 
-  /* v1 has 8-byte sizes; v2 has 16-byte (4GiB+) sizes */
-  fixed_len = 87;
-  if (db_ver == 1) fixed_len = 71;
+  h = (h ^ inode) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (uint64_t)size) * 0x94d049bb133111ebULL;
+  h = (h ^ (uint64_t)mtime) * 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 31);
+}
 
-  /* Read database entries */
-  while (1) {
-    int pathlen;
-    unsigned int linelen;
-    int hashcount;
-    uint64_t partialhash, fullhash = 0;
-    time_t mtime;
-    char *path;
-    hashdb_t *entry;
-    off_t size;
-    jdupes_ino_t inode;
 
-    errno = 0;
-    if ((fgets(line, PATHBUF_SIZE + 128, db) == NULL)) {
-      if (ferror(db) != 0) goto error_hashdb_read;
-      break;
-    }
-    LOUD(fprintf(stderr, "read hashdb: %s", line);)
-    strncpy(buf, line, PATHBUF_SIZE + 128);
-    linenum++;
-    linelen = (int64_t)strlen(buf);
-    if (linelen < fixed_len + 1) goto error_hashdb_line;
-
-    /* Split each entry into fields and
-     * hashcount: 1 = partial only, 2 = partial and full */
-    field = strtok(buf, ","); if (field == NULL) goto error_hashdb_line;
-    hashcount = (int)strtol(field, NULL, 16);
-    if (hashcount < 1 || hashcount > 2) goto error_hashdb_line;
-    field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
-    partialhash = strtoull(field, NULL, 16);
-    field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
-    if (hashcount == 2) fullhash = strtoull(field, NULL, 16);
-    field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
-    mtime = (time_t)strtoul(field, NULL, 16);
-    field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
-    size = strtoll(field, NULL, 16);
-    if (size == 0) goto error_hashdb_line;
-    field = strtok(NULL, ","); if (field == NULL) goto error_hashdb_line;
-    inode = strtoull(field, NULL, 16);
-
-    path = buf + fixed_len;
-    path = strtok(path, "\n"); if (path == NULL) goto error_hashdb_line;
-    pathlen = linelen - fixed_len + 1;
-    if (pathlen > PATHBUF_SIZE) goto error_hashdb_line;
-    *(path + pathlen) = '\0';
-
-    /* Allocate and populate a tree entry */
-    entry = add_hashdb_entry(path, pathlen, NULL);
-    if (entry == NULL) goto error_hashdb_add;
-    memcpy(entry->path, path, pathlen + 1);
-    entry->mtime = mtime;
-    entry->inode = inode;
-    entry->size = size;
-    entry->partialhash = partialhash;
-    entry->fullhash = fullhash;
-    entry->hashcount = hashcount;
-  }
+/* Entries whose stats change are added again; lookups skip stale slots */
+static void add_inode_slot(hashdb_t * const restrict entry)
+{
+  struct hashdb_slot slot;
+
+  if (entry->device == 0 || entry->hashcount == 0) return;
+  grow_hashdb_table(&itable, &itable_size, itable_count + 1);
+  slot.key = inode_key((uint64_t)entry->device, (uint64_t)entry->inode, (int64_t)entry->size, (int64_t)entry->mtime);
+  slot.entry = entry;
+  insert_hashdb_slot(itable, itable_size - 1, slot);
+  itable_count++;
+  return;
+}
 
-  fclose(db);
-  return linenum - 1;
 
-warn_hashdb_open:
-  fprintf(stderr, "Creating a new hash database '%s'\n", dbname);
-  new_hashdb = 1;
-  fclose(db);
+static int add_inode_node(hashdb_t *cur, void *arg)
+{
+  (void)arg;
+  add_inode_slot(cur);
   return 0;
-error_hashdb_read:
-  fprintf(stderr, "error reading hash database '%s': %s\n", dbname, strerror(errno));
-  fclose(db);
-  return -1;
-error_hashdb_header:
-  fprintf(stderr, "error in header of hash database '%s'\n", dbname);
-  fclose(db);
-  return -2;
-error_hashdb_version:
-  fprintf(stderr, "error: bad db version %u in hash database '%s'\n", db_ver, dbname);
-  fclose(db);
-  return -3;
-error_hashdb_line:
-  fprintf(stderr, "\nerror: bad line %" PRId64 " in hash database '%s':\n\n%s\n\n", linenum, dbname, line);
-  fclose(db);
-  return -4;
-error_hashdb_add:
-  fprintf(stderr, "error: internal failure allocating a hashdb entry\n");
-  fclose(db);
-  return -5;
-error_hashdb_null:
-  fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
-  return -6;
-warn_hashdb_algo:
-  fprintf(stderr, "warning: hashdb uses a different hash algorithm than selected; not loading\n");
-  fclose(db);
-  return -7;
 }
 
 
-static int get_path_hash(char *path, uint64_t *path_hash)
+static inline const struct hashdb3_record *mapped_record(const struct hashdb_map * const restrict m, const uint64_t recno)
 {
-  uint64_t aligned_path[(PATHBUF_SIZE + 8) / sizeof(uint64_t)];
-  int retval;
-
-  *path_hash = 0;
-  if ((uintptr_t)path & 0x0f) {
-    strncpy((char *)&aligned_path, path, PATHBUF_SIZE);
-    retval = jc_block_hash((uint64_t *)aligned_path, path_hash, strlen((char *)aligned_path));
-  } else retval = jc_block_hash((uint64_t *)path, path_hash, strlen(path));
-  return retval;
+  return (const struct hashdb3_record *)(const void *)(m->records + recno * m->record_size);
 }
 
 
-/* Scan database for a matching file entry; if found, load hashes into it */
-int read_hashdb_entry(file_t *file)
+/* File name of a mapped record and its directory, or NULL if the record
+ * points outside the heap. v3 records have no directory (dirlen = 0) and
+ * the "name" is the whole path. */
+static const char *mapped_name(const struct hashdb_map * const restrict m, const struct hashdb3_record * const restrict rec, const char ** const restrict dir, uint32_t * const restrict dirlen, size_t * const restrict namelen)
 {
-  unsigned int bucket;
-  hashdb_t *cur;
-  uint64_t path_hash;
-  int exclude;
-
-  LOUD(fprintf(stderr, "read_hashdb_entry('%s')\n", file->d_name);)
-  if (file == NULL || file->d_name == NULL) goto error_null;
-  if (get_path_hash(file->d_name, &path_hash) != 0) goto error_path_hash;
-  bucket = path_hash & HT_MASK;
-  if (hashdb[bucket] == NULL) return 0;
-  cur = hashdb[bucket];
-  while (1) {
-    if (cur->path_hash != path_hash) {
-      if (path_hash < cur->path_hash) cur = cur->left;
-      else cur = cur->right;
-      if (cur == NULL) return 0;
-      continue;
-    }
-    /* Found a matching path hash */
-    if (strcmp(cur->path, file->d_name) != 0) {
-      cur = cur->left;
-      if (cur == NULL) return 0;
-      continue;
-    } else {
-      /* Found a matching path too but check mtime */
-      exclude = 0;
-      if (cur->mtime != file->mtime) exclude |= 1;
-      if (cur->inode != file->inode) exclude |= 2;
-      if (cur->size  != file->size)  exclude |= 4;
-      if (exclude != 0) {
-        /* Invalidate if something has changed */
-        cur->hashcount = 0;
-        hashdb_dirty = 1;
-        return -1;
-      }
-      file->filehash_partial = cur->partialhash;
-      if (cur->hashcount == 2) {
-        file->filehash = cur->fullhash;
-        SETFLAG(file->flags, (FF_HASH_PARTIAL | FF_HASH_FULL));
-      } else SETFLAG(file->flags, FF_HASH_PARTIAL);
-      return 1;
-    }
+  const char *end;
+
+  *dir = NULL;
+  *dirlen = 0;
+  if (m->dirs == NULL) {
+    if (unlikely(rec->path_off >= m->heap_size || rec->path_len >= m->heap_size - rec->path_off)) return NULL;
+    if (unlikely(m->heap[rec->path_off + rec->path_len] != '\0')) return NULL;
+    *namelen = rec->path_len;
+    return m->heap + rec->path_off;
   }
-  return 0;
+  if (unlikely(rec->dir >= m->dir_count || rec->path_off >= m->heap_size)) return NULL;
+  end = (const char *)memchr(m->heap + rec->path_off, '\0', (size_t)(m->heap_size - rec->path_off));
+  if (unlikely(end == NULL)) return NULL;
+  *dir = m->heap + m->dirs[rec->dir].off;
+  *dirlen = m->dirs[rec->dir].len;
+  *namelen = (size_t)(end - (m->heap + rec->path_off));
+  return m->heap + rec->path_off;
+}
 
-error_null:
-  fprintf(stderr, "error: internal error: NULL data passed to read_hashdb_entry()\n");
-  return -255;
-error_path_hash:
-  fprintf(stderr, "error: internal error hashing a path\n");
-  return -255;
+
+/* Whole path of a mapped record, put together in buf (PATHBUF_SIZE + 1
+ * bytes) if it has a directory, or NULL if the record is damaged */
+static const char *mapped_path(const struct hashdb_map * const restrict m, const struct hashdb3_record * const restrict rec, char * const restrict buf)
+{
+  const char *dir, *name;
+  uint32_t dirlen;
+  size_t namelen;
+
+  name = mapped_name(m, rec, &dir, &dirlen, &namelen);
+  if (name == NULL || dirlen == 0) return name;
+  if (unlikely(dirlen + namelen > PATHBUF_SIZE)) return NULL;
+  memcpy(buf, dir, dirlen);
+  memcpy(buf + dirlen, name, namelen + 1);
+  return buf;
 }
 
 
-int cleanup_hashdb(uint64_t *cnt, hashdb_t *cur)
+/* Compare the path of a mapped record with a whole path */
+static int mapped_path_eq(const struct hashdb_map * const restrict m, const struct hashdb3_record * const restrict rec, const char * const restrict path)
 {
-  int err = 0;
-  static char **list;
-  static uint64_t listsize;
-  char *temp;
-  unsigned int i;
+  const char *dir, *name;
+  uint32_t dirlen;
+  size_t namelen;
 
-  /* First call: traverse array, sort results, do actual verification */
-  if (unlikely(cur == NULL)) {
-    list = NULL;
-    listsize = 0;
-    *cnt = 0;
+  name = mapped_name(m, rec, &dir, &dirlen, &namelen);
+  if (name == NULL) return 0;
+  return strncmp(dir == NULL ? "" : dir, path, dirlen) == 0 && strcmp(name, path + dirlen) == 0;
+}
 
-    for (i = 0; i < HT_SIZE; i++) {
-      if (hashdb[i] == NULL) continue;
-      err = cleanup_hashdb(cnt, hashdb[i]);
-      if (err != 0) return err;
+
+static const struct hashdb3_record *find_mapped_entry(const struct hashdb_map * const restrict m, const uint64_t path_hash, const char * const restrict path)
+{
+  const uint64_t mask = m->slots - 1;
+  uint64_t slot = path_hash & mask;
+
+  if (m->base == NULL) return NULL;
+  for (uint64_t probe = 0; probe < m->slots; probe++) {
+    const uint32_t recno = m->index[slot];
+    const struct hashdb3_record *rec;
+
+    if (recno == 0) return NULL;
+    if (likely(recno <= m->count)) {
+      rec = mapped_record(m, recno - 1);
+      if (rec->path_hash == path_hash && mapped_path_eq(m, rec, path)) return rec;
     }
+    slot = (slot + 1) & mask;
+  }
+  return NULL;
+}
 
-    /* TODO: sort list first */
 
-    /* Check each item for existence; remove if it can't be accessed */
-    for (i = 0; i < *cnt; i++) {
-      char *path = *(list + i);
-      if (jc_access(path, JC_F_OK) == 0) continue;
-      /* TODO: invalidate entry - maybe need pointer? */
-    }
+/* Map a whole file read-only, or read it into memory where mmap() is
+ * unavailable; an empty file gives a NULL base */
+static int map_hashdb_file(const char * const restrict dbname, const char ** const restrict base, size_t * const restrict size, int * const restrict mapped)
+{
+#ifndef ON_WINDOWS
+  struct stat st;
+  void *addr;
+  int fd, err;
 
-    return 0;
+  *base = NULL; *size = 0; *mapped = 0;
+  errno = 0;
+  fd = open(dbname, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) != 0) goto error_map;
+  if ((uint64_t)st.st_size > SIZE_MAX) {
+    errno = EFBIG;
+    goto error_map;
+  }
+  if (st.st_size > 0) {
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) goto error_map;
+    *base = (const char *)addr;
+    *size = (size_t)st.st_size;
+    *mapped = 1;
   }
+  close(fd);
+  return 0;
+
+error_map:
+  err = errno;
+  close(fd);
+  errno = err;
+  return -1;
+#else
+  FILE *db;
+  char *buf = NULL, *temp;
+  size_t alloc = 0, len = 0, got;
 
-  /* If node is valid, add file to list to be checked, expanding array as needed */
-  if (cur->hashcount != 0) {
-    if (listsize == *cnt) {
-      listsize += 4096;
-      list = realloc(list, sizeof(char *) * listsize);
-      if (list == NULL) jc_oom("cleanup_hashdb realloc");
+  *base = NULL; *size = 0; *mapped = 0;
+  errno = 0;
+  db = jc_fopen(dbname, JC_FILE_MODE_RDONLY_SEQ);
+  if (db == NULL) return -1;
+  do {
+    if (len == alloc) {
+      alloc = (alloc == 0) ? HASHDB3_IOBUF : alloc * 2;
+      temp = (char *)realloc(buf, alloc);
+      if (temp == NULL) jc_oom("map_hashdb_file()");
+      buf = temp;
     }
-    temp = (char *)malloc(strlen(cur->path) + 1);
-    if (temp == NULL) jc_oom("cleanup_hashdb path");
-    *(list + *cnt) = temp;
-    strcpy(temp, cur->path);
-    (void)*cnt++;
+    got = fread(buf + len, 1, alloc - len, db);
+    len += got;
+  } while (got > 0);
+  if (ferror(db) != 0) {
+    fclose(db);
+    free(buf);
+    return -1;
   }
+  fclose(db);
+  *base = buf;
+  *size = len;
+  return 0;
+#endif
+}
 
-  /* Traverse the tree, propagating errors */
-  if (err == 0 && cur->left != NULL) err = cleanup_hashdb(cnt, cur->left);
-  if (err == 0 && cur->right != NULL) err = cleanup_hashdb(cnt, cur->right);
-  return err;
+
+static void unmap_hashdb_file(const char * const restrict base, const size_t size, const int mapped)
+{
+  if (base == NULL) return;
+#ifndef ON_WINDOWS
+  if (mapped == 1) munmap((void *)(uintptr_t)base, size);
+  else
+#endif
+  free((void *)(uintptr_t)base);
+  (void)size; (void)mapped;
+  return;
+}
+
+
+static void unmap_hashdb(struct hashdb_map * const restrict m)
+{
+  unmap_hashdb_file(m->base, m->size, m->mapped);
+  memset(m, 0, sizeof(struct hashdb_map));
+  return;
+}
+
+
+/* Take the advisory lock that serializes writers of a database file; it
+ * lives in a lock file of its own that is never deleted. Readers never
+ * lock: database files are only replaced by rename() and journals only
+ * grow by whole records, so a reader always sees a consistent state. */
+static FILE *lock_hashdb_file(const char * const restrict name)
+{
+  FILE *lock;
+#ifndef ON_WINDOWS
+  struct flock fl;
+#endif
+
+  errno = 0;
+  lock = jc_fopen(name, JC_FILE_MODE_WRONLY_APPEND);
+  if (lock == NULL) return NULL;
+#ifndef ON_WINDOWS
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  while (fcntl(fileno(lock), F_SETLKW, &fl) != 0) {
+    if (errno == EINTR) continue;
+    fclose(lock);
+    return NULL;
+  }
+#else
+  /* _locking() gives up after ten seconds; keep waiting */
+  while (_locking(_fileno(lock), _LK_LOCK, 1) != 0) {
+    if (errno == EDEADLOCK) continue;
+    fclose(lock);
+    return NULL;
+  }
+#endif
+  return lock;
+}
+
+
+static void unlock_hashdb_file(FILE * const restrict lock)
+{
+#ifdef ON_WINDOWS
+  _locking(_fileno(lock), _LK_UNLCK, 1);
+#endif
+  /* Closing the file releases an fcntl() lock */
+  fclose(lock);
+  return;
+}
+
+
+/* Identify the file currently at name; a missing file is all zeroes */
+static void get_hashdb_fileid(const char * const restrict name, struct hashdb_fileid * const restrict id)
+{
+  struct JC_STAT st;
+
+  memset(id, 0, sizeof(struct hashdb_fileid));
+  if (jc_stat(name, &st) != 0) return;
+  id->dev = (uint64_t)st.st_dev;
+  id->ino = (uint64_t)st.st_ino;
+  id->size = (int64_t)st.st_size;
+  id->mtime = (int64_t)st.st_mtime;
+  return;
+}
+
+
+/* Length of the leading directories of a path that pick its shard */
+static size_t shard_prefix_len(const char * const restrict path, const size_t dirlen)
+{
+  unsigned int depth = 0;
+  size_t i = 0;
+
+  if (shard_dir == NULL) return 0;
+  /* A leading separator belongs to the first directory */
+  while (i < dirlen && is_path_sep(path[i])) i++;
+  for (; i < dirlen; i++) if (is_path_sep(path[i]) && ++depth == shard_depth) return i + 1;
+  return dirlen;
+}
+
+
+/* Binary search of the shards by prefix; *pos is where a missing one goes */
+static struct hashdb_shard *lookup_shard(const char * const restrict prefix, const size_t len, size_t * const restrict pos)
+{
+  size_t lo = 0, hi = shard_count;
+
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const struct hashdb_shard *cur = shards[mid];
+    int cmp = memcmp(cur->prefix, prefix, (cur->prefix_len < len) ? cur->prefix_len : len);
+
+    if (cmp == 0) cmp = (cur->prefix_len > len) - (cur->prefix_len < len);
+    if (cmp == 0) return shards[mid];
+    if (cmp < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  *pos = lo;
+  return NULL;
+}
+
+
+/* Add a shard at position pos; name is the file name for an ordinary
+ * database and NULL to name it after the number inside shard_dir */
+static struct hashdb_shard *add_shard(const char * const restrict name, const char * const restrict prefix, const size_t len, const uint32_t number, const size_t pos)
+{
+  struct hashdb_shard *shard;
+  size_t namelen;
+
+  if (shard_count == shard_alloc) {
+    shard_alloc = (shard_alloc == 0) ? 64 : shard_alloc * 2;
+    shards = (struct hashdb_shard **)realloc(shards, sizeof(struct hashdb_shard *) * shard_alloc);
+    if (shards == NULL) jc_oom("add_shard()");
+  }
+  shard = (struct hashdb_shard *)calloc(1, sizeof(struct hashdb_shard));
+  if (shard == NULL) jc_oom("add_shard()");
+  namelen = (name != NULL) ? strlen(name) : strlen(shard_dir) + 12;
+  shard->name = (char *)malloc(namelen + 1);
+  shard->journal_name = (char *)malloc(namelen + sizeof(HASHDB_JOURNAL_SUFFIX));
+  shard->lock_name = (char *)malloc(namelen + sizeof(HASHDB_LOCK_SUFFIX));
+  shard->prefix = (char *)malloc(len + 1);
+  if (shard->name == NULL || shard->journal_name == NULL || shard->lock_name == NULL || shard->prefix == NULL) jc_oom("add_shard()");
+  if (name != NULL) strcpy(shard->name, name);
+  else snprintf(shard->name, namelen + 1, "%s/%08" PRIx32 ".db", shard_dir, number);
+  strcpy(shard->journal_name, shard->name);
+  strcat(shard->journal_name, HASHDB_JOURNAL_SUFFIX);
+  strcpy(shard->lock_name, shard->name);
+  strcat(shard->lock_name, HASHDB_LOCK_SUFFIX);
+  memcpy(shard->prefix, prefix, len);
+  shard->prefix[len] = '\0';
+  shard->prefix_len = len;
+  shard->number = number;
+  if (number >= shard_next) shard_next = number + 1;
+
+  memmove(&shards[pos + 1], &shards[pos], sizeof(struct hashdb_shard *) * (shard_count - pos));
+  shards[pos] = shard;
+  shard_count++;
+  return shard;
+}
+
+
+/* Name of a file next to the manifest of a sharded database */
+static char *manifest_file_name(const char * const restrict suffix)
+{
+  const size_t len = strlen(shard_dir) + sizeof(HASHDB_MANIFEST) + strlen(suffix) + 1;
+  char *name = (char *)malloc(len);
+
+  if (name == NULL) jc_oom("manifest_file_name()");
+  snprintf(name, len, "%s/%s%s", shard_dir, HASHDB_MANIFEST, suffix);
+  return name;
+}
+
+
+/* Write the list of shards of a sharded database; the caller holds the
+ * manifest lock */
+static int write_hashdb_manifest(void)
+{
+  FILE *mf;
+  char *name, *temp;
+  int err = 1;
+
+  name = manifest_file_name("");
+  temp = manifest_file_name(".tmp");
+  jc_remove(temp);
+  errno = 0;
+  mf = jc_fopen(temp, JC_FILE_MODE_WRONLY);
+  if (mf == NULL) goto error_manifest;
+  fprintf(mf, HASHDB_MANIFEST_MAGIC ",%u,%d\n", shard_depth, hash_algo);
+  for (size_t i = 0; i < shard_count; i++) fprintf(mf, "%08" PRIx32 ",%s\n", shards[i]->number, shards[i]->prefix);
+  if (fflush(mf) != 0) goto error_manifest;
+#ifdef ON_WINDOWS
+  if (_commit(_fileno(mf)) != 0) goto error_manifest;
+#else
+  if (fsync(fileno(mf)) != 0) goto error_manifest;
+#endif
+  if (fclose(mf) != 0) {
+    mf = NULL;
+    goto error_manifest;
+  }
+  mf = NULL;
+#ifdef ON_WINDOWS
+  jc_remove(name);
+#endif
+  if (jc_rename(temp, name) != 0) goto error_manifest;
+  err = 0;
+error_manifest:
+  if (err != 0) fprintf(stderr, "error: cannot write hash database manifest '%s': %s\n", name, strerror(errno));
+  if (mf != NULL) fclose(mf);
+  free(name);
+  free(temp);
+  return err;
+}
+
+
+/* Add the shards listed in the manifest that are not known yet; other
+ * processes may have added some since it was last read.
+ * Returns 1 if there is no manifest yet. */
+static int read_hashdb_manifest(void)
+{
+  FILE *mf;
+  char buf[PATHBUF_SIZE + 32];
+  char *name, *prefix;
+  unsigned long depth, algo;
+  size_t pos = 0;
+
+  name = manifest_file_name("");
+  errno = 0;
+  mf = jc_fopen(name, JC_FILE_MODE_RDONLY_SEQ);
+  if (mf == NULL) {
+    free(name);
+    if (errno != ENOENT) goto error_manifest_read;
+    return 1;
+  }
+  if (fgets(buf, sizeof(buf), mf) == NULL) goto error_manifest_format;
+  if (strncmp(buf, HASHDB_MANIFEST_MAGIC ",", sizeof(HASHDB_MANIFEST_MAGIC)) != 0) goto error_manifest_format;
+  if (sscanf(buf + sizeof(HASHDB_MANIFEST_MAGIC), "%lu,%lu", &depth, &algo) != 2 || depth == 0) goto error_manifest_format;
+  if (algo != (unsigned long)hash_algo) goto warn_manifest_algo;
+  shard_depth = (unsigned int)depth;
+  while (fgets(buf, sizeof(buf), mf) != NULL) {
+    size_t plen;
+    uint32_t number;
+
+    number = (uint32_t)strtoul(buf, &prefix, 16);
+    if (*prefix != ',' || number == 0) goto error_manifest_format;
+    prefix++;
+    plen = strlen(prefix);
+    if (plen == 0 || prefix[plen - 1] != '\n') goto error_manifest_format;
+    prefix[--plen] = '\0';
+    if (lookup_shard(prefix, plen, &pos) == NULL) add_shard(NULL, prefix, plen, number, pos);
+  }
+  if (ferror(mf) != 0) goto error_manifest_read;
+  LOUD(fprintf(stderr, "read_hashdb_manifest('%s'): %zu shards, depth %u\n", name, shard_count, shard_depth);)
+  fclose(mf);
+  free(name);
+  return 0;
+
+error_manifest_read:
+  fprintf(stderr, "error reading hash database manifest in '%s': %s\n", shard_dir, strerror(errno));
+  if (mf != NULL) fclose(mf);
+  free(name);
+  return -1;
+error_manifest_format:
+  fprintf(stderr, "error: hash database manifest '%s' is corrupted\n", name);
+  fclose(mf);
+  free(name);
+  return -2;
+warn_manifest_algo:
+  fprintf(stderr, "warning: hashdb uses a different hash algorithm than selected; not loading\n");
+  fclose(mf);
+  free(name);
+  return -7;
+}
+
+
+/* Add a shard for a new prefix. Other processes add shards too, so this
+ * reads the manifest again and writes it back under the manifest lock. */
+static struct hashdb_shard *create_shard(const char * const restrict prefix, const size_t len)
+{
+  struct hashdb_shard *shard = NULL;
+  FILE *lock;
+  char *lock_name, *test;
+  const size_t testlen = strlen(shard_dir) + 12 + sizeof(HASHDB_JOURNAL_SUFFIX);
+  size_t pos = 0;
+
+  lock_name = manifest_file_name(HASHDB_LOCK_SUFFIX);
+  test = (char *)malloc(testlen);
+  if (test == NULL) jc_oom("create_shard()");
+  lock = lock_hashdb_file(lock_name);
+  if (lock == NULL) {
+    fprintf(stderr, "error: cannot lock hash database manifest '%s': %s\n", lock_name, strerror(errno));
+    goto finish;
+  }
+  if (read_hashdb_manifest() < 0) goto finish;
+  shard = lookup_shard(prefix, len, &pos);
+  if (shard != NULL) goto finish;
+  /* Skip numbers whose files were left behind without a manifest entry */
+  for (;; shard_next++) {
+    snprintf(test, testlen, "%s/%08" PRIx32 ".db", shard_dir, shard_next);
+    if (jc_access(test, JC_F_OK) == 0) continue;
+    strcat(test, HASHDB_JOURNAL_SUFFIX);
+    if (jc_access(test, JC_F_OK) != 0) break;
+  }
+  LOUD(fprintf(stderr, "create_shard: new shard %08" PRIx32 " for '%.*s'\n", shard_next, (int)len, prefix);)
+  shard = add_shard(NULL, prefix, len, shard_next, pos);
+  shard->state = 1;
+  if (write_hashdb_manifest() != 0) shard->state = -1;
+finish:
+  if (lock != NULL) unlock_hashdb_file(lock);
+  free(lock_name);
+  free(test);
+  return shard;
+}
+
+
+/* The loaded shard for a path with a directory part of dirlen bytes,
+ * loading it first if needed. create = 1 adds a shard for a new prefix.
+ * NULL if there is no such shard or it could not be loaded. */
+static struct hashdb_shard *path_shard(const char * const restrict path, const size_t dirlen, const int create)
+{
+  const size_t len = shard_prefix_len(path, dirlen);
+  struct hashdb_shard *shard;
+  size_t pos = 0;
+
+  shard = lookup_shard(path, len, &pos);
+  if (shard == NULL) {
+    if (create == 0 || shard_dir == NULL) return NULL;
+    shard = create_shard(path, len);
+    if (shard == NULL) return NULL;
+  }
+  if (shard->state == 0 && load_shard(shard) < 0) {
+    fprintf(stderr, "warning: ignoring unusable hash database shard '%s'\n", shard->name);
+    shard->state = -1;
+  }
+  return (shard->state == 1) ? shard : NULL;
+}
+
+
+/* The shard an entry is saved in; its directory remembers it */
+static struct hashdb_shard *entry_shard(const hashdb_t * const restrict entry)
+{
+  struct hashdb_dir * const dir = entry->dir;
+
+  if (dir->shard == NULL) dir->shard = path_shard(dir->path, dir->len, 1);
+  return dir->shard;
+}
+
+
+static int resolve_entry_shard(hashdb_t *cur, void *arg)
+{
+  (void)arg;
+  entry_shard(cur);
+  return 0;
+}
+
+
+/* A shard overlaps a root if either one lies inside the other */
+static int shard_in_root(const struct hashdb_shard * const restrict shard, const char * const restrict root)
+{
+  size_t len = strlen(root), i;
+
+  while (len > 0 && is_path_sep(root[len - 1])) len--;
+  for (i = 0; i < len && i < shard->prefix_len; i++) if (root[i] != shard->prefix[i]) return 0;
+  /* The root continues past the prefix, or the prefix continues into the root */
+  if (i == shard->prefix_len) return 1;
+  return is_path_sep(shard->prefix[i]);
+}
+
+
+/* Load the shards overlapping the command line roots so that files moved
+ * out of a directory that is gone can still be found by inode */
+static int64_t load_root_shards(void)
+{
+  int64_t count = 0, loaded;
+
+  for (size_t i = 0; i < shard_count; i++) {
+    if (shards[i]->state != 0) continue;
+    for (int r = 0; r < load_root_cnt; r++) {
+      if (shard_in_root(shards[i], load_roots[r]) == 0) continue;
+      loaded = load_shard(shards[i]);
+      if (loaded < 0) {
+        fprintf(stderr, "warning: ignoring unusable hash database shard '%s'\n", shards[i]->name);
+        shards[i]->state = -1;
+      } else count += loaded;
+      break;
+    }
+  }
+  return count;
+}
+
+
+/* Load every shard, for actions that work on the whole database */
+static void load_all_shards(void)
+{
+  for (size_t i = 0; i < shard_count; i++) {
+    if (shards[i]->state != 0) continue;
+    if (load_shard(shards[i]) < 0) {
+      fprintf(stderr, "warning: ignoring unusable hash database shard '%s'\n", shards[i]->name);
+      shards[i]->state = -1;
+    }
+  }
+  return;
+}
+
+
+static hashdb_t *find_hashdb_node(const uint64_t path_hash, const char * const restrict path)
+{
+  uint64_t mask, slot;
+
+  if (table == NULL) return NULL;
+  mask = table_size - 1;
+  slot = path_hash & mask;
+  /* Robin Hood order: stop at the first entry closer to home than we are */
+  for (uint64_t dist = 0; table[slot].entry != NULL; dist++) {
+    if (((slot - (table[slot].key & mask)) & mask) < dist) break;
+    if (table[slot].key == path_hash && hashdb_path_eq(table[slot].entry, path)) return table[slot].entry;
+    slot = (slot + 1) & mask;
+  }
+  return NULL;
+}
+
+
+/* Call func for every in-memory entry in the order they were added */
+static int walk_hashdb(int (*func)(hashdb_t *, void *), void *arg)
+{
+  int err;
+
+  for (struct hashdb_slab *slab = mem.slab_head; slab != NULL; slab = slab->next) {
+    for (unsigned int i = 0; i < slab->used; i++) {
+      err = func(&slab->entries[i], arg);
+      if (err != 0) return err;
+    }
+  }
+  return 0;
+}
+
+
+static void node_to_record(const hashdb_t * const restrict node, struct hashdb3_record * const restrict rec)
+{
+  memset(rec, 0, sizeof(struct hashdb3_record));
+  rec->path_hash = node->path_hash;
+  rec->partialhash = node->partialhash;
+  if (node->hashcount == 2) rec->fullhash = node->fullhash;
+  rec->mtime = (int64_t)node->mtime;
+  rec->size = (int64_t)node->size;
+  rec->inode = (uint64_t)node->inode;
+  rec->hashcount = (uint8_t)node->hashcount;
+  rec->device = (uint64_t)node->device;
+  return;
+}
+
+
+/* Mapped records that are valid and not shadowed by a table entry; the
+ * returned bitmap must be freed by the caller */
+static uint8_t *live_mapped_records(const struct hashdb_map * const restrict m, uint64_t * const restrict count)
+{
+  char buf[PATHBUF_SIZE + 1];
+  uint8_t *live;
+
+  live = (uint8_t *)calloc(1, (size_t)((m->count + 7) / 8) + 1);
+  if (live == NULL) jc_oom("live_mapped_records()");
+  for (uint64_t i = 0; i < m->count; i++) {
+    const struct hashdb3_record *rec = mapped_record(m, i);
+    const char *path = mapped_path(m, rec, buf);
+
+    if (path == NULL || rec->hashcount < 1 || rec->hashcount > 2) continue;
+    if (find_hashdb_node(rec->path_hash, path) != NULL) continue;
+    live[i >> 3] |= (uint8_t)(1U << (i & 7));
+    (*count)++;
+  }
+  return live;
+}
+
+
+/* Number a directory for the file being written when it is first used */
+static void add_writer_dir(struct hashdb3_writer * const restrict w, struct hashdb_dir * const restrict d)
+{
+  if (d->id < w->dir_count && w->dirs[d->id] == d) return;
+  if (w->dir_count == w->dir_alloc) {
+    w->dir_alloc = (w->dir_alloc == 0) ? 1024 : w->dir_alloc * 2;
+    w->dirs = (struct hashdb_dir **)realloc(w->dirs, sizeof(struct hashdb_dir *) * (size_t)w->dir_alloc);
+    if (w->dirs == NULL) jc_oom("add_writer_dir()");
+  }
+  d->id = (uint32_t)w->dir_count;
+  w->dirs[w->dir_count++] = d;
+  w->dir_size += d->len;
+  return;
+}
+
+
+/* Shared directory, file name and name length of a live mapped record;
+ * v3 paths are split here, v4 directories are looked up once each */
+static struct hashdb_dir *mapped_record_dir(struct hashdb3_writer * const restrict w, const struct hashdb3_record * const restrict rec, const char ** const restrict name, size_t * const restrict namelen)
+{
+  struct hashdb_dir *d;
+  const char *dir;
+  uint32_t dirlen;
+
+  *name = mapped_name(&w->shard->map, rec, &dir, &dirlen, namelen);
+  if (dir != NULL) {
+    if (w->dir_map[rec->dir] == NULL) w->dir_map[rec->dir] = intern_hashdb_dir(&mem, dir, dirlen);
+    d = w->dir_map[rec->dir];
+  } else {
+    dirlen = (uint32_t)path_dir_len(*name, *namelen);
+    d = intern_hashdb_dir(&mem, *name, dirlen);
+    *name += dirlen;
+    *namelen -= dirlen;
+  }
+  if (d == NULL) jc_oom("mapped_record_dir()");
+  return d;
+}
+
+
+static int count_hashdb_node(hashdb_t *cur, void *arg)
+{
+  struct hashdb3_writer *w = (struct hashdb3_writer *)arg;
+
+  if (cur->hashcount == 0 || cur->dir->shard != w->shard) return 0;
+  w->count++;
+  add_writer_dir(w, cur->dir);
+  w->name_size += strlen(cur->name) + 1;
+  return 0;
+}
+
+
+/* Write one record and enter it into the index; the heap holds all of
+ * the directories first and then the file names */
+static int write_hashdb3_record(struct hashdb3_writer * const restrict w, struct hashdb3_record * const restrict rec, const struct hashdb_dir * const restrict dir, const size_t namelen)
+{
+  uint64_t slot = rec->path_hash & w->mask;
+
+  rec->dir = dir->id;
+  rec->path_off = w->dir_size + w->name_size;
+  w->name_size += namelen + 1;
+  while (w->index[slot] != 0) slot = (slot + 1) & w->mask;
+  w->index[slot] = (uint32_t)(++w->count);
+  if (rec->device != 0) {
+    slot = inode_key(rec->device, rec->inode, rec->size, rec->mtime) & w->mask;
+    while (w->inode_index[slot] != 0) slot = (slot + 1) & w->mask;
+    w->inode_index[slot] = (uint32_t)w->count;
+  }
+  errno = 0;
+  if (fwrite(rec, sizeof(struct hashdb3_record), 1, w->db) != 1) return 1;
+  return 0;
+}
+
+
+static int write_hashdb_node_record(hashdb_t *cur, void *arg)
+{
+  struct hashdb3_record rec;
+
+  if (cur->hashcount == 0 || cur->dir->shard != ((struct hashdb3_writer *)arg)->shard) return 0;
+  node_to_record(cur, &rec);
+  return write_hashdb3_record((struct hashdb3_writer *)arg, &rec, cur->dir, strlen(cur->name));
+}
+
+
+static int write_hashdb_node_name(hashdb_t *cur, void *arg)
+{
+  struct hashdb3_writer *w = (struct hashdb3_writer *)arg;
+
+  if (cur->hashcount == 0 || cur->dir->shard != w->shard) return 0;
+  errno = 0;
+  if (fwrite(cur->name, strlen(cur->name) + 1, 1, w->db) != 1) return 1;
+  return 0;
+}
+
+
+/* Write the mapped records of a shard that are still live followed by
+ * its table entries; the records and the file names are written in the
+ * same order */
+static int write_hashdb3(struct hashdb_shard * const restrict shard, FILE *db, uint64_t *cnt)
+{
+  const struct hashdb_map * const m = &shard->map;
+  struct hashdb3_header hdr;
+  struct hashdb3_writer w;
+  struct timeval tm;
+  uint8_t *live = NULL;
+  uint64_t slots = 16, off = 0;
+  const char *name;
+  size_t namelen;
+  int err = 1;
+
+  memset(&w, 0, sizeof(w));
+  w.db = db;
+  w.shard = shard;
+  if (m->base != NULL) {
+    live = live_mapped_records(m, &w.count);
+    if (m->dirs != NULL) {
+      w.dir_map = (struct hashdb_dir **)calloc((size_t)m->dir_count + 1, sizeof(struct hashdb_dir *));
+      if (w.dir_map == NULL) jc_oom("write_hashdb3()");
+    }
+    for (uint64_t i = 0; i < m->count; i++) {
+      const struct hashdb3_record *rec = mapped_record(m, i);
+      struct hashdb_dir *d;
+
+      if (!(live[i >> 3] & (1U << (i & 7)))) continue;
+      d = mapped_record_dir(&w, rec, &name, &namelen);
+      add_writer_dir(&w, d);
+      w.name_size += namelen + 1;
+    }
+  }
+  walk_hashdb(count_hashdb_node, &w);
+  if (w.count >= UINT32_MAX) goto error_too_big;
+  while (slots < w.count * 2) slots <<= 1;
+
+  gettimeofday(&tm, NULL);
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, HASHDB4_MAGIC, sizeof(hdr.magic));
+  hdr.byte_order = HASHDB3_BYTE_ORDER;
+  hdr.hash_algo = (uint32_t)hash_algo;
+  hdr.record_size = sizeof(struct hashdb3_record);
+  get_path_hash(path_check_str, &hdr.path_check);
+  hdr.mtime = (uint64_t)tm.tv_sec;
+  hdr.count = w.count;
+  hdr.index_slots = slots;
+  hdr.records_off = sizeof(struct hashdb3_header);
+  hdr.index_off = hdr.records_off + w.count * sizeof(struct hashdb3_record);
+  hdr.inode_index_off = hdr.index_off + slots * sizeof(uint32_t);
+  hdr.dirs_off = hdr.inode_index_off + slots * sizeof(uint32_t);
+  hdr.dir_count = w.dir_count;
+  hdr.heap_off = hdr.dirs_off + w.dir_count * sizeof(struct hashdb4_dir);
+  hdr.heap_size = w.dir_size + w.name_size;
+  LOUD(fprintf(stderr, "write_hashdb3: %" PRIu64 " records, %" PRIu64 " index slots, %" PRIu64 " directories, %" PRIu64 " heap bytes\n", w.count, slots, w.dir_count, hdr.heap_size);)
+
+  w.index = (uint32_t *)calloc((size_t)slots, sizeof(uint32_t));
+  w.inode_index = (uint32_t *)calloc((size_t)slots, sizeof(uint32_t));
+  if (w.index == NULL || w.inode_index == NULL) jc_oom("write_hashdb3()");
+  w.mask = slots - 1;
+  w.count = 0;
+  w.name_size = 0;
+  setvbuf(db, NULL, _IOFBF, HASHDB3_IOBUF);
+  errno = 0;
+  if (fwrite(&hdr, sizeof(hdr), 1, db) != 1) goto error_write;
+
+  /* Records */
+  for (uint64_t i = 0; i < m->count; i++) {
+    struct hashdb3_record rec;
+    const struct hashdb_dir *d;
+
+    if (!(live[i >> 3] & (1U << (i & 7)))) continue;
+    d = mapped_record_dir(&w, mapped_record(m, i), &name, &namelen);
+    memset(&rec, 0, sizeof(rec));
+    memcpy(&rec, mapped_record(m, i), (m->record_size < sizeof(rec)) ? m->record_size : sizeof(rec));
+    memset(rec.reserved, 0, sizeof(rec.reserved));
+    if (write_hashdb3_record(&w, &rec, d, namelen) != 0) goto error_write;
+  }
+  if (walk_hashdb(write_hashdb_node_record, &w) != 0) goto error_write;
+
+  /* Indexes */
+  errno = 0;
+  if (fwrite(w.index, sizeof(uint32_t), (size_t)slots, db) != (size_t)slots) goto error_write;
+  if (fwrite(w.inode_index, sizeof(uint32_t), (size_t)slots, db) != (size_t)slots) goto error_write;
+
+  /* Directory table */
+  for (uint64_t i = 0; i < w.dir_count; i++) {
+    struct hashdb4_dir dir;
+
+    memset(&dir, 0, sizeof(dir));
+    dir.off = off;
+    dir.len = w.dirs[i]->len;
+    off += dir.len;
+    errno = 0;
+    if (fwrite(&dir, sizeof(dir), 1, db) != 1) goto error_write;
+  }
+
+  /* Heap */
+  for (uint64_t i = 0; i < w.dir_count; i++) {
+    errno = 0;
+    if (w.dirs[i]->len != 0 && fwrite(w.dirs[i]->path, w.dirs[i]->len, 1, db) != 1) goto error_write;
+  }
+  for (uint64_t i = 0; i < m->count; i++) {
+    if (!(live[i >> 3] & (1U << (i & 7)))) continue;
+    mapped_record_dir(&w, mapped_record(m, i), &name, &namelen);
+    errno = 0;
+    if (fwrite(name, namelen + 1, 1, db) != 1) goto error_write;
+  }
+  if (walk_hashdb(write_hashdb_node_name, &w) != 0) goto error_write;
+
+  *cnt += w.count;
+  err = 0;
+error_write:
+  free(w.index);
+  free(w.inode_index);
+  free(w.dirs);
+  free(w.dir_map);
+  free(live);
+  return err;
+error_too_big:
+  fprintf(stderr, "error: too many entries for one hash database\n");
+  free(w.dirs);
+  free(w.dir_map);
+  free(live);
+  errno = EFBIG;
+  return 1;
+}
+
+
+static void destroy_hashdb(void)
+{
+  free_hashdb_mem(&mem);
+  free(table);
+  table = NULL;
+  free(itable);
+  itable = NULL;
+  itable_size = 0;
+  itable_count = 0;
+  itable_built = 0;
+  table_size = 0;
+  table_count = 0;
+  checkpoint_due = 0;
+  for (size_t i = 0; i < shard_count; i++) {
+    unmap_hashdb(&shards[i]->map);
+    free(shards[i]->name);
+    free(shards[i]->journal_name);
+    free(shards[i]->lock_name);
+    free(shards[i]->jbuf);
+    free(shards[i]->prefix);
+    free(shards[i]);
+  }
+  free(shards);
+  shards = NULL;
+  shard_count = 0;
+  shard_alloc = 0;
+  shard_next = 1;
+  free(shard_dir);
+  shard_dir = NULL;
+  return;
+}
+
+
+static uint64_t journal_checksum(const void * const restrict data, size_t len, uint64_t sum)
+{
+  const unsigned char *p = (const unsigned char *)data;
+
+  /* FNV-1a; it must not depend on the hash algorithm chosen for files */
+  while (len-- > 0) {
+    sum ^= *p++;
+    sum *= 0x100000001b3ULL;
+  }
+  return sum;
+}
+
+
+static uint64_t journal_record_checksum(const struct hashdb_journal_record * const restrict rec, const char * const restrict path, const size_t recsize)
+{
+  uint64_t sum = 0xcbf29ce484222325ULL;
+
+  sum = journal_checksum((const char *)rec + sizeof(rec->checksum), recsize - sizeof(rec->checksum), sum);
+  return journal_checksum(path, rec->path_len, sum);
+}
+
+
+/* Make everything appended so far durable */
+static int sync_hashdb_journal(FILE * const restrict j)
+{
+  if (fflush(j) != 0) return 1;
+#ifdef ON_WINDOWS
+  if (_commit(_fileno(j)) != 0) return 1;
+#else
+  if (fsync(fileno(j)) != 0) return 1;
+#endif
+  return 0;
+}
+
+
+static int truncate_hashdb_journal(FILE * const restrict j, const uint64_t size)
+{
+  if (fflush(j) != 0) return 1;
+#ifdef ON_WINDOWS
+  if (_chsize_s(_fileno(j), (__int64)size) != 0) return 1;
+#else
+  if (ftruncate(fileno(j), (off_t)size) != 0) return 1;
+#endif
+  return 0;
+}
+
+
+/* Start a new journal; the caller holds the lock */
+static FILE *create_hashdb_journal(struct hashdb_shard * const restrict shard)
+{
+  struct hashdb_journal_header jh;
+  FILE *j;
+
+  errno = 0;
+  j = jc_fopen(shard->journal_name, JC_FILE_MODE_RW_SEQ);
+  if (j == NULL) return NULL;
+  memset(&jh, 0, sizeof(jh));
+  memcpy(jh.magic, HASHDB_JOURNAL_MAGIC, sizeof(jh.magic));
+  jh.byte_order = HASHDB3_BYTE_ORDER;
+  jh.hash_algo = (uint32_t)hash_algo;
+  if (fwrite(&jh, sizeof(jh), 1, j) != 1) {
+    fclose(j);
+    return NULL;
+  }
+  shard->journal_seen = sizeof(jh);
+  shard->journal_size = sizeof(jh);
+  shard->journal_recsize = sizeof(struct hashdb_journal_record);
+  return j;
+}
+
+
+/* Stop journaling and rewrite the whole shard at the end instead */
+static void fail_hashdb_journal(struct hashdb_shard * const restrict shard)
+{
+  fprintf(stderr, "warning: cannot write hash database journal '%s': %s\n", shard->journal_name, strerror(errno));
+  fprintf(stderr, "         the whole hash database will be rewritten when jdupes exits\n");
+  shard->journal_failed = 1;
+  shard->rewrite = 1;
+  shard->jbuf_len = 0;
+  return;
+}
+
+
+static void apply_journal_record(struct hashdb_shard * const restrict shard, const struct hashdb_journal_record * const restrict rec, const char * const restrict path, const uint64_t path_hash)
+{
+  hashdb_t *entry;
+
+  entry = find_hashdb_node(path_hash, path);
+  if (entry == NULL) entry = new_hashdb_node(path, (int)rec->path_len, path_hash);
+  if (entry == NULL) jc_oom("apply_journal_record()");
+  entry->dir->shard = shard;
+  entry->mtime = (time_t)rec->mtime;
+  entry->inode = (jdupes_ino_t)rec->inode;
+  entry->device = (dev_t)rec->device;
+  entry->size = (off_t)rec->size;
+  entry->partialhash = rec->partialhash;
+  entry->fullhash = rec->fullhash;
+  entry->hashcount = rec->hashcount;
+  /* Shards can be loaded after moved files were first looked for */
+  if (itable_built == 1) add_inode_slot(entry);
+  return;
+}
+
+
+/* Apply the journal records past journal_seen. Writers append whole
+ * records under the lock, so a torn record at the end is left over from
+ * a crash and is cut off if the lock is held; without the lock it may be
+ * a record being written right now and reading just stops there.
+ * Returns the number of records, -1 on error or -2 for a journal that
+ * cannot be used. */
+static int64_t read_hashdb_journal(struct hashdb_shard * const restrict shard, FILE * const restrict j, const int locked)
+{
+  struct hashdb_journal_header jh;
+  struct hashdb_journal_record rec;
+  char path[PATHBUF_SIZE + 1];
+  int64_t replayed = 0, end;
+  size_t got = 0, recsize;
+
+  errno = 0;
+  if (fseek(j, 0, SEEK_END) != 0 || (end = ftell(j)) < 0) goto error_journal_read;
+  /* A journal shorter than what was read is not the same journal */
+  if ((uint64_t)end < shard->journal_seen) shard->journal_seen = 0;
+  if (shard->journal_seen == 0) {
+    rewind(j);
+    if (fread(&jh, sizeof(jh), 1, j) != 1) {
+      if (ferror(j) != 0) goto error_journal_read;
+      /* Another process may be creating it right now */
+      return (locked == 1) ? -2 : 0;
+    }
+    if (memcmp(jh.magic, HASHDB_JOURNAL_MAGIC_V1, sizeof(jh.magic)) == 0) shard->journal_recsize = offsetof(struct hashdb_journal_record, device);
+    else if (memcmp(jh.magic, HASHDB_JOURNAL_MAGIC, sizeof(jh.magic)) == 0) shard->journal_recsize = sizeof(rec);
+    else return -2;
+    if (jh.byte_order != HASHDB3_BYTE_ORDER || jh.hash_algo != (uint32_t)hash_algo) return -2;
+    shard->journal_seen = sizeof(jh);
+  } else if (fseek(j, (long)shard->journal_seen, SEEK_SET) != 0) goto error_journal_read;
+
+  recsize = shard->journal_recsize;
+  while (1) {
+    uint64_t path_hash;
+
+    memset(&rec, 0, sizeof(rec));
+    got = fread(&rec, 1, recsize, j);
+    if (got != recsize) break;
+    if (rec.path_len == 0 || rec.path_len > PATHBUF_SIZE || rec.hashcount > 2) break;
+    if (fread(path, rec.path_len, 1, j) != 1) break;
+    if (journal_record_checksum(&rec, path, recsize) != rec.checksum) break;
+    path[rec.path_len] = '\0';
+    if (get_path_hash(path, &path_hash) != 0) break;
+    apply_journal_record(shard, &rec, path, path_hash);
+    shard->journal_seen += recsize + rec.path_len;
+    replayed++;
+  }
+  if (ferror(j) != 0) goto error_journal_read;
+  if (got != 0 || feof(j) == 0) {
+    if (locked == 1) {
+      fprintf(stderr, "warning: discarding an incomplete record at the end of hash database journal '%s'\n", shard->journal_name);
+      if (truncate_hashdb_journal(j, shard->journal_seen) != 0) goto error_journal_read;
+    }
+    LOUD(if (locked == 0) fprintf(stderr, "read_hashdb_journal: stopped at a partial record in '%s'\n", shard->journal_name);)
+  }
+  shard->journal_size = shard->journal_seen;
+  LOUD(fprintf(stderr, "read_hashdb_journal: %" PRId64 " records, %" PRIu64 " bytes\n", replayed, shard->journal_seen);)
+  return replayed;
+
+error_journal_read:
+  fprintf(stderr, "error reading hash database journal '%s': %s\n", shard->journal_name, strerror(errno));
+  return -1;
+}
+
+
+/* Queue a change to an in-memory entry for its shard's journal */
+static void hashdb_changed(hashdb_t * const restrict entry)
+{
+  struct hashdb_journal_record rec;
+  struct hashdb_shard *shard;
+  char path[PATHBUF_SIZE + 1];
+
+  if (itable_built == 1) add_inode_slot(entry);
+  shard = entry_shard(entry);
+  if (shard == NULL) return;
+  shard->dirty = 1;
+  if (shard->journal_failed == 1) return;
+  memset(&rec, 0, sizeof(rec));
+  rec.partialhash = entry->partialhash;
+  if (entry->hashcount == 2) rec.fullhash = entry->fullhash;
+  rec.mtime = (int64_t)entry->mtime;
+  rec.size = (int64_t)entry->size;
+  rec.inode = (uint64_t)entry->inode;
+  rec.path_len = (uint32_t)hashdb_entry_path(entry, path);
+  rec.hashcount = (uint8_t)entry->hashcount;
+  rec.device = (uint64_t)entry->device;
+  rec.checksum = journal_record_checksum(&rec, path, sizeof(rec));
+  if (shard->jbuf_len + sizeof(rec) + rec.path_len > shard->jbuf_alloc) {
+    shard->jbuf_alloc = (shard->jbuf_alloc == 0) ? 65536 : shard->jbuf_alloc * 2;
+    shard->jbuf = (char *)realloc(shard->jbuf, shard->jbuf_alloc);
+    if (shard->jbuf == NULL) jc_oom("hashdb_changed()");
+  }
+  memcpy(shard->jbuf + shard->jbuf_len, &rec, sizeof(rec));
+  memcpy(shard->jbuf + shard->jbuf_len + sizeof(rec), path, rec.path_len);
+  shard->jbuf_len += sizeof(rec) + rec.path_len;
+  if (++shard->journal_pending >= HASHDB_CHECKPOINT_ENTRIES || time(NULL) - shard->journal_synced >= HASHDB_CHECKPOINT_SECS) checkpoint_due = 1;
+  return;
+}
+
+
+/* Append queued changes to the journals. A checkpoint can reload shards
+ * and drop their entries, so it only runs before an entry is looked up
+ * and never while a caller holds one. */
+static void run_hashdb_checkpoints(void)
+{
+  if (checkpoint_due == 0) return;
+  checkpoint_due = 0;
+  for (size_t i = 0; i < shard_count; i++) {
+    if (shards[i]->state != 1 || shards[i]->jbuf_len == 0) continue;
+    LOUD(fprintf(stderr, "hashdb journal checkpoint: '%s' %zu bytes\n", shards[i]->name, shards[i]->jbuf_len);)
+    sync_hashdb_shard(shards[i], NULL);
+  }
+  return;
+}
+
+
+/* Apply the queued changes again after records from other processes */
+static void reapply_hashdb_jbuf(struct hashdb_shard * const restrict shard)
+{
+  struct hashdb_journal_record rec;
+  char path[PATHBUF_SIZE + 1];
+
+  for (size_t off = 0; off < shard->jbuf_len; off += sizeof(rec) + rec.path_len) {
+    uint64_t path_hash;
+
+    memcpy(&rec, shard->jbuf + off, sizeof(rec));
+    memcpy(path, shard->jbuf + off + sizeof(rec), rec.path_len);
+    path[rec.path_len] = '\0';
+    if (get_path_hash(path, &path_hash) == 0) apply_journal_record(shard, &rec, path, path_hash);
+  }
+  return;
+}
+
+
+/* An entry belongs to a shard even before its directory remembers it */
+static int dir_in_shard(const struct hashdb_dir * const restrict dir, const struct hashdb_shard * const restrict shard)
+{
+  size_t len;
+
+  if (dir->shard != NULL) return dir->shard == shard;
+  len = shard_prefix_len(dir->path, dir->len);
+  return len == shard->prefix_len && memcmp(dir->path, shard->prefix, len) == 0;
+}
+
+
+/* Another process has rewritten a shard; load it again. Changes made by
+ * this process are in the new file already or still wait in jbuf, unless
+ * journaling failed and they only exist in the table. */
+static int reload_hashdb_shard(struct hashdb_shard * const restrict shard)
+{
+  LOUD(fprintf(stderr, "reload_hashdb_shard('%s')\n", shard->name);)
+  if (shard->journal_failed == 0) {
+    struct hashdb_slot * const old = table;
+    const uint64_t oldsize = table_size;
+
+    /* Rebuild the table without the shard's entries */
+    table = NULL;
+    table_size = 0;
+    grow_hashdb_table(&table, &table_size, table_count);
+    table_count = 0;
+    for (uint64_t i = 0; i < oldsize; i++) {
+      if (old[i].entry == NULL) continue;
+      if (dir_in_shard(old[i].entry->dir, shard)) {
+        old[i].entry->hashcount = 0;
+        continue;
+      }
+      insert_hashdb_slot(table, table_size - 1, old[i]);
+      table_count++;
+    }
+    free(old);
+    free(itable);
+    itable = NULL;
+    itable_size = 0;
+    itable_count = 0;
+    itable_built = 0;
+  }
+  unmap_hashdb(&shard->map);
+  shard->journal_seen = 0;
+  shard->journal_size = 0;
+  if (load_hashdb_base(shard) < 0) return 1;
+  return 0;
+}
+
+
+/* Write a compacted shard and delete its journal; the caller holds the
+ * lock and has merged everything on disk into memory */
+static int compact_hashdb_shard(struct hashdb_shard * const restrict shard, uint64_t * const restrict cnt)
+{
+  FILE *db = NULL;
+  char *dbtemp = NULL;
+  const char * const dbname = shard->name;
+
+  errno = 0;
+  dbtemp = malloc(strlen(dbname) + 5);
+  if (dbtemp == NULL) goto error_hashdb_alloc;
+  strcpy(dbtemp, dbname);
+  strcat(dbtemp, ".tmp");
+  /* Try to remove any existing temporary database, ignoring errors */
+  jc_remove(dbtemp);
+  db = jc_fopen(dbtemp, JC_FILE_MODE_RW_SEQ);
+  if (db == NULL) goto error_hashdb_open;
+  if (write_hashdb3(shard, db, cnt) != 0) goto error_hashdb_write;
+  errno = 0;
+  /* The journal is deleted next, so the new database must be on disk */
+  if (fflush(db) != 0) goto error_hashdb_write;
+#ifdef ON_WINDOWS
+  if (_commit(_fileno(db)) != 0) goto error_hashdb_write;
+#else
+  if (fsync(fileno(db)) != 0) goto error_hashdb_write;
+#endif
+  if (fclose(db) != 0) {
+    db = NULL;
+    goto error_hashdb_write;
+  }
+  /* rename() replaces the old file in one step so readers never miss it */
+#ifdef ON_WINDOWS
+  jc_errno = 0;
+  if (jc_remove(dbname) != 0) {
+    if (jc_errno != ENOENT) goto error_hashdb_remove;
+  }
+#endif
+  if (jc_rename(dbtemp, dbname) != 0) goto error_hashdb_rename;
+  LOUD(fprintf(stderr, "Wrote %" PRIu64 " items to hash databse '%s'\n", *cnt, dbname);)
+  jc_remove(shard->journal_name);
+  get_hashdb_fileid(dbname, &shard->base_id);
+  shard->base_size = (uint64_t)shard->base_id.size;
+  shard->journal_seen = 0;
+  shard->journal_size = 0;
+  shard->journal_failed = 0;
+  shard->rewrite = 0;
+  free(dbtemp);
+  return 0;
+
+error_hashdb_open:
+  fprintf(stderr, "error: cannot open temp hashdb '%s' for writing: %s\n", dbtemp, strerror(errno));
+  free(dbtemp);
+  return -2;
+error_hashdb_write:
+  fprintf(stderr, "error: write failed to temp hashdb '%s': %s\n", dbtemp, strerror(errno));
+  if (db != NULL) fclose(db);
+  jc_remove(dbtemp);
+  free(dbtemp);
+  return -3;
+error_hashdb_alloc:
+  fprintf(stderr, "error: cannot allocate memory for temporary hashdb name\n");
+  return -4;
+#ifdef ON_WINDOWS
+error_hashdb_remove:
+  fprintf(stderr, "error: cannot delete old hashdb '%s': %s\n", dbname, strerror(errno));
+  jc_remove(dbtemp);
+  free(dbtemp);
+  return -5;
+#endif
+error_hashdb_rename:
+  fprintf(stderr, "error: cannot rename temporary hashdb '%s' to '%s'; leaving it alone: %s\n", dbtemp, dbname, strerror(errno));
+  free(dbtemp);
+  return -5;
+}
+
+
+/* Bring a shard up to date with what other processes wrote and append
+ * the queued changes to its journal, all under the shard's lock. With
+ * cnt set this is the final save: the shard is compacted if it has to be
+ * rewritten or its journal has grown too large, and cnt counts what was
+ * written. */
+static int sync_hashdb_shard(struct hashdb_shard * const restrict shard, uint64_t * const restrict cnt)
+{
+  struct hashdb_fileid id;
+  FILE *lock, *j = NULL;
+  int64_t merged = 0;
+  int reapply = 0, err = 0;
+
+  lock = lock_hashdb_file(shard->lock_name);
+  if (lock == NULL) goto error_lock;
+
+  get_hashdb_fileid(shard->name, &id);
+  if (memcmp(&id, &shard->base_id, sizeof(id)) != 0) {
+    if (reload_hashdb_shard(shard) != 0) goto error_reload;
+    reapply = 1;
+  }
+  errno = 0;
+  j = jc_fopen(shard->journal_name, "r+b");
+  if (j == NULL && errno != ENOENT) goto error_journal;
+  if (j != NULL) {
+    merged = read_hashdb_journal(shard, j, 1);
+    if (merged == -1) goto error_journal;
+    if (merged == -2) {
+      fprintf(stderr, "warning: ignoring unusable hash database journal '%s'\n", shard->journal_name);
+      fclose(j);
+      j = NULL;
+      jc_remove(shard->journal_name);
+      shard->journal_seen = 0;
+      shard->journal_size = 0;
+      merged = 0;
+    }
+    if (merged > 0) reapply = 1;
+    DBG(hashdb_merged += (uint64_t)merged;)
+  }
+  /* Changes from this process are newer than anything merged above */
+  if (reapply == 1) reapply_hashdb_jbuf(shard);
+  /* New records can't go into an old journal; fold it into the database */
+  if (j != NULL && shard->journal_recsize != sizeof(struct hashdb_journal_record)) {
+    uint64_t written = 0;
+
+    fclose(j);
+    j = NULL;
+    if (compact_hashdb_shard(shard, &written) != 0) goto error_compact;
+    if (cnt != NULL) *cnt += written;
+    shard->jbuf_len = 0;
+  }
+
+  if (shard->jbuf_len > 0 && shard->journal_failed == 0) {
+    if (j == NULL) j = create_hashdb_journal(shard);
+    errno = 0;
+    if (j == NULL || fseek(j, 0, SEEK_END) != 0 || fwrite(shard->jbuf, shard->jbuf_len, 1, j) != 1 || sync_hashdb_journal(j) != 0) {
+      /* Whatever part made it out is cut off by the next writer */
+      fail_hashdb_journal(shard);
+    } else {
+      shard->journal_seen += shard->jbuf_len;
+      shard->journal_size = shard->journal_seen;
+      shard->journal_appended += shard->journal_pending;
+    }
+  }
+  if (j != NULL) fclose(j);
+  j = NULL;
+  shard->jbuf_len = 0;
+  shard->journal_pending = 0;
+  shard->journal_synced = time(NULL);
+
+  /* Rewrite when forced to or when the journal has grown too large */
+  if (cnt != NULL) {
+    if (shard->rewrite == 1 || shard->journal_size > shard->base_size / HASHDB_JOURNAL_RATIO) err = compact_hashdb_shard(shard, cnt);
+    else *cnt += shard->journal_appended;
+    if (err == 0) shard->dirty = 0;
+  }
+  unlock_hashdb_file(lock);
+  return err;
+
+error_lock:
+  fprintf(stderr, "error: cannot lock hash database '%s': %s\n", shard->lock_name, strerror(errno));
+  if (shard->journal_failed == 0) fail_hashdb_journal(shard);
+  return -6;
+error_reload:
+  fprintf(stderr, "error: cannot reload hash database '%s' after another process changed it\n", shard->name);
+  goto error_unlock;
+error_journal:
+  if (shard->journal_failed == 0) fail_hashdb_journal(shard);
+  goto error_unlock;
+error_compact:
+  err = -3;
+error_unlock:
+  if (j != NULL) fclose(j);
+  unlock_hashdb_file(lock);
+  return (err != 0) ? err : -1;
+}
+
+
+/* Force the next save to rewrite the database even without changes */
+void mark_hashdb_dirty(void)
+{
+  load_all_shards();
+  for (size_t i = 0; i < shard_count; i++) shards[i]->rewrite = 1;
+  return;
+}
+
+
+/* Save every shard that this process changed; shards that were never
+ * loaded or not changed are left alone.
+ * destroy = 1 will free() all nodes after saving */
+int save_hash_database(const char * const restrict dbname, const int destroy)
+{
+  uint64_t cnt = 0;
+  int err = 0, ret;
+
+  if (dbname == NULL) goto error_hashdb_null;
+  LOUD(fprintf(stderr, "save_hash_database('%s'): %zu shards\n", dbname, shard_count);)
+  /* Entries may belong to shards that do not exist yet */
+  walk_hashdb(resolve_entry_shard, NULL);
+  for (size_t i = 0; i < shard_count; i++) {
+    struct hashdb_shard * const shard = shards[i];
+
+    if (shard->state != 1 || (shard->dirty == 0 && shard->rewrite == 0)) continue;
+    LOUD(fprintf(stderr, "save_hash_database: '%s' rewrite = %d, queued %zu bytes, journal %" PRIu64 " bytes, db %" PRIu64 " bytes\n", shard->name, shard->rewrite, shard->jbuf_len, shard->journal_size, shard->base_size);)
+    ret = sync_hashdb_shard(shard, &cnt);
+    if (ret < 0 && err == 0) err = ret;
+  }
+  DBG(if (shard_dir != NULL) hashdb_shards = shard_count;)
+  if (destroy == 1) destroy_hashdb();
+  if (err != 0) return err;
+  return (int)cnt;
+
+error_hashdb_null:
+  fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
+  return -1;
+}
+
+
+/* Print one entry in the v2 text line format */
+static void print_text_entry(const struct hashdb3_record * const restrict rec, const char * const restrict path)
+{
+  printf("%u,%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%016" PRIx64 ",%s\n",
+    (unsigned int)rec->hashcount, rec->partialhash, rec->fullhash, (uint64_t)rec->mtime, (uint64_t)rec->size, rec->inode, path);
+  return;
+}
+
+
+static int dump_hashdb_node(hashdb_t *cur, void *arg)
+{
+  struct hashdb3_record rec;
+  char path[PATHBUF_SIZE + 1];
+
+  if (cur->hashcount == 0) return 0;
+  node_to_record(cur, &rec);
+  hashdb_entry_path(cur, path);
+  print_text_entry(&rec, path);
+  (*(uint64_t *)arg)++;
+  return 0;
+}
+
+
+/* Print the whole database to stdout as a v2 text database */
+uint64_t dump_hashdb(void)
+{
+  struct timeval tm;
+  char path[PATHBUF_SIZE + 1];
+  uint64_t cnt = 0;
+  uint8_t *live;
+
+  fprintf(stderr, "Dumping hash database\n");
+  gettimeofday(&tm, NULL);
+  printf("jdupes hashdb:%d,%d,%08lx\n", HASHDB_TEXT_VER, hash_algo, (unsigned long)tm.tv_sec);
+  load_all_shards();
+  for (size_t s = 0; s < shard_count; s++) {
+    const struct hashdb_map * const m = &shards[s]->map;
+
+    if (m->base == NULL) continue;
+    live = live_mapped_records(m, &cnt);
+    for (uint64_t i = 0; i < m->count; i++) {
+      const struct hashdb3_record *rec = mapped_record(m, i);
+      if (live[i >> 3] & (1U << (i & 7))) print_text_entry(rec, mapped_path(m, rec, path));
+    }
+    free(live);
+  }
+  walk_hashdb(dump_hashdb_node, &cnt);
+  return cnt;
+}
+
+
+/* Mark an entry invalid; it keeps the file's current metadata so that
+ * hashes for the file as it is now can take its place later */
+static void invalidate_hashdb_entry(hashdb_t * const restrict entry, const file_t * const restrict file)
+{
+  entry->mtime = file->mtime;
+  entry->inode = file->inode;
+  entry->device = file->device;
+  entry->size = file->size;
+  entry->partialhash = 0;
+  entry->fullhash = 0;
+  entry->hashcount = 0;
+  hashdb_changed(entry);
+  return;
+}
+
+
+/* Shadow a mapped record with an invalidated in-memory entry */
+static void shadow_mapped_entry(const file_t * const restrict file)
+{
+  hashdb_t *entry;
+
+  entry = add_hashdb_entry(file->d_name, 0, NULL);
+  if (entry != NULL) invalidate_hashdb_entry(entry, file);
+  return;
+}
+
+
+/* in_path allows use of a precomputed path length to avoid extra strlen() calls */
+hashdb_t *add_hashdb_entry(const char *in_path, int pathlen, const file_t *check)
+{
+  struct hashdb_shard *shard;
+  hashdb_t *file;
+  uint64_t path_hash;
+  int exclude;
+  const char *path;
+
+  if (unlikely((in_path == NULL && check == NULL) || (check != NULL && check->d_name == NULL))) return NULL;
+
+  /* Get path hash and length from supplied path */
+  if (in_path == NULL) path = check->d_name;
+  else path = in_path;
+  if (pathlen == 0) pathlen = strlen(path);
+  if (get_path_hash(path, &path_hash) != 0) return NULL;
+  run_hashdb_checkpoints();
+  shard = path_shard(path, path_dir_len(path, (size_t)pathlen), 0);
+
+  if (check != NULL) {
+    /* If this entry already exists then check it */
+    file = find_hashdb_node(path_hash, path);
+    if (file != NULL) {
+      /* Should we invalidate this entry? */
+      exclude = 0;
+      if (file->mtime != check->mtime) exclude |= 1;
+      if (file->inode != check->inode) exclude |= 2;
+      if (file->size  != check->size)  exclude |= 4;
+      if (exclude == 0) {
+        if (file->hashcount == 0 && ISFLAG(check->flags, FF_HASH_PARTIAL)) {
+          /* Invalidated earlier but the file has been hashed again since */
+          file->device = check->device;
+          file->partialhash = check->filehash_partial;
+          file->fullhash = check->filehash;
+          file->hashcount = ISFLAG(check->flags, FF_HASH_FULL) ? 2 : 1;
+          hashdb_changed(file);
+        } else if (file->hashcount == 1 && ISFLAG(check->flags, FF_HASH_FULL)) {
+          file->device = check->device;
+          file->hashcount = 2;
+          file->fullhash = check->filehash;
+          hashdb_changed(file);
+        }
+        return file;
+      } else {
+        /* Something changed; invalidate this entry */
+        invalidate_hashdb_entry(file, check);
+        return NULL;
+      }
+    }
+
+    /* A mapped record only needs an in-memory entry if this changes it */
+    if (shard != NULL && shard->map.base != NULL) {
+      const struct hashdb3_record *rec = find_mapped_entry(&shard->map, path_hash, path);
+
+      if (rec != NULL) {
+        if (rec->mtime != (int64_t)check->mtime || rec->inode != (uint64_t)check->inode || rec->size != (int64_t)check->size) {
+          shadow_mapped_entry(check);
+          return NULL;
+        }
+        if (!(rec->hashcount == 1 && ISFLAG(check->flags, FF_HASH_FULL))) return NULL;
+      }
+    }
+    /* Nothing to remember without at least a partial hash */
+    if (!ISFLAG(check->flags, FF_HASH_PARTIAL)) return NULL;
+  }
+
+  file = new_hashdb_node(path, pathlen, path_hash);
+  if (file == NULL) return NULL;
+
+  /* If a check entry was given then populate it */
+  if (check != NULL) {
+    file->size = check->size;
+    file->inode = check->inode;
+    file->device = check->device;
+    file->mtime = check->mtime;
+    file->partialhash = check->filehash_partial;
+    file->fullhash = check->filehash;
+    if (ISFLAG(check->flags, FF_HASH_FULL)) file->hashcount = 2;
+    else file->hashcount = 1;
+    hashdb_changed(file);
+  }
+  return file;
+}
+
+
+/* Check a mapped v3/v4 database and set up its map */
+static int64_t load_hashdb3(struct hashdb_shard * const restrict shard)
+{
+  struct hashdb_map * const m = &shard->map;
+  const char * const dbname = shard->name;
+  const struct hashdb3_header *hdr;
+  char buf[PATHBUF_SIZE + 1];
+  uint64_t path_check;
+
+  if (m->size < sizeof(struct hashdb3_header)) goto error_hashdb3_format;
+
+  hdr = (const struct hashdb3_header *)(const void *)m->base;
+  if (hdr->byte_order != HASHDB3_BYTE_ORDER) goto error_hashdb3_byte_order;
+  if (hdr->hash_algo != (uint32_t)hash_algo) goto warn_hashdb3_algo;
+  /* Never trust offsets from the file */
+  if (hdr->record_size < HASHDB3_MIN_RECORD_SIZE || (hdr->record_size & 7) != 0) goto error_hashdb3_format;
+  if (hdr->index_slots == 0 || (hdr->index_slots & (hdr->index_slots - 1)) != 0) goto error_hashdb3_format;
+  if (hdr->count >= UINT32_MAX || hdr->count > hdr->index_slots) goto error_hashdb3_format;
+  if ((hdr->records_off & 7) != 0 || (hdr->index_off & 3) != 0) goto error_hashdb3_format;
+  if (hdr->records_off > m->size || hdr->count > (m->size - hdr->records_off) / hdr->record_size) goto error_hashdb3_format;
+  if (hdr->index_off > m->size || hdr->index_slots > (m->size - hdr->index_off) / sizeof(uint32_t)) goto error_hashdb3_format;
+  if (hdr->heap_off > m->size || hdr->heap_size > m->size - hdr->heap_off) goto error_hashdb3_format;
+  /* Older files have neither devices nor the inode index */
+  if (hdr->inode_index_off != 0) {
+    if (hdr->record_size < sizeof(struct hashdb3_record) || (hdr->inode_index_off & 3) != 0) goto error_hashdb3_format;
+    if (hdr->inode_index_off > m->size || hdr->index_slots > (m->size - hdr->inode_index_off) / sizeof(uint32_t)) goto error_hashdb3_format;
+    m->inode_index = (const uint32_t *)(const void *)(m->base + hdr->inode_index_off);
+  }
+  /* v4 directories must lie inside the heap and contain no NUL */
+  if (memcmp(hdr->magic, HASHDB4_MAGIC, sizeof(hdr->magic)) == 0) {
+    if (hdr->record_size < sizeof(struct hashdb3_record) || (hdr->dirs_off & 7) != 0) goto error_hashdb3_format;
+    if (hdr->dirs_off > m->size || hdr->dir_count > (m->size - hdr->dirs_off) / sizeof(struct hashdb4_dir)) goto error_hashdb3_format;
+    m->dirs = (const struct hashdb4_dir *)(const void *)(m->base + hdr->dirs_off);
+    m->dir_count = hdr->dir_count;
+    for (uint64_t i = 0; i < m->dir_count; i++) {
+      const struct hashdb4_dir *dir = &m->dirs[i];
+
+      if (dir->off > hdr->heap_size || dir->len > hdr->heap_size - dir->off) goto error_hashdb3_format;
+      if (memchr(m->base + hdr->heap_off + dir->off, '\0', dir->len) != NULL) goto error_hashdb3_format;
+    }
+  }
+  m->count = hdr->count;
+  m->slots = hdr->index_slots;
+  m->record_size = hdr->record_size;
+  m->records = m->base + hdr->records_off;
+  m->index = (const uint32_t *)(const void *)(m->base + hdr->index_off);
+  m->heap = m->base + hdr->heap_off;
+  m->heap_size = hdr->heap_size;
+  shard->base_size = m->size;
+  LOUD(fprintf(stderr, "hashdb v3/v4: %" PRIu64 " records, %" PRIu64 " index slots, %" PRIu64 " directories, %" PRIu64 " heap bytes\n", m->count, m->slots, m->dir_count, m->heap_size);)
+
+  /* Path hashes from another block hash are useless; load into the table */
+  get_path_hash(path_check_str, &path_check);
+  if (hdr->path_check != path_check) {
+    const uint64_t count = m->count;
+
+    LOUD(fprintf(stderr, "hashdb v3/v4: path hash mismatch, loading all records\n");)
+    for (uint64_t i = 0; i < count; i++) {
+      const struct hashdb3_record *rec = mapped_record(m, i);
+      const char *path = mapped_path(m, rec, buf);
+      uint64_t path_hash;
+      hashdb_t *entry;
+
+      if (path == NULL || strlen(path) > PATHBUF_SIZE || rec->hashcount < 1 || rec->hashcount > 2) continue;
+      if (get_path_hash(path, &path_hash) != 0) continue;
+      entry = new_hashdb_node(path, (int)strlen(path), path_hash);
+      if (entry == NULL) goto error_hashdb3_add;
+      entry->mtime = (time_t)rec->mtime;
+      entry->inode = (jdupes_ino_t)rec->inode;
+      if (m->record_size >= sizeof(struct hashdb3_record)) entry->device = (dev_t)rec->device;
+      entry->size = (off_t)rec->size;
+      entry->partialhash = rec->partialhash;
+      entry->fullhash = rec->fullhash;
+      entry->hashcount = rec->hashcount;
+      if (itable_built == 1) add_inode_slot(entry);
+    }
+    unmap_hashdb(m);
+    shard->rewrite = 1;
+    return (int64_t)count;
+  }
+  return (int64_t)m->count;
+
+error_hashdb3_format:
+  fprintf(stderr, "error: hash database '%s' is truncated or corrupted\n", dbname);
+  unmap_hashdb(m);
+  return -2;
+error_hashdb3_byte_order:
+  fprintf(stderr, "error: hash database '%s' was written on a machine with a different byte order\n", dbname);
+  unmap_hashdb(m);
+  return -3;
+error_hashdb3_add:
+  fprintf(stderr, "error: internal failure allocating a hashdb entry\n");
+  unmap_hashdb(m);
+  return -5;
+warn_hashdb3_algo:
+  fprintf(stderr, "warning: hashdb uses a different hash algorithm than selected; not loading\n");
+  unmap_hashdb(m);
+  return -7;
+}
+
+
+/* A newline-aligned piece of a text database and what parsing it made */
+struct hashdb_text_job {
+  const char *start;
+  const char *end;
+  unsigned int fixed_len;
+  struct hashdb_mem mem;
+  uint64_t count;
+  const char *bad_line;
+  int failed;  /* 1 = bad line, 2 = allocation failure */
+};
+
+
+/* Parse a hex field up to its comma and step past the comma */
+static int parse_hashdb_field(const char ** const restrict p, const char * const restrict end, uint64_t * const restrict value)
+{
+  const char *s = *p;
+  uint64_t v = 0;
+
+  for (; s < end && *s != ','; s++) {
+    const unsigned int c = (unsigned char)*s | 0x20;
+
+    if (c >= '0' && c <= '9') v = (v << 4) | (c - '0');
+    else if (c >= 'a' && c <= 'f') v = (v << 4) | (c - 'a' + 10);
+    else return -1;
+  }
+  if (s == end) return -1;
+  *value = v;
+  *p = s + 1;
+  return 0;
+}
+
+
+/* Parse text database lines into private slabs; runs on a loader thread,
+ * so the shared table and strtok() are off limits here */
+static void *load_hashdb_text_job(void *arg)
+{
+  struct hashdb_text_job * const restrict job = (struct hashdb_text_job *)arg;
+  const char *line = job->start;
+  /* NUL-terminated copy of the path for get_path_hash() */
+  uint64_t path[(PATHBUF_SIZE + 8) / sizeof(uint64_t)];
+
+  while (line < job->end) {
+    const char *eol = (const char *)memchr(line, '\n', (size_t)(job->end - line));
+    const char *p = line;
+    uint64_t field[6];
+    size_t pathlen;
+    hashdb_t *entry;
+
+    if (eol == NULL) eol = job->end;
+    if ((size_t)(eol - line) <= job->fixed_len) goto bad_line;
+    /* hashcount: 1 = partial only, 2 = partial and full */
+    for (int i = 0; i < 6; i++) if (parse_hashdb_field(&p, eol, &field[i]) != 0) goto bad_line;
+    if (field[0] < 1 || field[0] > 2 || field[4] == 0) goto bad_line;
+    pathlen = (size_t)(eol - line) - job->fixed_len;
+    if (pathlen > PATHBUF_SIZE) goto bad_line;
+
+    memcpy(path, line + job->fixed_len, pathlen);
+    ((char *)path)[pathlen] = '\0';
+    entry = alloc_hashdb_node(&job->mem, (const char *)path, (int)pathlen);
+    if (entry == NULL || get_path_hash((const char *)path, &entry->path_hash) != 0) {
+      job->failed = 2;
+      return NULL;
+    }
+    entry->hashcount = (uint8_t)field[0];
+    entry->partialhash = field[1];
+    entry->fullhash = (field[0] == 2) ? field[2] : 0;
+    entry->mtime = (time_t)field[3];
+    entry->size = (off_t)field[4];
+    entry->inode = (jdupes_ino_t)field[5];
+    job->count++;
+    line = eol + 1;
+  }
+  return NULL;
+
+bad_line:
+  job->bad_line = line;
+  job->failed = 1;
+  return NULL;
+}
+
+
+/* Parse the entries of a text database. Large files are split at line
+ * boundaries and parsed by several threads; the table is then sized once
+ * and filled in file order. */
+static int64_t load_hashdb_text(const char * const restrict dbname, const char * const restrict data, const char * const restrict end, const unsigned int fixed_len)
+{
+  struct hashdb_text_job job[HASHDB_LOAD_MAX_THREADS];
+  const size_t len = (size_t)(end - data);
+  unsigned int jobs = 1;
+  uint64_t total = 0, linenum = 2;
+  const char *bad, *eol;
+  int64_t retval;
+
+#ifdef HASHDB_THREADS
+  jobs = HASHDB_LOAD_THREADS;
+  if (jobs == 0) {
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs = (cpus > 0) ? (unsigned int)cpus : 1;
+  }
+  if (jobs > HASHDB_LOAD_MAX_THREADS) jobs = HASHDB_LOAD_MAX_THREADS;
+#endif
+  if (jobs > len / HASHDB_LOAD_MIN_BYTES) jobs = (unsigned int)(len / HASHDB_LOAD_MIN_BYTES);
+  if (jobs == 0) jobs = 1;
+
+  memset(job, 0, sizeof(struct hashdb_text_job) * jobs);
+  for (unsigned int i = 0; i < jobs; i++) {
+    job[i].start = (i == 0) ? data : job[i - 1].end;
+    job[i].fixed_len = fixed_len;
+    if (i == jobs - 1) job[i].end = end;
+    else {
+      const char *split = data + (len / jobs) * (i + 1);
+
+      if (split < job[i].start) split = job[i].start;
+      split = (const char *)memchr(split, '\n', (size_t)(end - split));
+      job[i].end = (split == NULL) ? end : split + 1;
+    }
+  }
+  DBG(hashdb_load_threads = jobs;)
+
+#ifdef HASHDB_THREADS
+  if (jobs > 1) {
+    pthread_t tid[HASHDB_LOAD_MAX_THREADS];
+    unsigned int started;
+
+    LOUD(fprintf(stderr, "load_hashdb_text: %u threads for %zu bytes\n", jobs, len);)
+    for (started = 0; started < jobs; started++)
+      if (pthread_create(&tid[started], NULL, load_hashdb_text_job, &job[started]) != 0) break;
+    /* Whatever could not get a thread is parsed here */
+    for (unsigned int i = started; i < jobs; i++) load_hashdb_text_job(&job[i]);
+    for (unsigned int i = 0; i < started; i++) pthread_join(tid[i], NULL);
+  } else
+#endif
+  load_hashdb_text_job(&job[0]);
+
+  for (unsigned int i = 0; i < jobs; i++) {
+    bad = job[i].bad_line;
+    if (job[i].failed == 1) goto error_text_line;
+    if (job[i].failed == 2) goto error_text_add;
+    total += job[i].count;
+  }
+
+  /* Bulk build; the slabs keep file order for saving */
+  grow_hashdb_table(&table, &table_size, table_count + total);
+  for (unsigned int i = 0; i < jobs; i++) {
+    struct hashdb_slab *first = job[i].mem.slab_head;
+
+    if (splice_hashdb_mem(&job[i].mem) != 0) goto error_text_add;
+    for (struct hashdb_slab *slab = first; slab != NULL; slab = slab->next) {
+      for (unsigned int j = 0; j < slab->used; j++) {
+        struct hashdb_slot slot;
+
+        slot.key = slab->entries[j].path_hash;
+        slot.entry = &slab->entries[j];
+        insert_hashdb_slot(table, table_size - 1, slot);
+      }
+    }
+  }
+  table_count += total;
+  return (int64_t)total;
+
+error_text_line:
+  for (const char *p = data; (p = (const char *)memchr(p, '\n', (size_t)(bad - p))) != NULL; p++) linenum++;
+  eol = (const char *)memchr(bad, '\n', (size_t)(end - bad));
+  if (eol == NULL || eol - bad > PATHBUF_SIZE + 128) eol = (end - bad > PATHBUF_SIZE + 128) ? bad + PATHBUF_SIZE + 128 : end;
+  fprintf(stderr, "\nerror: bad line %" PRIu64 " in hash database '%s':\n\n%.*s\n\n", linenum, dbname, (int)(eol - bad), bad);
+  retval = -4;
+  goto error_text_free;
+error_text_add:
+  fprintf(stderr, "error: internal failure allocating a hashdb entry\n");
+  retval = -5;
+error_text_free:
+  for (unsigned int i = 0; i < jobs; i++) free_hashdb_mem(&job[i].mem);
+  return retval;
+}
+
+
+/* db header format: jdupes hashdb:dbversion,hashtype,update_mtime
+ * db line format: hashcount,partial,full,mtime,size,inode,path
+ * v3 databases are binary and start with HASHDB3_MAGIC */
+static int64_t load_hashdb_base(struct hashdb_shard * const restrict shard)
+{
+  const char * const dbname = shard->name;
+  struct hashdb_fileid after;
+  char buf[PATHBUF_SIZE + 128];
+  char *field, *temp;
+  const char *data, *eol;
+  size_t size, hdrlen;
+  int db_ver, hashdb_algo, mapped;
+  unsigned int fixed_len;
+  int64_t count;
+#ifdef LOUD_DEBUG
+  time_t db_mtime;
+  char date[32];
+#endif /* LOUD_DEBUG */
+
+  /* Another process may replace the file at any time; the ID must match
+   * the file that was actually read */
+  while (1) {
+    get_hashdb_fileid(dbname, &shard->base_id);
+    errno = 0;
+    if (map_hashdb_file(dbname, &data, &size, &mapped) != 0) {
+      data = NULL;
+      size = 0;
+    }
+    get_hashdb_fileid(dbname, &after);
+    if (memcmp(&after, &shard->base_id, sizeof(after)) == 0) break;
+    unmap_hashdb_file(data, size, mapped);
+  }
+  if (data == NULL || size == 0) goto warn_hashdb_open;  // empty file = make new DB
+  if (shard->state == 0 && shard_dir == NULL && !ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "Loading hash database...");
+  if ((size >= sizeof(HASHDB4_MAGIC) - 1 && memcmp(data, HASHDB4_MAGIC, sizeof(HASHDB4_MAGIC) - 1) == 0)
+      || (size >= sizeof(HASHDB3_MAGIC) - 1 && memcmp(data, HASHDB3_MAGIC, sizeof(HASHDB3_MAGIC) - 1) == 0)) {
+    shard->map.base = data;
+    shard->map.size = size;
+    shard->map.mapped = mapped;
+    return load_hashdb3(shard);
+  }
+
+  /* Read header line */
+  hdrlen = (size < PATHBUF_SIZE + 127) ? size : PATHBUF_SIZE + 127;
+  eol = (const char *)memchr(data, '\n', hdrlen);
+  if (eol != NULL) hdrlen = (size_t)(eol - data) + 1;
+  memcpy(buf, data, hdrlen);
+  buf[hdrlen] = '\0';
+  field = strtok(buf, ":");
+  if (field == NULL || strcmp(field, "jdupes hashdb") != 0) goto error_hashdb_header;
+  field = strtok(NULL, ":");
+  temp = strtok(field, ",");
+  if (temp == NULL) goto error_hashdb_header;
+  db_ver = (int)strtoul(temp, NULL, 10);
+  temp = strtok(NULL, ",");
+  if (temp == NULL) goto error_hashdb_header;
+  hashdb_algo = (int)strtoul(temp, NULL, 10);
+  temp = strtok(NULL, ",");
+  if (temp == NULL) goto error_hashdb_header;
+  /* Database mod time is currently set but not used */
+  LOUD(db_mtime = (int)strtoul(temp, NULL, 16);)
+  LOUD(SECS_TO_TIME(date, &db_mtime);)
+  LOUD(fprintf(stderr, "hashdb header: ver %u, algo %u, mod %s\n", db_ver, hashdb_algo, date);)
+  if (db_ver < HASHDB_MIN_VER || db_ver > HASHDB_TEXT_VER) goto error_hashdb_version;
+  if (hashdb_algo != hash_algo) goto warn_hashdb_algo;
+
+  /* v1 has 8-byte sizes; v2 has 16-byte (4GiB+) sizes */
+  fixed_len = 87;
+  if (db_ver == 1) fixed_len = 71;
+
+  /* Parse the rest of the file from memory */
+  count = load_hashdb_text(dbname, data + hdrlen, data + size, fixed_len);
+  unmap_hashdb_file(data, size, mapped);
+  shard->base_size = (uint64_t)size;
+  return count;
+
+warn_hashdb_open:
+  if (shard->state == 0 && shard_dir == NULL) fprintf(stderr, "Creating a new hash database '%s'\n", dbname);
+  unmap_hashdb_file(data, size, mapped);
+  shard->base_size = 0;
+  return 0;
+error_hashdb_header:
+  fprintf(stderr, "error in header of hash database '%s'\n", dbname);
+  unmap_hashdb_file(data, size, mapped);
+  return -2;
+error_hashdb_version:
+  fprintf(stderr, "error: bad db version %u in hash database '%s'\n", db_ver, dbname);
+  unmap_hashdb_file(data, size, mapped);
+  return -3;
+warn_hashdb_algo:
+  fprintf(stderr, "warning: hashdb uses a different hash algorithm than selected; not loading\n");
+  unmap_hashdb_file(data, size, mapped);
+  return -7;
+}
+
+
+/* Load a shard and replay its journal over it */
+static int64_t load_shard(struct hashdb_shard * const restrict shard)
+{
+  struct hashdb_fileid pre_id;
+  FILE *j;
+  int64_t count, replayed = 0;
+#ifdef DEBUG
+  struct timeval start, stop;
+
+  gettimeofday(&start, NULL);
+#endif
+
+  LOUD(fprintf(stderr, "load_shard('%s') prefix '%s'\n", shard->name, shard->prefix);)
+  /* A writer compacts by renaming the new database over the old one and
+   * then deleting the journal. Opening the journal first means it is
+   * either the one that belongs to the database loaded next or one that
+   * was already folded into it; the ids tell the two apart. */
+  get_hashdb_fileid(shard->name, &pre_id);
+  errno = 0;
+  j = jc_fopen(shard->journal_name, JC_FILE_MODE_RDONLY_SEQ);
+  if (j == NULL && errno != ENOENT) {
+    fprintf(stderr, "error reading hash database journal '%s': %s\n", shard->journal_name, strerror(errno));
+    return -8;
+  }
+  count = load_hashdb_base(shard);
+  if (count < 0) goto error_load_shard;
+  if (j != NULL) {
+    if (memcmp(&pre_id, &shard->base_id, sizeof(pre_id)) == 0) {
+      setvbuf(j, NULL, _IOFBF, 65536);
+      replayed = read_hashdb_journal(shard, j, 0);
+      if (replayed == -2) {
+        fprintf(stderr, "warning: ignoring unusable hash database journal '%s'\n", shard->journal_name);
+        replayed = 0;
+      }
+      if (replayed < 0) {
+        count = -8;
+        goto error_load_shard;
+      }
+    }
+    fclose(j);
+  }
+  shard->state = 1;
+#ifdef DEBUG
+  gettimeofday(&stop, NULL);
+  hashdb_load_usec += (uint64_t)(stop.tv_sec - start.tv_sec) * 1000000 + (uint64_t)stop.tv_usec - (uint64_t)start.tv_usec;
+  hashdb_shards_loaded++;
+#endif
+  return count + replayed;
+
+error_load_shard:
+  if (j != NULL) fclose(j);
+  return count;
+}
+
+
+/* Read the list of shards of a sharded database; the shards themselves
+ * are loaded when a path inside them is first looked up */
+static int64_t load_hashdb_manifest(const char * const restrict dbname)
+{
+  int err;
+
+  shard_dir = (char *)malloc(strlen(dbname) + 1);
+  if (shard_dir == NULL) jc_oom("load_hashdb_manifest()");
+  strcpy(shard_dir, dbname);
+  err = read_hashdb_manifest();
+  if (err == 1) fprintf(stderr, "Creating a new sharded hash database '%s'\n", dbname);
+  return (err < 0) ? err : 0;
+}
+
+
+/* Load the database and replay its journal over it; a directory is a
+ * sharded database whose shards are loaded on demand */
+int64_t load_hash_database(const char * const restrict dbname)
+{
+  struct JC_STAT st;
+
+  if (dbname == NULL) goto error_hashdb_null;
+  LOUD(fprintf(stderr, "load_hash_database('%s')\n", dbname);)
+  if (jc_stat(dbname, &st) == 0 && JC_S_ISDIR(st.st_mode)) {
+    const int64_t err = load_hashdb_manifest(dbname);
+
+    if (err < 0) return err;
+    return load_root_shards();
+  }
+  return load_shard(add_shard(dbname, "", 0, 0, 0));
+
+error_hashdb_null:
+  fprintf(stderr, "error: internal failure: NULL pointer for hashdb\n");
+  return -6;
+}
+
+
+#ifdef HASHDB_THREADS
+static void *hashdb_load_thread(void *arg)
+{
+  const int64_t count = load_hash_database((const char *)arg);
+
+  pthread_mutex_lock(&load_lock);
+  load_result = count;
+  load_done = 1;
+  pthread_mutex_unlock(&load_lock);
+  return NULL;
+}
+
+
+static int hashdb_load_finished(void)
+{
+  int done;
+
+  pthread_mutex_lock(&load_lock);
+  done = load_done;
+  pthread_mutex_unlock(&load_lock);
+  return done;
+}
+#endif /* HASHDB_THREADS */
+
+
+/* Start loading the database on a background thread so that directory
+ * traversal can run at the same time; loads right away without threads.
+ * Of a sharded database only the shards overlapping the roots are loaded. */
+void start_hash_database_load(const char * const restrict dbname, char **roots, const int root_cnt)
+{
+#ifdef HASHDB_THREADS
+  sigset_t all, old;
+  int err;
+#endif
+
+  load_roots = roots;
+  load_root_cnt = root_cnt;
+#ifdef HASHDB_THREADS
+  /* Signals such as the progress alarm must go to the main thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  err = pthread_create(&load_tid, NULL, hashdb_load_thread, (void *)(uintptr_t)dbname);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err == 0) {
+    load_running = 1;
+    return;
+  }
+#endif
+  load_result = load_hash_database(dbname);
+  return;
+}
+
+
+/* Wait for a background load and resolve the lookups it held up */
+int64_t finish_hash_database_load(void)
+{
+#ifdef HASHDB_THREADS
+  if (load_running != 0) {
+    pthread_join(load_tid, NULL);
+    load_running = 0;
+  }
+#endif
+  if (load_result >= 0)
+    for (size_t i = 0; i < pending_cnt; i++) read_hashdb_entry(pending[i]);
+  free(pending);
+  pending = NULL;
+  pending_cnt = 0;
+  pending_alloc = 0;
+  return load_result;
+}
+
+
+#ifdef HASHDB_THREADS
+static int defer_hashdb_lookup(file_t * const restrict file)
+{
+  if (pending_cnt == pending_alloc) {
+    file_t **temp;
+
+    pending_alloc = (pending_alloc == 0) ? 4096 : pending_alloc * 2;
+    temp = (file_t **)realloc(pending, sizeof(file_t *) * pending_alloc);
+    if (temp == NULL) jc_oom("defer_hashdb_lookup()");
+    pending = temp;
+  }
+  pending[pending_cnt++] = file;
+  DBG(hashdb_deferred++;)
+  return 0;
+}
+#endif /* HASHDB_THREADS */
+
+
+static int get_path_hash(const char * const restrict path, uint64_t *path_hash)
+{
+  uint64_t aligned_path[(PATHBUF_SIZE + 8) / sizeof(uint64_t)];
+  int retval;
+
+  *path_hash = 0;
+  if ((uintptr_t)path & 0x0f) {
+    strncpy((char *)&aligned_path, path, PATHBUF_SIZE);
+    retval = jc_block_hash((uint64_t *)aligned_path, path_hash, strlen((char *)aligned_path));
+  } else retval = jc_block_hash((uint64_t *)(uintptr_t)path, path_hash, strlen(path));
+  return retval;
+}
+
+
+/* Find hashes cached under another path for a file with the same device,
+ * inode, size and mtime; returns the hash count, 0 if there are none. The
+ * old path goes in oldpath (PATHBUF_SIZE + 1 bytes) and its in-memory
+ * entry in *oldentry, or NULL for a record that is only mapped. */
+static int find_moved_hashes(const file_t * const restrict file, uint64_t * const restrict partialhash, uint64_t * const restrict fullhash,
+    char * const restrict oldpath, hashdb_t ** const restrict oldentry)
+{
+  hashdb_t *cur;
+  const struct hashdb3_record *rec;
+  char buf[PATHBUF_SIZE + 1];
+  uint64_t key, mask, slot;
+
+  if (file->device == 0) return 0;
+  key = inode_key((uint64_t)file->device, (uint64_t)file->inode, (int64_t)file->size, (int64_t)file->mtime);
+  if (itable_built == 0) {
+    walk_hashdb(add_inode_node, NULL);
+    itable_built = 1;
+  }
+
+  if (itable != NULL) {
+    mask = itable_size - 1;
+    slot = key & mask;
+    for (uint64_t dist = 0; itable[slot].entry != NULL; dist++) {
+      if (((slot - (itable[slot].key & mask)) & mask) < dist) break;
+      cur = itable[slot].entry;
+      if (itable[slot].key == key && cur->hashcount != 0 && cur->device == file->device
+          && cur->inode == file->inode && cur->size == file->size && cur->mtime == file->mtime) {
+        *partialhash = cur->partialhash;
+        *fullhash = cur->fullhash;
+        hashdb_entry_path(cur, oldpath);
+        *oldentry = cur;
+        return cur->hashcount;
+      }
+      slot = (slot + 1) & mask;
+    }
+  }
+
+  /* Shards that were never loaded are not searched */
+  for (size_t i = 0; i < shard_count; i++) {
+    const struct hashdb_map * const m = &shards[i]->map;
+
+    if (shards[i]->state != 1 || m->inode_index == NULL) continue;
+    mask = m->slots - 1;
+    slot = key & mask;
+    for (uint64_t probe = 0; probe < m->slots; probe++) {
+      const uint32_t recno = m->inode_index[slot];
+      const char *path;
+
+      if (recno == 0) break;
+      if (likely(recno <= m->count)) {
+        rec = mapped_record(m, recno - 1);
+        if (rec->device == (uint64_t)file->device && rec->inode == (uint64_t)file->inode && rec->size == (int64_t)file->size
+            && rec->mtime == (int64_t)file->mtime && rec->hashcount >= 1 && rec->hashcount <= 2) {
+          /* A table entry for the same path replaces the record */
+          path = mapped_path(m, rec, buf);
+          if (path != NULL && find_hashdb_node(rec->path_hash, path) == NULL) {
+            *partialhash = rec->partialhash;
+            *fullhash = rec->fullhash;
+            strcpy(oldpath, path);
+            *oldentry = NULL;
+            return rec->hashcount;
+          }
+        }
+      }
+      slot = (slot + 1) & mask;
+    }
+  }
+  return 0;
+}
+
+
+/* Give a file that was renamed or moved the hashes of its old path; entry
+ * is the outdated entry for the new path, if there is one. The old path's
+ * entry is dropped unless the file is still there, as another hard link */
+static int rekey_hashdb_entry(hashdb_t *entry, file_t * const restrict file, const uint64_t path_hash)
+{
+  struct JC_STAT st;
+  char oldpath[PATHBUF_SIZE + 1];
+  hashdb_t *old = NULL;
+  uint64_t partialhash, fullhash;
+  const int hashcount = find_moved_hashes(file, &partialhash, &fullhash, oldpath, &old);
+
+  if (hashcount == 0) return 0;
+  if (entry == NULL) {
+    entry = new_hashdb_node(file->d_name, (int)strlen(file->d_name), path_hash);
+    if (entry == NULL) return 0;
+  }
+  LOUD(fprintf(stderr, "read_hashdb_entry: '%s' was moved\n", file->d_name);)
+  entry->mtime = file->mtime;
+  entry->inode = file->inode;
+  entry->device = file->device;
+  entry->size = file->size;
+  entry->partialhash = partialhash;
+  entry->fullhash = (hashcount == 2) ? fullhash : 0;
+  entry->hashcount = (uint_fast8_t)hashcount;
+  hashdb_changed(entry);
+  DBG(hashdb_moved++;)
+
+  if (jc_stat(oldpath, &st) != 0 || st.st_ino != file->inode || st.st_dev != file->device) {
+    LOUD(fprintf(stderr, "read_hashdb_entry: dropping old path '%s'\n", oldpath);)
+    /* A record that is only mapped is shadowed by an invalidated entry */
+    if (old == NULL) {
+      old = add_hashdb_entry(oldpath, 0, NULL);
+      if (old != NULL) {
+        old->mtime = file->mtime;
+        old->inode = file->inode;
+        old->device = file->device;
+        old->size = file->size;
+      }
+    }
+    if (old != NULL) {
+      old->partialhash = 0;
+      old->fullhash = 0;
+      old->hashcount = 0;
+      hashdb_changed(old);
+    }
+  }
+
+  file->filehash_partial = partialhash;
+  if (hashcount == 2) {
+    file->filehash = fullhash;
+    SETFLAG(file->flags, (FF_HASH_PARTIAL | FF_HASH_FULL));
+  } else SETFLAG(file->flags, FF_HASH_PARTIAL);
+  return 1;
+}
+
+
+/* Scan database for a matching file entry; if found, load hashes into it */
+int read_hashdb_entry(file_t *file)
+{
+  struct hashdb_shard *shard;
+  hashdb_t *cur;
+  const struct hashdb3_record *rec;
+  uint64_t path_hash;
+  int exclude;
+
+  LOUD(fprintf(stderr, "read_hashdb_entry('%s')\n", file->d_name);)
+  if (file == NULL || file->d_name == NULL) goto error_null;
+#ifdef HASHDB_THREADS
+  /* The table belongs to the loading thread until it is done */
+  if (unlikely(load_running != 0)) {
+    if (hashdb_load_finished() == 0 || load_result < 0) return defer_hashdb_lookup(file);
+    finish_hash_database_load();
+  }
+#endif
+  if (get_path_hash(file->d_name, &path_hash) != 0) goto error_path_hash;
+  run_hashdb_checkpoints();
+  /* Loading the shard first keeps its journal from adding a second entry */
+  shard = path_shard(file->d_name, path_dir_len(file->d_name, strlen(file->d_name)), 0);
+
+  cur = find_hashdb_node(path_hash, file->d_name);
+  if (cur != NULL) {
+    /* Found a matching path too but check mtime */
+    exclude = 0;
+    if (cur->mtime != file->mtime) exclude |= 1;
+    if (cur->inode != file->inode) exclude |= 2;
+    if (cur->size  != file->size)  exclude |= 4;
+    if (exclude != 0) {
+      /* Invalidate if something has changed unless it was moved here */
+      if (rekey_hashdb_entry(cur, file, path_hash) == 1) return 1;
+      invalidate_hashdb_entry(cur, file);
+      return -1;
+    }
+    if (cur->hashcount == 0) return rekey_hashdb_entry(cur, file, path_hash);
+    /* Entries from before devices were stored get one the first time */
+    if (cur->device == 0 && file->device != 0) {
+      cur->device = file->device;
+      hashdb_changed(cur);
+    }
+    file->filehash_partial = cur->partialhash;
+    if (cur->hashcount == 2) {
+      file->filehash = cur->fullhash;
+      SETFLAG(file->flags, (FF_HASH_PARTIAL | FF_HASH_FULL));
+    } else SETFLAG(file->flags, FF_HASH_PARTIAL);
+    return 1;
+  }
+
+  /* Not changed during this run; look in the mapped database */
+  rec = (shard != NULL) ? find_mapped_entry(&shard->map, path_hash, file->d_name) : NULL;
+  if (rec == NULL || rec->hashcount < 1 || rec->hashcount > 2) return rekey_hashdb_entry(NULL, file, path_hash);
+  if (rec->mtime != (int64_t)file->mtime || rec->inode != (uint64_t)file->inode || rec->size != (int64_t)file->size) {
+    if (rekey_hashdb_entry(NULL, file, path_hash) == 1) return 1;
+    shadow_mapped_entry(file);
+    return -1;
+  }
+  file->filehash_partial = rec->partialhash;
+  if (rec->hashcount == 2) {
+    file->filehash = rec->fullhash;
+    SETFLAG(file->flags, (FF_HASH_PARTIAL | FF_HASH_FULL));
+  } else SETFLAG(file->flags, FF_HASH_PARTIAL);
+  if (file->device != 0 && (shard->map.record_size < sizeof(struct hashdb3_record) || rec->device == 0)) {
+    cur = new_hashdb_node(file->d_name, (int)strlen(file->d_name), path_hash);
+    if (cur != NULL) {
+      cur->mtime = file->mtime;
+      cur->inode = file->inode;
+      cur->device = file->device;
+      cur->size = file->size;
+      cur->partialhash = rec->partialhash;
+      cur->fullhash = rec->fullhash;
+      cur->hashcount = rec->hashcount;
+      hashdb_changed(cur);
+    }
+  }
+  return 1;
+
+error_null:
+  fprintf(stderr, "error: internal error: NULL data passed to read_hashdb_entry()\n");
+  return -255;
+error_path_hash:
+  fprintf(stderr, "error: internal error hashing a path\n");
+  return -255;
+}
+
+
+/* Databases that prune_hashdb() or merge_hash_database() changed are
+ * compacted when saved so the removed entries leave the files */
+static void rewrite_dirty_shards(void)
+{
+  for (size_t i = 0; i < shard_count; i++) if (shards[i]->dirty == 1) shards[i]->rewrite = 1;
+  return;
+}
+
+
+/* An entry to check while pruning; name points into the map or the entry */
+struct hashdb_prune_item {
+  struct hashdb_dir *dir;
+  const char *name;
+  hashdb_t *entry;  /* NULL for a mapped record */
+  struct hashdb_shard *shard;
+  uint64_t recno;
+  int64_t size;
+  int64_t mtime;
+  int dead;
+};
+
+struct hashdb_prune_list {
+  struct hashdb_prune_item *items;
+  uint64_t cnt;
+  uint64_t alloc;
+};
+
+/* Directories are handed out to the checking threads one at a time;
+ * groups holds the first item of each directory plus the end */
+struct hashdb_prune_job {
+  struct hashdb_prune_item *items;
+  uint64_t *groups;
+  uint64_t group_cnt;
+  uint64_t next;
+#ifdef HASHDB_THREADS
+  pthread_mutex_t lock;
+#endif
+};
+
+
+static struct hashdb_prune_item *add_prune_item(struct hashdb_prune_list * const restrict pl)
+{
+  if (pl->cnt == pl->alloc) {
+    pl->alloc = (pl->alloc == 0) ? 65536 : pl->alloc * 2;
+    pl->items = (struct hashdb_prune_item *)realloc(pl->items, sizeof(struct hashdb_prune_item) * (size_t)pl->alloc);
+    if (pl->items == NULL) jc_oom("add_prune_item()");
+  }
+  memset(&pl->items[pl->cnt], 0, sizeof(struct hashdb_prune_item));
+  return &pl->items[pl->cnt++];
+}
+
+
+static int collect_prune_node(hashdb_t *cur, void *arg)
+{
+  struct hashdb_prune_item *item;
+
+  if (cur->hashcount == 0) return 0;
+  item = add_prune_item((struct hashdb_prune_list *)arg);
+  item->dir = cur->dir;
+  item->name = cur->name;
+  item->entry = cur;
+  item->size = (int64_t)cur->size;
+  item->mtime = (int64_t)cur->mtime;
+  return 0;
+}
+
+
+static void collect_prune_records(struct hashdb_prune_list * const restrict pl, struct hashdb_shard * const restrict shard)
+{
+  const struct hashdb_map * const m = &shard->map;
+  struct hashdb_dir **dir_map;
+  uint64_t live_cnt = 0;
+  uint8_t *live;
+
+  if (m->base == NULL) return;
+  live = live_mapped_records(m, &live_cnt);
+  dir_map = (struct hashdb_dir **)calloc((size_t)m->dir_count + 1, sizeof(struct hashdb_dir *));
+  if (dir_map == NULL) jc_oom("collect_prune_records()");
+  for (uint64_t i = 0; i < m->count; i++) {
+    const struct hashdb3_record * const rec = mapped_record(m, i);
+    struct hashdb_prune_item *item;
+    struct hashdb_dir *d;
+    const char *dir, *name;
+    uint32_t dirlen;
+    size_t namelen;
+
+    if (!(live[i >> 3] & (1U << (i & 7)))) continue;
+    name = mapped_name(m, rec, &dir, &dirlen, &namelen);
+    if (dir != NULL) {
+      if (dir_map[rec->dir] == NULL) dir_map[rec->dir] = intern_hashdb_dir(&mem, dir, dirlen);
+      d = dir_map[rec->dir];
+    } else {
+      dirlen = (uint32_t)path_dir_len(name, namelen);
+      d = intern_hashdb_dir(&mem, name, dirlen);
+      name += dirlen;
+    }
+    if (d == NULL) jc_oom("collect_prune_records()");
+    item = add_prune_item(pl);
+    item->dir = d;
+    item->name = name;
+    item->shard = shard;
+    item->recno = i;
+    item->size = rec->size;
+    item->mtime = rec->mtime;
+  }
+  free(dir_map);
+  free(live);
+  return;
+}
+
+
+static int sort_prune_dir(const void *a, const void *b)
+{
+  const struct hashdb_dir * const da = *(const struct hashdb_dir * const *)a;
+  const struct hashdb_dir * const db = *(const struct hashdb_dir * const *)b;
+  const int cmp = memcmp(da->path, db->path, (da->len < db->len) ? da->len : db->len);
+
+  if (cmp != 0) return cmp;
+  return (da->len > db->len) - (da->len < db->len);
+}
+
+
+/* Directory order first (by the rank stored in id), then file name */
+static int sort_prune_item(const void *a, const void *b)
+{
+  const struct hashdb_prune_item * const ia = (const struct hashdb_prune_item *)a;
+  const struct hashdb_prune_item * const ib = (const struct hashdb_prune_item *)b;
+
+  if (ia->dir->id != ib->dir->id) return (ia->dir->id > ib->dir->id) ? 1 : -1;
+  return strcmp(ia->name, ib->name);
+}
+
+
+/* Sort the items by path so each directory is checked in one go; returns
+ * the start of each directory's run of items */
+static uint64_t *sort_prune_list(struct hashdb_prune_list * const restrict pl, uint64_t * const restrict group_cnt)
+{
+  struct hashdb_dir **dirs = NULL;
+  uint64_t *groups, dir_cnt = 0, dir_alloc = 0;
+
+  for (uint64_t i = 0; i < pl->cnt; i++) pl->items[i].dir->id = UINT32_MAX;
+  for (uint64_t i = 0; i < pl->cnt; i++) {
+    struct hashdb_dir * const d = pl->items[i].dir;
+
+    if (d->id != UINT32_MAX) continue;
+    if (dir_cnt == dir_alloc) {
+      dir_alloc = (dir_alloc == 0) ? 4096 : dir_alloc * 2;
+      dirs = (struct hashdb_dir **)realloc(dirs, sizeof(struct hashdb_dir *) * (size_t)dir_alloc);
+      if (dirs == NULL) jc_oom("sort_prune_list()");
+    }
+    d->id = (uint32_t)dir_cnt;
+    dirs[dir_cnt++] = d;
+  }
+  qsort(dirs, (size_t)dir_cnt, sizeof(struct hashdb_dir *), sort_prune_dir);
+  for (uint64_t i = 0; i < dir_cnt; i++) dirs[i]->id = (uint32_t)i;
+  free(dirs);
+  qsort(pl->items, (size_t)pl->cnt, sizeof(struct hashdb_prune_item), sort_prune_item);
+
+  groups = (uint64_t *)malloc(sizeof(uint64_t) * (size_t)(dir_cnt + 1));
+  if (groups == NULL) jc_oom("sort_prune_list()");
+  *group_cnt = 0;
+  for (uint64_t i = 0; i < pl->cnt; i++)
+    if (i == 0 || pl->items[i].dir != pl->items[i - 1].dir) groups[(*group_cnt)++] = i;
+  groups[*group_cnt] = pl->cnt;
+  return groups;
+}
+
+
+/* Mark the items of one directory whose files are gone or have changed;
+ * a file that cannot be checked for another reason is kept */
+static void check_prune_group(struct hashdb_prune_item * const restrict items, const uint64_t start, const uint64_t end)
+{
+  const struct hashdb_dir * const dir = items[start].dir;
+#ifndef ON_WINDOWS
+  struct stat st;
+  int dfd;
+
+  dfd = open((dir->len == 0) ? "." : dir->path, O_RDONLY | O_DIRECTORY);
+  if (dfd < 0) {
+    if (errno == ENOENT || errno == ENOTDIR) for (uint64_t i = start; i < end; i++) items[i].dead = 1;
+    return;
+  }
+  for (uint64_t i = start; i < end; i++) {
+    if (fstatat(dfd, items[i].name, &st, 0) != 0) {
+      if (errno == ENOENT || errno == ENOTDIR) items[i].dead = 1;
+      continue;
+    }
+    if ((int64_t)st.st_size != items[i].size || (int64_t)st.st_mtime != items[i].mtime) items[i].dead = 1;
+  }
+  close(dfd);
+#else
+  struct JC_STAT st;
+  char path[PATHBUF_SIZE + 1];
+
+  for (uint64_t i = start; i < end; i++) {
+    if (dir->len + strlen(items[i].name) > PATHBUF_SIZE) continue;
+    memcpy(path, dir->path, dir->len);
+    strcpy(path + dir->len, items[i].name);
+    jc_errno = 0;
+    if (jc_stat(path, &st) != 0) {
+      if (jc_errno == ENOENT || jc_errno == ENOTDIR) items[i].dead = 1;
+      continue;
+    }
+    if ((int64_t)st.st_size != items[i].size || (int64_t)st.st_mtime != items[i].mtime) items[i].dead = 1;
+  }
+#endif
+  return;
+}
+
+
+static void *prune_hashdb_job(void *arg)
+{
+  struct hashdb_prune_job * const job = (struct hashdb_prune_job *)arg;
+  uint64_t g;
+
+  while (1) {
+#ifdef HASHDB_THREADS
+    pthread_mutex_lock(&job->lock);
+#endif
+    g = job->next++;
+#ifdef HASHDB_THREADS
+    pthread_mutex_unlock(&job->lock);
+#endif
+    if (g >= job->group_cnt) break;
+    check_prune_group(job->items, job->groups[g], job->groups[g + 1]);
+  }
+  return NULL;
+}
+
+
+/* Invalidate every entry whose file no longer exists or has a different
+ * size or modify time. Entries are sorted by path and checked a directory
+ * at a time by a pool of threads; the changed shards are compacted by the
+ * next save. */
+int prune_hashdb(uint64_t * const restrict checked, uint64_t * const restrict removed)
+{
+  struct hashdb_prune_list pl;
+  struct hashdb_prune_job job;
+  char path[PATHBUF_SIZE + 1];
+
+  memset(&pl, 0, sizeof(pl));
+  memset(&job, 0, sizeof(job));
+  *checked = 0;
+  *removed = 0;
+  load_all_shards();
+  for (size_t s = 0; s < shard_count; s++) collect_prune_records(&pl, shards[s]);
+  walk_hashdb(collect_prune_node, &pl);
+  if (pl.cnt == 0) return 0;
+  job.items = pl.items;
+  job.groups = sort_prune_list(&pl, &job.group_cnt);
+
+#ifdef HASHDB_THREADS
+  if (job.group_cnt > 1) {
+    pthread_t tid[HASHDB_PRUNE_THREADS];
+    const unsigned int threads = (job.group_cnt < HASHDB_PRUNE_THREADS) ? (unsigned int)job.group_cnt : HASHDB_PRUNE_THREADS;
+    unsigned int started;
+
+    LOUD(fprintf(stderr, "prune_hashdb: %u threads for %" PRIu64 " directories\n", threads, job.group_cnt);)
+    pthread_mutex_init(&job.lock, NULL);
+    for (started = 0; started < threads; started++)
+      if (pthread_create(&tid[started], NULL, prune_hashdb_job, &job) != 0) break;
+    /* Without any threads the work is done here */
+    if (started == 0) prune_hashdb_job(&job);
+    for (unsigned int i = 0; i < started; i++) pthread_join(tid[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+  } else
+#endif
+  prune_hashdb_job(&job);
+
+  for (uint64_t i = 0; i < pl.cnt; i++) {
+    struct hashdb_prune_item * const item = &pl.items[i];
+    hashdb_t *entry = item->entry;
+
+    if (item->dead == 0) continue;
+    if (entry == NULL) {
+      /* Shadow the mapped record with an invalidated entry */
+      const struct hashdb3_record * const rec = mapped_record(&item->shard->map, item->recno);
+      const size_t namelen = strlen(item->name);
+
+      if (item->dir->len + namelen > PATHBUF_SIZE) continue;
+      memcpy(path, item->dir->path, item->dir->len);
+      memcpy(path + item->dir->len, item->name, namelen + 1);
+      entry = new_hashdb_node(path, (int)(item->dir->len + namelen), rec->path_hash);
+      if (entry == NULL) jc_oom("prune_hashdb()");
+      entry->mtime = (time_t)rec->mtime;
+      entry->inode = (jdupes_ino_t)rec->inode;
+      entry->device = (dev_t)rec->device;
+      entry->size = (off_t)rec->size;
+    }
+    LOUD(fprintf(stderr, "prune_hashdb: removing '%s%s'\n", item->dir->path, item->name);)
+    entry->partialhash = 0;
+    entry->fullhash = 0;
+    entry->hashcount = 0;
+    hashdb_changed(entry);
+    (*removed)++;
+  }
+  *checked = pl.cnt;
+  rewrite_dirty_shards();
+  free(job.groups);
+  free(pl.items);
+  return 0;
+}
+
+
+/* Entries read from the database being merged in */
+struct hashdb_merge_list {
+  struct hashdb3_record *recs;
+  char *paths;
+  uint64_t cnt;
+  uint64_t alloc;
+  size_t paths_len;
+  size_t paths_alloc;
+};
+
+
+static void add_merge_entry(struct hashdb_merge_list * const restrict ml, const struct hashdb3_record * const restrict rec, const char * const restrict path)
+{
+  const size_t len = strlen(path);
+
+  if (ml->cnt == ml->alloc) {
+    ml->alloc = (ml->alloc == 0) ? 65536 : ml->alloc * 2;
+    ml->recs = (struct hashdb3_record *)realloc(ml->recs, sizeof(struct hashdb3_record) * (size_t)ml->alloc);
+    if (ml->recs == NULL) jc_oom("add_merge_entry()");
+  }
+  while (ml->paths_len + len + 1 > ml->paths_alloc) {
+    ml->paths_alloc = (ml->paths_alloc == 0) ? 1048576 : ml->paths_alloc * 2;
+    ml->paths = (char *)realloc(ml->paths, ml->paths_alloc);
+    if (ml->paths == NULL) jc_oom("add_merge_entry()");
+  }
+  ml->recs[ml->cnt] = *rec;
+  ml->recs[ml->cnt].path_off = ml->paths_len;
+  ml->recs[ml->cnt].path_len = (uint32_t)len;
+  ml->cnt++;
+  memcpy(ml->paths + ml->paths_len, path, len + 1);
+  ml->paths_len += len + 1;
+  return;
+}
+
+
+static int collect_merge_node(hashdb_t *cur, void *arg)
+{
+  struct hashdb3_record rec;
+  char path[PATHBUF_SIZE + 1];
+
+  if (cur->hashcount == 0) return 0;
+  node_to_record(cur, &rec);
+  hashdb_entry_path(cur, path);
+  add_merge_entry((struct hashdb_merge_list *)arg, &rec, path);
+  return 0;
+}
+
+
+/* Add the entries of the database srcname to dbname. An entry replaces
+ * one for the same path if its file is newer, or if it is the same file
+ * with more of it hashed. Nothing may be loaded yet; dbname stays loaded
+ * for saving. Returns the number of entries taken or a negative error. */
+int64_t merge_hash_database(const char * const restrict dbname, const char * const restrict srcname)
+{
+  struct hashdb_merge_list ml;
+  char buf[PATHBUF_SIZE + 1];
+  uint64_t live_cnt = 0;
+  int64_t taken = 0, err;
+  uint8_t *live;
+
+  memset(&ml, 0, sizeof(ml));
+  err = load_hash_database(srcname);
+  if (err < 0) return err;
+  load_all_shards();
+  for (size_t s = 0; s < shard_count; s++) {
+    const struct hashdb_map * const m = &shards[s]->map;
+
+    if (m->base == NULL) continue;
+    live = live_mapped_records(m, &live_cnt);
+    for (uint64_t i = 0; i < m->count; i++) {
+      struct hashdb3_record rec;
+
+      if (!(live[i >> 3] & (1U << (i & 7)))) continue;
+      /* Older v3 files have short records without a device */
+      memset(&rec, 0, sizeof(rec));
+      memcpy(&rec, mapped_record(m, i), (m->record_size < sizeof(rec)) ? m->record_size : sizeof(rec));
+      add_merge_entry(&ml, &rec, mapped_path(m, &rec, buf));
+    }
+    free(live);
+  }
+  walk_hashdb(collect_merge_node, &ml);
+  destroy_hashdb();
+  LOUD(fprintf(stderr, "merge_hash_database: %" PRIu64 " entries in '%s'\n", ml.cnt, srcname);)
+
+  err = load_hash_database(dbname);
+  if (err < 0) goto error_merge;
+  for (uint64_t i = 0; i < ml.cnt; i++) {
+    const struct hashdb3_record * const rec = &ml.recs[i];
+    const char * const path = ml.paths + rec->path_off;
+    struct hashdb_shard *shard;
+    hashdb_t *entry;
+    uint64_t path_hash;
+    int64_t mtime = 0, size = 0;
+    uint64_t inode = 0;
+    int hashcount = 0;
+
+    if (get_path_hash(path, &path_hash) != 0) continue;
+    /* Loading the shard first keeps its journal from adding a second entry */
+    shard = path_shard(path, path_dir_len(path, rec->path_len), 0);
+    entry = find_hashdb_node(path_hash, path);
+    if (entry != NULL) {
+      mtime = (int64_t)entry->mtime;
+      size = (int64_t)entry->size;
+      inode = (uint64_t)entry->inode;
+      hashcount = entry->hashcount;
+    } else if (shard != NULL) {
+      const struct hashdb3_record * const cur = find_mapped_entry(&shard->map, path_hash, path);
+
+      if (cur != NULL && cur->hashcount >= 1 && cur->hashcount <= 2) {
+        mtime = cur->mtime;
+        size = cur->size;
+        inode = cur->inode;
+        hashcount = cur->hashcount;
+      }
+    }
+    if (hashcount != 0 && rec->mtime < mtime) continue;
+    if (hashcount != 0 && rec->mtime == mtime && (rec->size != size || rec->inode != inode || rec->hashcount <= hashcount)) continue;
+    if (entry == NULL) entry = new_hashdb_node(path, (int)rec->path_len, path_hash);
+    if (entry == NULL) jc_oom("merge_hash_database()");
+    entry->mtime = (time_t)rec->mtime;
+    entry->inode = (jdupes_ino_t)rec->inode;
+    entry->device = (dev_t)rec->device;
+    entry->size = (off_t)rec->size;
+    entry->partialhash = rec->partialhash;
+    entry->fullhash = rec->fullhash;
+    entry->hashcount = rec->hashcount;
+    hashdb_changed(entry);
+    taken++;
+  }
+  rewrite_dirty_shards();
+  err = taken;
+
+error_merge:
+  free(ml.recs);
+  free(ml.paths);
+  return err;
+}
+
+
+/* Count the entries of the whole database */
+static int count_stats_node(hashdb_t *cur, void *arg)
+{
+  struct hashdb_stats * const st = (struct hashdb_stats *)arg;
+
+  if (cur->hashcount == 0) st->invalid++;
+  else st->entries++;
+  return 0;
+}
+
+
+void get_hashdb_stats(struct hashdb_stats * const restrict st)
+{
+  char buf[PATHBUF_SIZE + 1];
+
+  memset(st, 0, sizeof(struct hashdb_stats));
+  load_all_shards();
+  for (size_t s = 0; s < shard_count; s++) {
+    const struct hashdb_map * const m = &shards[s]->map;
+
+    st->shards++;
+    st->db_bytes += shards[s]->base_size;
+    st->journal_bytes += shards[s]->journal_size;
+    for (uint64_t i = 0; i < m->count; i++) {
+      const struct hashdb3_record * const rec = mapped_record(m, i);
+      const char * const path = mapped_path(m, rec, buf);
+
+      if (path == NULL || rec->hashcount < 1 || rec->hashcount > 2) st->invalid++;
+      else if (find_hashdb_node(rec->path_hash, path) != NULL) st->superseded++;
+      else st->entries++;
+    }
+  }
+  walk_hashdb(count_stats_node, st);
+  return;
 }
@@ -11,25 +11,57 @@ extern "C" {
 #include <stdint.h>
 #include "jdupes.h"
 
+/* Paths are stored as a shared directory plus the file name */
+struct hashdb_dir;
+
 typedef struct _hashdb {
-  struct _hashdb *left;
-  struct _hashdb *right;
   uint64_t path_hash;
-  char *path;
+  struct hashdb_dir *dir;
+  char *name;
   uint64_t partialhash;
   uint64_t fullhash;
   jdupes_ino_t inode;
+  dev_t device;
   off_t size;
   time_t mtime;
   uint_fast8_t hashcount;
 } hashdb_t;
 
+/* Reported by get_hashdb_stats(); superseded records are still in a
+ * database file but replaced by newer journal entries */
+struct hashdb_stats {
+  uint64_t shards;
+  uint64_t entries;
+  uint64_t invalid;
+  uint64_t superseded;
+  uint64_t db_bytes;
+  uint64_t journal_bytes;
+};
+
 extern int save_hash_database(const char * const restrict dbname, const int destroy);
-extern hashdb_t *add_hashdb_entry(char *in_path, const int in_pathlen, const file_t *check);
+extern hashdb_t *add_hashdb_entry(const char *in_path, const int in_pathlen, const file_t *check);
 extern int64_t load_hash_database(const char * const restrict dbname);
+extern void start_hash_database_load(const char * const restrict dbname, char **roots, const int root_cnt);
+extern int64_t finish_hash_database_load(void);
 extern int read_hashdb_entry(file_t *file);
 extern uint64_t dump_hashdb(void);
-extern int cleanup_hashdb(uint64_t *cnt, hashdb_t *cur);
+extern int prune_hashdb(uint64_t * const restrict checked, uint64_t * const restrict removed);
+extern int64_t merge_hash_database(const char * const restrict dbname, const char * const restrict srcname);
+extern void get_hashdb_stats(struct hashdb_stats * const restrict st);
+extern void mark_hashdb_dirty(void);
+
+#ifdef DEBUG
+/* Load time, text parser threads (0 = mapped v3 database), lookups that
+ * had to wait for a background load, files found under a new path and
+ * shards of a sharded database loaded out of all of them */
+extern uint64_t hashdb_load_usec;
+extern unsigned int hashdb_load_threads;
+extern uint64_t hashdb_deferred;
+extern uint64_t hashdb_moved;
+extern uint64_t hashdb_merged;
+extern size_t hashdb_shards_loaded;
+extern size_t hashdb_shards;
+#endif
 
 #ifdef __cplusplus
 }
@@ -25,11 +25,13 @@ int main(int argc, char **argv)
 #endif
 {
   const char * const default_name = "jdupes_hashdb.txt";
-  const char *dbname, *action;
+  const char *dbname, *action, *srcname = NULL;
+  struct hashdb_stats st;
   int64_t hdbsize;
-  uint64_t cnt;
+  uint64_t checked, removed;
+  int written;
 
-  if (argc != 3) goto util_usage;
+  if (argc < 3 || argc > 4) goto util_usage;
 
 #ifdef UNICODE
   /* Create a UTF-8 **argv from the wide version */
@@ -49,8 +51,26 @@ int main(int argc, char **argv)
 
   dbname = argv[1];
   action = argv[2];
+  if (argc == 4) srcname = argv[3];
+  /* Only merge takes a second database */
+  if ((srcname != NULL) != (strcmp(action, "merge") == 0)) goto util_usage;
 
   if (strcmp(dbname, ".") == 0) dbname = default_name;
+  if (srcname != NULL) {
+    if (strcmp(srcname, ".") == 0) srcname = default_name;
+    fprintf(stderr, "Merging '%s' into '%s'\n", srcname, dbname);
+    /* Two databases are loaded; only the totals are worth printing */
+    SETFLAG(flags, F_HIDEPROGRESS);
+    hdbsize = merge_hash_database(dbname, srcname);
+    if (hdbsize < 0) goto error_hashdb_merge;
+    written = save_hash_database(dbname, 1);
+    if (written < 0) goto error_hashdb_save;
+    /* Nothing is written when the merge changed no shard */
+    if (written > 0) fprintf(stderr, "Merged %" PRId64 " entries; wrote %d entries to '%s'\n", hdbsize, written, dbname);
+    else fprintf(stderr, "Merged %" PRId64 " entries; '%s' is unchanged\n", hdbsize, dbname);
+    return 0;
+  }
+
   hdbsize = load_hash_database(dbname);
   if (hdbsize < 0) goto error_load_hashdb;
   if (hdbsize > 0 && !ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "%" PRId64 " entries loaded.\n", hdbsize);
@@ -59,22 +79,56 @@ int main(int argc, char **argv)
   if (strcmp(action, "dump") == 0) {
     dump_hashdb();
     return 0;
-  } else if (strcmp(action, "clean") == 0) {
-    fprintf(stderr, "Cleaning entries\n");
-    if (cleanup_hashdb(&cnt, NULL) != 0) goto error_hashdb_cleanup;
+  } else if (strcmp(action, "convert") == 0 || strcmp(action, "compact") == 0) {
+    /* Rewrite in the current format even if nothing changed */
+    mark_hashdb_dirty();
+    written = save_hash_database(dbname, 1);
+    if (written < 0) goto error_hashdb_save;
+    fprintf(stderr, "Wrote %d entries to '%s'\n", written, dbname);
+  } else if (strcmp(action, "prune") == 0 || strcmp(action, "clean") == 0) {
+    fprintf(stderr, "Pruning entries\n");
+    if (prune_hashdb(&checked, &removed) != 0) goto error_hashdb_cleanup;
+    fprintf(stderr, "Checked %" PRIu64 " entries, removed %" PRIu64 "\n", checked, removed);
+    if (removed > 0) {
+      written = save_hash_database(dbname, 1);
+      if (written < 0) goto error_hashdb_save;
+      fprintf(stderr, "Wrote %d entries to '%s'\n", written, dbname);
+    }
+  } else if (strcmp(action, "stats") == 0) {
+    get_hashdb_stats(&st);
+    printf("Shards:             %" PRIu64 "\n", st.shards);
+    printf("Entries:            %" PRIu64 "\n", st.entries);
+    printf("Invalid entries:    %" PRIu64 " (%.1f%%)\n", st.invalid,
+        (st.entries + st.invalid == 0) ? 0.0 : (double)st.invalid * 100.0 / (double)(st.entries + st.invalid));
+    printf("Superseded records: %" PRIu64 "\n", st.superseded);
+    printf("Database bytes:     %" PRIu64 "\n", st.db_bytes);
+    printf("Journal bytes:      %" PRIu64 "\n", st.journal_bytes);
   } else goto error_action;
 
   return 0;
 
 util_usage:
   printf("jdupes hashdb utility %s (%s)\n", VER, VERDATE);
-  printf("usage: %s hash_database_name action\n", argv[0]);
+  printf("usage: %s hash_database_name action [other_database]\n", argv[0]);
   printf("If the name is a period '.' then 'jdupes_hashdb.txt' will be used\n");
-  printf("Actions: none yet\n");
+  printf("If the name is a directory then it holds a sharded database\n");
+  printf("Actions: dump     print the database as a v2 text database\n");
+  printf("         convert  rewrite the database in the current binary format\n");
+  printf("         compact  same as convert: fold the journals into the database\n");
+  printf("                  and drop invalidated entries\n");
+  printf("         prune    remove entries for files that are gone or have changed\n");
+  printf("         merge    add the entries of other_database to the database\n");
+  printf("         stats    print entry counts, sizes and the share of invalid entries\n");
   exit(EXIT_FAILURE);
 error_hashdb_cleanup:
   fprintf(stderr, "error cleaning up hash database '%s'\n", dbname);
   exit(EXIT_FAILURE);
+error_hashdb_merge:
+  fprintf(stderr, "error merging hash database '%s' into '%s'\n", srcname, dbname);
+  exit(EXIT_FAILURE);
+error_hashdb_save:
+  fprintf(stderr, "error saving hash database '%s'\n", dbname);
+  exit(EXIT_FAILURE);
 error_load_hashdb:
   fprintf(stderr, "error: cannot open hash database '%s'\n", dbname);
   exit(EXIT_FAILURE);
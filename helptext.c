@@ -47,6 +47,9 @@ const char *feature_flags[] = {
   #ifdef NO_HASHDB
   "nohashdb",
   #endif
+  #ifdef NO_JOURNAL
+  "nojournal",
+  #endif
   #ifdef NO_NUMSORT
   "nojsort",
   #endif
@@ -62,6 +65,9 @@ const char *feature_flags[] = {
   #ifdef NO_PERMS
   "noperm",
   #endif
+  #ifdef NO_STREAM
+  "nostream",
+  #endif
   #ifdef NO_SYMLINKS
   "noslink",
   #endif
@@ -101,9 +107,17 @@ void help_text(void)
   printf(" -0 --print-null  \toutput nulls instead of CR/LF (like 'find -print0')\n");
   printf(" -1 --one-file-system\tdo not match files on different filesystems/devices\n");
   printf(" -A --no-hidden    \texclude hidden files from consideration\n");
+#if defined ENABLE_DEDUPE && defined __linux__
+  printf(" -b --dedupe-blocks=#\tdeduplicate identical runs of #-KiB blocks shared\n");
+  printf("                  \tby partially matching files instead of whole files\n");
+#endif
 #ifdef ENABLE_DEDUPE
   printf(" -B --dedupe      \tdo a copy-on-write (reflink/clone) deduplication\n");
 #endif
+#if defined ENABLE_DEDUPE && defined __linux__ && !defined NO_HARDLINKS
+  printf(" -c --reflink     \treplace each duplicate with a reflink clone of the\n");
+  printf("                  \tfirst file (no kernel compare; see the manual)\n");
+#endif
 #ifndef NO_CHUNKSIZE
   printf(" -C --chunk-size=#\toverride I/O chunk size in KiB (min %d, max %d)\n", MIN_CHUNK_SIZE / 1024, MAX_CHUNK_SIZE / 1024);
 #endif /* NO_CHUNKSIZE */
@@ -131,6 +145,9 @@ void help_text(void)
 #ifndef NO_USER_ORDER
   printf(" -I --isolate     \tfiles in the same specified directory won't match\n");
 #endif
+#ifndef NO_JOURNAL
+  printf(" -J --journal=file\trecord completed dedupe/link actions in a journal\n");
+#endif /* NO_JOURNAL */
 #ifndef NO_JSON
   printf(" -j --json        \tproduce JSON (machine-readable) output\n");
 #endif /* NO_JSON */
@@ -184,11 +201,20 @@ void help_text(void)
   printf(" -U --no-trav-check\tdisable double-traversal safety check (BE VERY CAREFUL)\n");
   printf("                  \tThis fixes a Google Drive File Stream recursion issue\n");
   printf(" -v --version     \tdisplay jdupes version and license information\n");
+#ifndef NO_JOURNAL
+  printf(" -w --resume      \twith --journal, skip files already handled by an\n");
+  printf("                  \tinterrupted run if they have not changed since\n");
+#endif /* NO_JOURNAL */
+#ifndef NO_STREAM
+  printf(" -W --stream      \tprint each match set as soon as all files of its size\n");
+  printf("                  \tare scanned instead of at the end; with -j, print one\n");
+  printf("                  \tJSON object per set and line (NDJSON)\n");
+#endif /* NO_STREAM */
 #ifndef NO_EXTFILTER
   printf(" -X --ext-filter=x:y\tfilter files based on specified criteria\n");
   printf("                  \tUse '-X help' for detailed extfilter help\n");
 #endif /* NO_EXTFILTER */
-  printf(" -y --hash-db=file\tuse a hash database text file to speed up repeat runs\n");
+  printf(" -y --hash-db=file\tuse a hash database file to speed up repeat runs\n");
   printf("                  \tPassing '-y .' will expand to  '-y jdupes_hashdb.txt'\n");
   printf(" -z --zero-match  \tconsider zero-length files to be duplicates\n");
   printf(" -Z --soft-abort  \tIf the user aborts (i.e. CTRL-C) act on matches so far\n");
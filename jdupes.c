@@ -37,11 +37,17 @@
  #include "hashdb.h"
 #endif
 #include "helptext.h"
+#ifndef NO_JOURNAL
+ #include "journal.h"
+#endif
 #include "loaddir.h"
 #include "match.h"
 #include "progress.h"
 #include "interrupt.h"
 #include "sort.h"
+#ifndef NO_STREAM
+ #include "stream.h"
+#endif
 #ifndef NO_TRAVCHECK
  #include "travcheck.h"
 #endif
@@ -60,6 +66,7 @@
 #include "act_deletefiles.h"
 #ifdef ENABLE_DEDUPE
  #include "act_dedupefiles.h"
+ #include "act_dedupeblocks.h"
 #endif
 #include "act_linkfiles.h"
 #include "act_printmatches.h"
@@ -104,6 +111,12 @@ uintmax_t filecount = 0, progress = 0, item_progress = 0, dupecount = 0;
 unsigned int small_file = 0, partial_hash = 0, partial_elim = 0;
 unsigned int full_hash = 0, partial_to_full = 0, hash_fail = 0;
 uintmax_t comparisons = 0;
+ #ifndef NO_HARDLINKS
+unsigned int hardlink_alias = 0;
+ #endif
+ #ifndef NO_JOURNAL
+unsigned int journal_skip = 0;
+ #endif
  #ifdef ON_WINDOWS
   #ifndef NO_HARDLINKS
   unsigned int hll_exclude = 0;
@@ -175,6 +188,9 @@ int main(int argc, char **argv)
   int64_t hdbsize;
   uint64_t hdbout;
 #endif
+#ifndef NO_JOURNAL
+  char *journal_name = NULL;
+#endif
 
 #ifndef NO_GETOPT_LONG
   static const struct option long_options[] =
@@ -184,7 +200,9 @@ int main(int argc, char **argv)
     { "one-file-system", 0, 0, '1' },
     { "", 0, 0, '9' },
     { "no-hidden", 0, 0, 'A' },
+    { "dedupe-blocks", 1, 0, 'b' },
     { "dedupe", 0, 0, 'B' },
+    { "reflink", 0, 0, 'c' },
     { "chunk-size", 1, 0, 'C' },
     { "debug", 0, 0, 'D' },
     { "delete", 0, 0, 'd' },
@@ -195,6 +213,7 @@ int main(int argc, char **argv)
     { "help", 0, 0, 'h' },
     { "isolate", 0, 0, 'I' },
     { "reverse", 0, 0, 'i' },
+    { "journal", 1, 0, 'J' },
     { "json", 0, 0, 'j' },
 /*    { "skip-hash", 0, 0, 'K' }, */
     { "link-hard", 0, 0, 'L' },
@@ -211,12 +230,14 @@ int main(int argc, char **argv)
     { "recurse:", 0, 0, 'R' },
     { "recurse", 0, 0, 'r' },
     { "size", 0, 0, 'S' },
+    { "stream", 0, 0, 'W' },
     { "symlinks", 0, 0, 's' },
     { "partial-only", 0, 0, 'T' },
     { "no-change-check", 0, 0, 't' },
     { "no-trav-check", 0, 0, 'U' },
     { "print-unique", 0, 0, 'u' },
     { "version", 0, 0, 'v' },
+    { "resume", 0, 0, 'w' },
     { "ext-filter", 1, 0, 'X' },
     { "hash-db", 1, 0, 'y' },
     { "soft-abort", 0, 0, 'Z' },
@@ -228,7 +249,7 @@ int main(int argc, char **argv)
  #define GETOPT getopt
 #endif
 
-#define GETOPT_STRING "@019ABC:DdEefHhIijKLlMmNnOo:P:pQqRrSsTtUuVvX:y:Zz"
+#define GETOPT_STRING "@019Ab:BcC:DdEefHhIiJ:jKLlMmNnOo:P:pQqRrSsTtUuVvWwX:y:Zz"
 
   /* Verify libjodycode compatibility before going further */
   if (libjodycode_version_check(1, 0) != 0) {
@@ -327,6 +348,24 @@ int main(int argc, char **argv)
       LOUD(fprintf(stderr, "opt: CoW/block-level deduplication enabled (--dedupe)\n");)
       break;
 #endif /* ENABLE_DEDUPE */
+#if defined ENABLE_DEDUPE && defined __linux__
+    case 'b':
+      blockdedupe_size = (size_t)((strtol(optarg, NULL, 10) & 0x0ffffffcL) << 10);  /* Align to 4K sizes */
+      if (blockdedupe_size < 4096 || blockdedupe_size > BLOCKDEDUPE_MAX_SIZE) {
+        fprintf(stderr, "error: invalid block size for --dedupe-blocks (must be 4 - %d KiB in multiples of 4)\n", BLOCKDEDUPE_MAX_SIZE / 1024);
+        exit(EXIT_FAILURE);
+      }
+      SETFLAG(a_flags, FA_DEDUPEBLOCKS);
+      LOUD(fprintf(stderr, "opt: block-level partial deduplication enabled (--dedupe-blocks)\n");)
+      break;
+#endif /* ENABLE_DEDUPE && __linux__ */
+#if defined ENABLE_DEDUPE && defined __linux__ && !defined NO_HARDLINKS
+    case 'c':
+      SETFLAG(a_flags, FA_REFLINKFILES);
+      /* Cloning never reads the data, so it is only as safe as the match */
+      LOUD(fprintf(stderr, "opt: replace duplicates with reflink clones (--reflink)\n");)
+      break;
+#endif /* ENABLE_DEDUPE && __linux__ && !NO_HARDLINKS */
 #ifndef NO_CHUNKSIZE
     case 'C':
       manual_chunk_size = (strtol(optarg, NULL, 10) & 0x0ffffffcL) << 10;  /* Align to 4K sizes */
@@ -398,6 +437,22 @@ int main(int argc, char **argv)
       fprintf(stderr, "warning: -I and -O are disabled and ignored in this build\n");
       break;
 #endif
+#ifndef NO_JOURNAL
+    case 'J':
+      journal_name = optarg;
+      LOUD(fprintf(stderr, "opt: record completed actions in a journal (--journal)\n");)
+      break;
+    case 'w':
+      SETFLAG(flags, F_RESUME);
+      LOUD(fprintf(stderr, "opt: skip work recorded in the journal (--resume)\n");)
+      break;
+#endif /* NO_JOURNAL */
+#ifndef NO_STREAM
+    case 'W':
+      SETFLAG(a_flags, FA_STREAM);
+      LOUD(fprintf(stderr, "opt: print match sets as soon as they are complete (--stream)\n");)
+      break;
+#endif /* NO_STREAM */
 #ifndef NO_JSON
     case 'j':
       SETFLAG(a_flags, FA_PRINTJSON);
@@ -593,6 +648,13 @@ skip_partialonly_noise:
     fprintf(stderr, "warning: option --dedupe overrides the behavior of --hardlinks\n");
 #endif
 
+#ifndef NO_JOURNAL
+  if (ISFLAG(flags, F_RESUME) && journal_name == NULL) {
+    fprintf(stderr, "option --resume requires --journal\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
   /* Debugging mode: dump all set flags */
   DBG(if (ISFLAG(flags, F_DEBUG)) dump_all_flags();)
 
@@ -604,14 +666,23 @@ skip_partialonly_noise:
       !!ISFLAG(a_flags, FA_PRINTJSON) +
       !!ISFLAG(a_flags, FA_PRINTUNIQUE) +
       !!ISFLAG(a_flags, FA_ERRORONDUPE) +
-      !!ISFLAG(a_flags, FA_DEDUPEFILES);
+      !!ISFLAG(a_flags, FA_DEDUPEFILES) +
+      !!ISFLAG(a_flags, FA_DEDUPEBLOCKS) +
+      !!ISFLAG(a_flags, FA_REFLINKFILES);
 
   if (pm > 1) {
-      fprintf(stderr, "Only one of --summarize, --print-summarize, --delete, --link-hard,\n--link-soft, --json, --error-on-dupe, or --dedupe may be used\n");
+      fprintf(stderr, "Only one of --summarize, --print-summarize, --delete, --link-hard,\n--link-soft, --json, --error-on-dupe, --dedupe, --dedupe-blocks, or --reflink may be used\n");
       exit(EXIT_FAILURE);
   }
   if (pm == 0) SETFLAG(a_flags, FA_PRINTMATCHES);
 
+#ifndef NO_STREAM
+  if (ISFLAG(a_flags, FA_STREAM) && !ISFLAG(a_flags, FA_PRINTMATCHES) && !ISFLAG(a_flags, FA_PRINTJSON)) {
+    fprintf(stderr, "--stream only works when printing matches (plain, --print-summarize, or --json)\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
+
 #ifndef ON_WINDOWS
   /* Catch SIGUSR1 and use it to enable -Z */
   signal(SIGUSR1, catch_sigusr1);
@@ -621,13 +692,18 @@ skip_partialonly_noise:
   signal(SIGINT, catch_interrupt);
 
 #ifndef NO_HASHDB
-  if (ISFLAG(flags, F_HASHDB)) {
-    hdbsize = load_hash_database(hashdb_name);
-    if (hdbsize < 0) goto error_load_hashdb;
-    if (hdbsize > 0 && !ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "%" PRId64 " entries loaded.\n", hdbsize);
-  }
+  /* Loads in the background while the directories are scanned */
+  if (ISFLAG(flags, F_HASHDB)) start_hash_database_load(hashdb_name, argv + optind, argc - optind);
 #endif /* NO_HASHDB */
 
+#ifndef NO_JOURNAL
+  if (journal_name != NULL) {
+    int jcount = journal_open(journal_name, ISFLAG(flags, F_RESUME));
+    if (jcount < 0) exit(EXIT_FAILURE);
+    if (jcount > 0 && !ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "%d completed actions loaded from the journal.\n", jcount);
+  }
+#endif /* NO_JOURNAL */
+
   /* Progress indicator every second */
   if (!ISFLAG(flags, F_HIDEPROGRESS)) {
     jc_start_alarm(1, 1);
@@ -675,6 +751,14 @@ skip_partialonly_noise:
   /* Force a progress update */
   if (!ISFLAG(flags, F_HIDEPROGRESS)) update_phase1_progress("items");
 
+#ifndef NO_HASHDB
+  if (ISFLAG(flags, F_HASHDB)) {
+    hdbsize = finish_hash_database_load();
+    if (hdbsize < 0) goto error_load_hashdb;
+    if (hdbsize > 0 && !ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\n%" PRId64 " entries loaded.", hdbsize);
+  }
+#endif /* NO_HASHDB */
+
 /* We don't need the double traversal check tree anymore */
 #ifndef NO_TRAVCHECK
   travcheck_free(NULL);
@@ -692,6 +776,30 @@ skip_partialonly_noise:
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\n");
   if (!files) goto skip_file_scan;
 
+#ifndef NO_HARDLINKS
+  /* Read each hard linked inode only once */
+  collapse_hardlinks(files);
+#endif
+
+#if defined ENABLE_DEDUPE && defined __linux__
+  /* Partial duplicates are found by block fingerprints, not file matching */
+  if (ISFLAG(a_flags, FA_DEDUPEBLOCKS)) {
+    dedupeblocks(files);
+    goto skip_file_scan;
+  }
+#endif
+
+#ifndef NO_STREAM
+  /* Sets of a size are printed as soon as all files of that size are done */
+  if (ISFLAG(a_flags, FA_STREAM)) {
+ #ifndef NO_MTIME
+    stream_init(files, ordertype);
+ #else
+    stream_init(files, ORDER_NAME);
+ #endif
+  }
+#endif
+
   curfile = files;
   progress = 0;
 
@@ -709,6 +817,19 @@ skip_partialonly_noise:
 
     LOUD(fprintf(stderr, "\nMAIN: current file: %s\n", curfile->d_name));
 
+#ifndef NO_HARDLINKS
+    /* Links collapsed into another file are matched through that file */
+    if (ISFLAG(curfile->flags, FF_HARDLINK_ALIAS)) goto skip_full_check;
+#endif
+
+#ifndef NO_JOURNAL
+    /* Files handled by an interrupted run are not read again */
+    if (ISFLAG(flags, F_RESUME) && journal_done(curfile)) {
+      DBG(journal_skip++;)
+      goto skip_full_check;
+    }
+#endif
+
     if (!checktree) registerfile(&checktree, NONE, curfile);
     else match = checkmatch(checktree, curfile);
 
@@ -727,22 +848,14 @@ skip_partialonly_noise:
 #endif
           ) {
         LOUD(fprintf(stderr, "MAIN: notice: hard linked, quick, or partial-only match (-H/-Q/-T)\n"));
-#ifndef NO_MTIME
-        registerpair(match, curfile, (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
-#else
-        registerpair(match, curfile, sort_pairs_by_filename);
-#endif
+        registerpair(match, curfile);
         dupecount++;
         goto skip_full_check;
       }
 
       if (confirmmatch(curfile->d_name, (*match)->d_name, curfile->size) == 0) {
         LOUD(fprintf(stderr, "MAIN: registering matched file pair\n"));
-#ifndef NO_MTIME
-        registerpair(match, curfile, (ordertype == ORDER_TIME) ? sort_pairs_by_mtime : sort_pairs_by_filename);
-#else
-        registerpair(match, curfile, sort_pairs_by_filename);
-#endif
+        registerpair(match, curfile);
         dupecount++;
       } else {
 	goto skip_full_check;
@@ -751,6 +864,9 @@ skip_partialonly_noise:
     }
 
 skip_full_check:
+#ifndef NO_STREAM
+    if (ISFLAG(a_flags, FA_STREAM)) stream_file_done(curfile);
+#endif
     curfile = curfile->next;
 
     check_sigusr1();
@@ -764,6 +880,28 @@ skip_full_check:
   if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
 
 skip_file_scan:
+#ifndef NO_STREAM
+  /* Streamed sets were finished and printed as their size groups completed */
+  if (ISFLAG(a_flags, FA_STREAM)) {
+    if (files != NULL) stream_finish();
+    goto skip_set_finish;
+  }
+#endif
+#ifndef NO_HARDLINKS
+  /* Put collapsed hard links into the match sets of their representatives */
+  expand_hardlinks(files);
+#endif /* NO_HARDLINKS */
+
+  /* Put every match set in the requested order */
+#ifndef NO_MTIME
+  sort_match_sets(files, ordertype);
+#else
+  sort_match_sets(files, ORDER_NAME);
+#endif
+#ifndef NO_STREAM
+skip_set_finish:
+#endif
+
   /* Stop catching CTRL+C and firing alarms */
   signal(SIGINT, SIG_DFL);
   if (!ISFLAG(flags, F_HIDEPROGRESS)) jc_stop_alarm();
@@ -780,24 +918,31 @@ skip_file_scan:
   }
 #endif /* NO_DELETE */
 #ifndef NO_SYMLINKS
-  if (ISFLAG(a_flags, FA_MAKESYMLINKS)) linkfiles(files, 0, 0);
+  if (ISFLAG(a_flags, FA_MAKESYMLINKS)) linkfiles(files, LINK_SYMLINK, 0);
 #endif /* NO_SYMLINKS */
 #ifndef NO_HARDLINKS
-  if (ISFLAG(a_flags, FA_HARDLINKFILES)) linkfiles(files, 1, 0);
+  if (ISFLAG(a_flags, FA_HARDLINKFILES)) linkfiles(files, LINK_HARDLINK, 0);
 #endif /* NO_HARDLINKS */
 #ifdef ENABLE_DEDUPE
   if (ISFLAG(a_flags, FA_DEDUPEFILES)) dedupefiles(files);
+ #if defined __linux__ && !defined NO_HARDLINKS
+  if (ISFLAG(a_flags, FA_REFLINKFILES)) linkfiles(files, LINK_REFLINK, 0);
+ #endif
 #endif /* ENABLE_DEDUPE */
-  if (ISFLAG(a_flags, FA_PRINTMATCHES)) printmatches(files);
+  if (ISFLAG(a_flags, FA_PRINTMATCHES) && !ISFLAG(a_flags, FA_STREAM)) printmatches(files);
   if (ISFLAG(a_flags, FA_PRINTUNIQUE)) printunique(files);
 #ifndef NO_JSON
-  if (ISFLAG(a_flags, FA_PRINTJSON)) printjson(files, argc, argv);
+  if (ISFLAG(a_flags, FA_PRINTJSON) && !ISFLAG(a_flags, FA_STREAM)) printjson(files, argc, argv);
 #endif /* NO_JSON */
   if (ISFLAG(a_flags, FA_SUMMARIZEMATCHES)) {
     if (ISFLAG(a_flags, FA_PRINTMATCHES)) printf("\n\n");
     summarizematches(files);
   }
 
+#ifndef NO_JOURNAL
+  if (journal_name != NULL) journal_close();
+#endif
+
 #ifndef NO_HASHDB
   if (ISFLAG(flags, F_HASHDB)) {
     hdbout = save_hash_database(hashdb_name, 1);
@@ -819,6 +964,22 @@ skip_all_scan_code:
         partial_hash, PARTIAL_HASH_SIZE >> 10, small_file, full_hash, partial_to_full,
         partial_elim, hash_fail, (unsigned int)sizeof(uint64_t)*8);
     fprintf(stderr, "%" PRIuMAX " total files, %" PRIuMAX " comparisons\n", filecount, comparisons);
+ #ifndef NO_HARDLINKS
+    if (hardlink_alias > 0) fprintf(stderr, "%u hard links matched through another link to the same file\n", hardlink_alias);
+ #endif
+ #ifndef NO_HASHDB
+    if (ISFLAG(flags, F_HASHDB)) {
+      if (hashdb_load_threads > 0) fprintf(stderr, "Hash database loaded in %" PRIu64 " ms (%u parser threads)\n", hashdb_load_usec / 1000, hashdb_load_threads);
+      else fprintf(stderr, "Hash database loaded in %" PRIu64 " ms (mapped)\n", hashdb_load_usec / 1000);
+      if (hashdb_deferred > 0) fprintf(stderr, "%" PRIu64 " hash database lookups waited for the background load\n", hashdb_deferred);
+      if (hashdb_moved > 0) fprintf(stderr, "%" PRIu64 " renamed or moved files found in the hash database\n", hashdb_moved);
+      if (hashdb_merged > 0) fprintf(stderr, "%" PRIu64 " hash database changes from other processes merged\n", hashdb_merged);
+      if (hashdb_shards > 0) fprintf(stderr, "%zu of %zu hash database shards loaded\n", hashdb_shards_loaded, hashdb_shards);
+    }
+ #endif
+ #ifndef NO_JOURNAL
+    if (journal_skip > 0) fprintf(stderr, "%u files skipped as already handled according to the journal\n", journal_skip);
+ #endif
  #ifndef NO_CHUNKSIZE
     if (manual_chunk_size > 0) fprintf(stderr, "I/O chunk size: %ld KiB (manually set)\n", manual_chunk_size >> 10);
     else {
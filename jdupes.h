@@ -70,6 +70,9 @@ extern "C" {
 extern unsigned int small_file, partial_hash, partial_elim;
 extern unsigned int full_hash, partial_to_full, hash_fail;
 extern uintmax_t comparisons;
+ #ifndef NO_HARDLINKS
+extern unsigned int hardlink_alias;
+ #endif
  #ifdef ON_WINDOWS
   #ifndef NO_HARDLINKS
   extern unsigned int hll_exclude;
@@ -96,6 +99,11 @@ extern uintmax_t comparisons;
  #define auto_chunk_size CHUNK_SIZE
 #endif /* NO_CHUNKSIZE */
 
+/* How far ahead of the hashing/comparison position the kernel is asked to read */
+#ifndef READAHEAD_SIZE
+ #define READAHEAD_SIZE 1048576
+#endif
+
 /* Low memory option overrides */
 #ifdef LOW_MEMORY
  #ifndef NO_PERMS
@@ -149,6 +157,7 @@ extern uint64_t flags, a_flags, p_flags;
 #define F_NOCHANGECHECK		(1ULL << 17)
 #define F_NOTRAVCHECK		(1ULL << 18)
 #define F_SKIPHASH		(1ULL << 19)
+#define F_RESUME		(1ULL << 20)
 #define F_BENCHMARKSTOP		(1ULL << 29)
 #define F_HASHDB		(1ULL << 30)
 
@@ -168,6 +177,9 @@ extern uint64_t flags, a_flags, p_flags;
 #define FA_PRINTNULL		(1U << 9)
 #define FA_PRINTJSON		(1U << 10)
 #define FA_ERRORONDUPE		(1U << 11)
+#define FA_DEDUPEBLOCKS		(1U << 12)
+#define FA_REFLINKFILES		(1U << 13)
+#define FA_STREAM		(1U << 14)
 
 /* Per-file true/false flags */
 #define FF_VALID_STAT		(1U << 0)
@@ -176,6 +188,7 @@ extern uint64_t flags, a_flags, p_flags;
 #define FF_HAS_DUPES		(1U << 3)
 #define FF_IS_SYMLINK		(1U << 4)
 #define FF_NOT_UNIQUE		(1U << 5)
+#define FF_HARDLINK_ALIAS	(1U << 6)
 
 /* Extra print flags */
 #define PF_PARTIAL		(1U << 0)
@@ -218,6 +231,7 @@ typedef struct _file {
  #else
   nlink_t nlink;
  #endif /* ON_WINDOWS */
+  struct _file *hardlinks;  /* Other links to this inode that are not read */
 #endif
 #ifndef NO_PERMS
   uid_t uid;
@@ -0,0 +1,284 @@
+/* Action progress journal for resuming interrupted runs
+ * This file is part of jdupes; see jdupes.c for license information
+ *
+ * Every completed dedupe or link action is appended to the journal as
+ * one record and flushed immediately, so a crash loses at most the record
+ * being written. A partial record is cut off when resuming. With
+ * resume enabled, destination files recorded in an earlier run are
+ * skipped during the scan if neither they nor their source have changed
+ * since; they are not read, hashed, or acted upon again.
+ *
+ * Header: "jdupes journal:2"
+ * Record: action,size,src_mtime,dst_mtime,dst_inode,src_len,dst_len,<src><dst>
+ * (numbers in hex; paths are read by length since they may hold newlines,
+ * and a newline follows the dst) */
+
+#ifndef NO_JOURNAL
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef ON_WINDOWS
+ #include <io.h>
+#endif
+#include "jdupes.h"
+#include "libjodycode.h"
+#include "likely_unlikely.h"
+#include "journal.h"
+
+#define JOURNAL_HEADER "jdupes journal:2\n"
+
+/* One completed action from an earlier run */
+struct journal_rec {
+  char *src;
+  char *dst;
+  off_t size;
+  time_t src_mtime;
+  time_t dst_mtime;
+  jdupes_ino_t dst_inode;
+  size_t seq;
+};
+
+static FILE *journal = NULL;
+static struct journal_rec *recs = NULL;
+static size_t reccount = 0;
+/* End of the last complete record in the loaded journal */
+static long journal_end = -1;
+
+
+static int cmp_journal_rec(const void *a, const void *b)
+{
+  const struct journal_rec * const restrict ra = (const struct journal_rec *)a;
+  const struct journal_rec * const restrict rb = (const struct journal_rec *)b;
+  int cmp;
+
+  cmp = strcmp(ra->dst, rb->dst);
+  if (cmp != 0) return cmp;
+  return (ra->seq < rb->seq) ? -1 : (ra->seq > rb->seq);
+}
+
+
+static int cmp_journal_dst(const void *key, const void *rec)
+{
+  return strcmp((const char *)key, ((const struct journal_rec *)rec)->dst);
+}
+
+
+/* Read one hex field ending in a comma; returns -1 if there is none */
+static int journal_hex(const char ** const restrict p, const char * const restrict end, uint64_t * const restrict val)
+{
+  const char *q = *p;
+  uint64_t v = 0;
+
+  while (q < end && q - *p < 16) {
+    const char c = *q;
+
+    if (c >= '0' && c <= '9') v = (v << 4) | (uint64_t)(c - '0');
+    else if (c >= 'a' && c <= 'f') v = (v << 4) | (uint64_t)(c - 'a' + 10);
+    else break;
+    q++;
+  }
+  if (q == *p || q == end || *q != ',') return -1;
+  *val = v;
+  *p = q + 1;
+  return 0;
+}
+
+
+/* Load completed actions from an existing journal; returns the number
+ * of records loaded or -1 on error */
+static int64_t journal_load(const char * const restrict name)
+{
+  FILE *fp;
+  char *buf;
+  const char *p, *end;
+  long len;
+  size_t recalloc = 0;
+
+  errno = 0;
+  fp = jc_fopen(name, JC_FILE_MODE_RDONLY_SEQ);
+  if (fp == NULL) {
+    if (errno == ENOENT) return 0;
+    goto error_journal_open;
+  }
+  if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) goto error_journal_read;
+  if (len == 0) {
+    fclose(fp);
+    return 0;
+  }
+  buf = (char *)malloc((size_t)len + 1);
+  if (buf == NULL) jc_oom("journal_load()");
+  if (fread(buf, 1, (size_t)len, fp) != (size_t)len) {
+    free(buf);
+    goto error_journal_read;
+  }
+  fclose(fp);
+  buf[len] = '\0';
+  end = buf + len;
+  if ((size_t)len < sizeof(JOURNAL_HEADER) - 1 || memcmp(buf, JOURNAL_HEADER, sizeof(JOURNAL_HEADER) - 1) != 0) goto error_journal_header;
+
+  p = buf + sizeof(JOURNAL_HEADER) - 1;
+  journal_end = (long)(p - buf);
+  /* Only the last record can be incomplete, since journal_open() cuts
+   * it off before appending; stop at the first one that does not parse */
+  while (p < end) {
+    struct journal_rec *rec;
+    uint64_t size, src_mtime, dst_mtime, dst_inode, srclen, dstlen;
+
+    if (end - p < 2 || p[1] != ',') break;
+    p += 2;
+    if (journal_hex(&p, end, &size) != 0 || journal_hex(&p, end, &src_mtime) != 0
+        || journal_hex(&p, end, &dst_mtime) != 0 || journal_hex(&p, end, &dst_inode) != 0
+        || journal_hex(&p, end, &srclen) != 0 || journal_hex(&p, end, &dstlen) != 0) break;
+    if (srclen == 0 || dstlen == 0 || srclen > PATHBUF_SIZE || dstlen > PATHBUF_SIZE) break;
+    if ((uint64_t)(end - p) <= srclen + dstlen || p[srclen + dstlen] != '\n') break;
+    if (memchr(p, '\0', (size_t)(srclen + dstlen)) != NULL) break;
+
+    if (reccount == recalloc) {
+      recalloc = (recalloc == 0) ? 4096 : recalloc * 2;
+      recs = (struct journal_rec *)realloc(recs, sizeof(struct journal_rec) * recalloc);
+      if (recs == NULL) jc_oom("journal_load()");
+    }
+    rec = &recs[reccount];
+    rec->src = (char *)malloc((size_t)(srclen + dstlen + 2));
+    if (rec->src == NULL) jc_oom("journal_load() path");
+    memcpy(rec->src, p, (size_t)srclen);
+    rec->src[srclen] = '\0';
+    rec->dst = rec->src + srclen + 1;
+    memcpy(rec->dst, p + srclen, (size_t)dstlen);
+    rec->dst[dstlen] = '\0';
+    rec->size = (off_t)size;
+    rec->src_mtime = (time_t)src_mtime;
+    rec->dst_mtime = (time_t)dst_mtime;
+    rec->dst_inode = (jdupes_ino_t)dst_inode;
+    rec->seq = reccount;
+    reccount++;
+    p += srclen + dstlen + 1;
+    journal_end = (long)(p - buf);
+  }
+  free(buf);
+
+  /* Later records for the same destination replace earlier ones */
+  qsort(recs, reccount, sizeof(struct journal_rec), cmp_journal_rec);
+  return (int64_t)reccount;
+
+error_journal_open:
+  fprintf(stderr, "error: cannot open journal '%s': %s\n", name, strerror(errno));
+  return -1;
+error_journal_read:
+  fprintf(stderr, "error: cannot read journal '%s': %s\n", name, strerror(errno));
+  fclose(fp);
+  return -1;
+error_journal_header:
+  fprintf(stderr, "error: '%s' is not a jdupes journal or is from an older version\n", name);
+  free(buf);
+  return -1;
+}
+
+
+/* Open the journal for appending, loading its records first if resuming
+ * Returns the number of records loaded or -1 on error */
+int journal_open(const char * const restrict name, const int resume)
+{
+  int64_t loaded = 0;
+  long pos;
+
+  if (name == NULL) jc_nullptr("journal_open()");
+  LOUD(fprintf(stderr, "journal_open('%s', %d)\n", name, resume);)
+  if (resume) {
+    loaded = journal_load(name);
+    if (loaded < 0) return -1;
+  }
+
+  errno = 0;
+  journal = jc_fopen(name, resume ? JC_FILE_MODE_WRONLY_APPEND : JC_FILE_MODE_WRONLY);
+  if (journal == NULL) {
+    fprintf(stderr, "error: cannot open journal '%s': %s\n", name, strerror(errno));
+    return -1;
+  }
+  fseek(journal, 0, SEEK_END);
+  pos = ftell(journal);
+  /* Drop a record the last run died in the middle of */
+  if (journal_end >= 0 && pos > journal_end) {
+#ifdef ON_WINDOWS
+    if (_chsize_s(_fileno(journal), (__int64)journal_end) != 0) goto error_journal_truncate;
+#else
+    if (ftruncate(fileno(journal), (off_t)journal_end) != 0) goto error_journal_truncate;
+#endif
+    fseek(journal, 0, SEEK_END);
+  }
+  if (pos == 0) fputs(JOURNAL_HEADER, journal);
+  fflush(journal);
+  return (int)loaded;
+
+error_journal_truncate:
+  fprintf(stderr, "error: cannot truncate journal '%s': %s\n", name, strerror(errno));
+  fclose(journal);
+  journal = NULL;
+  return -1;
+}
+
+
+/* Record a completed action; the destination's metadata is read now,
+ * after the action, since linking changes it */
+void journal_add(const char action, const char * const restrict src, const char * const restrict dst)
+{
+  struct JC_STAT ss, ds;
+
+  if (journal == NULL) return;
+  if (jc_stat(src, &ss) != 0 || jc_stat(dst, &ds) != 0) return;
+  fprintf(journal, "%c,%" PRIx64 ",%" PRIx64 ",%" PRIx64 ",%" PRIx64 ",%zx,%zx,%s%s\n", action,
+      (uint64_t)ds.st_size, (uint64_t)ss.st_mtime, (uint64_t)ds.st_mtime, (uint64_t)ds.st_ino,
+      strlen(src), strlen(dst), src, dst);
+  fflush(journal);
+  return;
+}
+
+
+/* Check whether a file was the destination of an action recorded in the
+ * journal and neither it nor its source has changed since then */
+int journal_done(const file_t * const restrict file)
+{
+  struct journal_rec *rec;
+  struct JC_STAT s;
+
+  if (reccount == 0) return 0;
+  rec = (struct journal_rec *)bsearch(file->d_name, recs, reccount, sizeof(struct journal_rec), cmp_journal_dst);
+  if (rec == NULL) return 0;
+  /* Several records may share a destination; use the last one in the file */
+  while ((size_t)(rec - recs) + 1 < reccount && strcmp((rec + 1)->dst, file->d_name) == 0) rec++;
+
+  /* A replaced file has a new inode even if its size and mtime match */
+  if (file->inode != rec->dst_inode) return 0;
+  if (jc_stat(file->d_name, &s) != 0) return 0;
+  if (s.st_size != rec->size || s.st_mtime != rec->dst_mtime) return 0;
+  if (jc_stat(rec->src, &s) != 0) return 0;
+  if (s.st_size != rec->size || s.st_mtime != rec->src_mtime) return 0;
+  LOUD(fprintf(stderr, "journal_done: '%s' already handled\n", file->d_name);)
+  return 1;
+}
+
+
+void journal_close(void)
+{
+  if (journal != NULL) {
+    fflush(journal);
+#ifndef ON_WINDOWS
+    fsync(fileno(journal));
+#endif
+    fclose(journal);
+    journal = NULL;
+  }
+  for (size_t i = 0; i < reccount; i++) free(recs[i].src);
+  free(recs);
+  recs = NULL;
+  reccount = 0;
+  journal_end = -1;
+  return;
+}
+
+#endif /* NO_JOURNAL */
@@ -0,0 +1,28 @@
+/* Action progress journal for resuming interrupted runs
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_JOURNAL_H
+#define JDUPES_JOURNAL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+/* Action types recorded in the journal */
+#define JOURNAL_DEDUPE 'B'
+#define JOURNAL_HARDLINK 'L'
+#define JOURNAL_SYMLINK 'S'
+#define JOURNAL_CLONE 'C'
+
+extern int journal_open(const char * const restrict name, const int resume);
+extern void journal_add(const char action, const char * const restrict src, const char * const restrict dst);
+extern int journal_done(const file_t * const restrict file);
+extern void journal_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_JOURNAL_H */
@@ -76,13 +76,172 @@ static void cross_copy_hashes(file_t *file1, file_t *file2)
 #endif  /* NO_HARDLINKS */
 
 
-void registerpair(file_t **matchlist, file_t *newmatch, int (*comparef)(file_t *f1, file_t *f2))
+#ifndef NO_HARDLINKS
+struct hardlink_ent {
+  file_t *file;
+  size_t order;
+};
+
+static int cmp_hardlink_ent(const void *a, const void *b)
 {
-  file_t *traverse;
-  file_t *back;
+  const struct hardlink_ent *e1 = (const struct hardlink_ent *)a;
+  const struct hardlink_ent *e2 = (const struct hardlink_ent *)b;
+
+  if (e1->file->device != e2->file->device) return (e1->file->device < e2->file->device) ? -1 : 1;
+  if (e1->file->inode != e2->file->inode) return (e1->file->inode < e2->file->inode) ? -1 : 1;
+#ifndef NO_USER_ORDER
+  /* -I must still be able to keep links in the same parameter apart */
+  if (ISFLAG(flags, F_ISOLATE) && e1->file->user_order != e2->file->user_order)
+    return (e1->file->user_order < e2->file->user_order) ? -1 : 1;
+#endif
+  return (e1->order < e2->order) ? -1 : ((e1->order > e2->order) ? 1 : 0);
+}
+
+
+/* Collapse hard links to the same inode before any file data is read
+ *
+ * The first link in the file list becomes the representative that goes
+ * through hashing and matching; the others are flagged FF_HARDLINK_ALIAS,
+ * chained to it through the hardlinks pointer and skipped until
+ * expand_hardlinks() puts them into the representative's match set. */
+void collapse_hardlinks(file_t *files)
+{
+  struct hardlink_ent *list = NULL;
+  size_t cnt = 0, listsize = 0;
+  size_t i, rep;
+  file_t *tail;
+
+  LOUD(fprintf(stderr, "collapse_hardlinks(%p)\n", files));
+
+  for (; files != NULL; files = files->next) {
+    if (files->nlink < 2) continue;
+    if (cnt == listsize) {
+      listsize += 4096;
+      list = (struct hardlink_ent *)realloc(list, sizeof(struct hardlink_ent) * listsize);
+      if (list == NULL) jc_oom("collapse_hardlinks() list");
+    }
+    list[cnt].file = files;
+    list[cnt].order = cnt;
+    cnt++;
+  }
+  if (cnt < 2) goto done;
+
+  qsort(list, cnt, sizeof(struct hardlink_ent), cmp_hardlink_ent);
+
+  rep = 0;
+  tail = list[0].file;
+  for (i = 1; i < cnt; i++) {
+    file_t *cur = list[i].file;
+    file_t *rfile = list[rep].file;
 
+    if (cur->device != rfile->device || cur->inode != rfile->inode
+#ifndef NO_USER_ORDER
+        || (ISFLAG(flags, F_ISOLATE) && cur->user_order != rfile->user_order)
+#endif
+        ) {
+      rep = i;
+      tail = cur;
+      continue;
+    }
+    LOUD(fprintf(stderr, "collapse_hardlinks: '%s' is a link to '%s'\n", cur->d_name, rfile->d_name));
+    SETFLAG(cur->flags, FF_HARDLINK_ALIAS);
+    tail->hardlinks = cur;
+    tail = cur;
+    DBG(hardlink_alias++;)
+  }
+
+done:
+  free(list);
+  return;
+}
+
+
+/* Register the hard links collapsed into the members of one match set as
+ * duplicates in that set, copying the hashes of their representatives.
+ * Links of a file that matched another inode are duplicates of that file
+ * too, as they were before links were collapsed; only without -H, a set
+ * that is all one inode has its links released */
+void expand_set_hardlinks(file_t *head)
+{
+  file_t *chain, *pending = NULL, *tail = NULL, *link;
+  int one_inode = 1;
+
+  for (chain = head->duplicates; chain != NULL; chain = chain->duplicates)
+    if (chain->device != head->device || chain->inode != head->inode) one_inode = 0;
+
+  /* Detach all links from the set first; registering changes the chain */
+  for (chain = head; chain != NULL; chain = chain->duplicates) {
+    if (chain->hardlinks == NULL) continue;
+    if (tail == NULL) pending = chain->hardlinks;
+    else tail->hardlinks = chain->hardlinks;
+    for (link = chain->hardlinks; link != NULL; link = link->hardlinks) {
+      cross_copy_hashes(chain, link);
+      tail = link;
+    }
+    chain->hardlinks = NULL;
+  }
+
+  while (pending != NULL) {
+    link = pending;
+    pending = link->hardlinks;
+    link->hardlinks = NULL;
+    if (one_inode && !ISFLAG(flags, F_CONSIDERHARDLINKS)) continue;
+    registerpair(&head, link);
+    dupecount++;
+  }
+  return;
+}
+
+
+/* Handle the links of a representative that matched nothing else; with -H
+ * they form a set with it, otherwise a file's own links are not its
+ * duplicates and they are simply released */
+void expand_lone_hardlinks(file_t *head)
+{
+  file_t *pending, *link;
+
+  pending = head->hardlinks;
+  head->hardlinks = NULL;
+  while (pending != NULL) {
+    link = pending;
+    pending = link->hardlinks;
+    link->hardlinks = NULL;
+    if (!ISFLAG(flags, F_CONSIDERHARDLINKS)) continue;
+#ifndef NO_USER_ORDER
+    if (ISFLAG(flags, F_ISOLATE)) continue;
+#endif
+    cross_copy_hashes(head, link);
+    registerpair(&head, link);
+    dupecount++;
+  }
+  return;
+}
+
+
+/* Register hard links collapsed by collapse_hardlinks() as duplicates in
+ * their representative's match set, copying its hashes to them. With -H,
+ * a representative that matched nothing else forms a set with its links */
+void expand_hardlinks(file_t *files)
+{
+  file_t *cur;
+
+  LOUD(fprintf(stderr, "expand_hardlinks(%p)\n", files));
+
+  for (cur = files; cur != NULL; cur = cur->next)
+    if (ISFLAG(cur->flags, FF_HAS_DUPES)) expand_set_hardlinks(cur);
+
+  /* Whatever is left belongs to files without duplicates */
+  for (cur = files; cur != NULL; cur = cur->next)
+    if (cur->hardlinks != NULL) expand_lone_hardlinks(cur);
+  return;
+}
+#endif /* NO_HARDLINKS */
+
+
+void registerpair(file_t **matchlist, file_t *newmatch)
+{
   /* NULL pointer sanity checks */
-  if (unlikely(matchlist == NULL || newmatch == NULL || comparef == NULL)) jc_nullptr("registerpair()");
+  if (unlikely(matchlist == NULL || newmatch == NULL)) jc_nullptr("registerpair()");
   LOUD(fprintf(stderr, "registerpair: '%s', '%s'\n", (*matchlist)->d_name, newmatch->d_name);)
 
 #ifndef NO_ERRORONDUPE
@@ -94,37 +253,11 @@ void registerpair(file_t **matchlist, file_t *newmatch, int (*comparef)(file_t *
   }
 #endif
 
+  /* Sets are put in order by sort_match_sets() once matching is done, so
+   * the new match is just linked in right after the head of the set */
   SETFLAG((*matchlist)->flags, FF_HAS_DUPES);
-  back = NULL;
-  traverse = *matchlist;
-
-  /* FIXME: This needs to be changed! As it currently stands, the compare
-   * function only runs on a pair as it is registered and future pairs can
-   * mess up the sort order. A separate sorting function should happen before
-   * the dupe chain is acted upon rather than while pairs are registered. */
-  while (traverse) {
-    if (comparef(newmatch, traverse) <= 0) {
-      newmatch->duplicates = traverse;
-
-      if (!back) {
-        *matchlist = newmatch; /* update pointer to head of list */
-        SETFLAG(newmatch->flags, FF_HAS_DUPES);
-        CLEARFLAG(traverse->flags, FF_HAS_DUPES); /* flag is only for first file in dupe chain */
-      } else back->duplicates = newmatch;
-
-      break;
-    } else {
-      if (traverse->duplicates == 0) {
-        traverse->duplicates = newmatch;
-        if (!back) SETFLAG(traverse->flags, FF_HAS_DUPES);
-
-        break;
-      }
-    }
-
-    back = traverse;
-    traverse = traverse->duplicates;
-  }
+  newmatch->duplicates = (*matchlist)->duplicates;
+  (*matchlist)->duplicates = newmatch;
   return;
 }
 
@@ -217,7 +350,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
     LOUD(fprintf(stderr, "checkmatch: starting file data comparisons\n"));
     /* Attempt to exclude files quickly with partial file hashing */
     if (!ISFLAG(tree->file->flags, FF_HASH_PARTIAL)) {
-      filehash = get_filehash(tree->file, PARTIAL_HASH_SIZE, hash_algo);
+      filehash = get_filehash(tree->file, NULL, PARTIAL_HASH_SIZE, hash_algo);
       if (filehash == NULL) return NULL;
 
       tree->file->filehash_partial = *filehash;
@@ -228,7 +361,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
     }
 
     if (!ISFLAG(file->flags, FF_HASH_PARTIAL)) {
-      filehash = get_filehash(file, PARTIAL_HASH_SIZE, hash_algo);
+      filehash = get_filehash(file, NULL, PARTIAL_HASH_SIZE, hash_algo);
       if (filehash == NULL) return NULL;
 
       file->filehash_partial = *filehash;
@@ -273,7 +406,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
 //      } else {
         /* If partial match was correct, perform a full file hash match */
         if (!ISFLAG(tree->file->flags, FF_HASH_FULL)) {
-          filehash = get_filehash(tree->file, 0, hash_algo);
+          filehash = get_filehash(tree->file, ISFLAG(file->flags, FF_HASH_FULL) ? NULL : file, 0, hash_algo);
           if (filehash == NULL) return NULL;
 
           tree->file->filehash = *filehash;
@@ -284,7 +417,7 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
         }
 
         if (!ISFLAG(file->flags, FF_HASH_FULL)) {
-          filehash = get_filehash(file, 0, hash_algo);
+          filehash = get_filehash(file, NULL, 0, hash_algo);
           if (filehash == NULL) return NULL;
 
           file->filehash = *filehash;
@@ -359,6 +492,64 @@ file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file)
 }
 
 
+/* Check that a block read from one file is entirely zero bytes */
+static inline int is_zero_block(const char * const restrict block, const size_t len)
+{
+  if (len == 0) return 1;
+  return (block[0] == 0 && memcmp(block, block + 1, len - 1) == 0);
+}
+
+
+/* Compare two files with holes one data/hole region at a time
+ *
+ * Regions where both files have holes are skipped without any reads. Data
+ * facing a hole in the other file must be all zeroes. Returns 0 if the
+ * files match and 1 if they are different. */
+static int confirm_sparse(FILE * const fp1, FILE * const fp2, const off_t size, char * const restrict c1, char * const restrict c2)
+{
+  const int fd1 = fileno(fp1), fd2 = fileno(fp2);
+  off_t bytes = 0, end1 = 0, end2 = 0;
+  int hole1 = 0, hole2 = 0;
+  size_t len;
+
+  LOUD(fprintf(stderr, "confirm_sparse running\n"));
+  while (bytes < size) {
+    if (interrupt) return 1;
+    if (bytes >= end1) {
+      hole1 = sparse_region(fd1, bytes, size, &end1);
+      if (fseeko(fp1, bytes, SEEK_SET) == -1) return 1;
+    }
+    if (bytes >= end2) {
+      hole2 = sparse_region(fd2, bytes, size, &end2);
+      if (fseeko(fp2, bytes, SEEK_SET) == -1) return 1;
+    }
+
+    if (hole1 && hole2) {
+      bytes = (end1 < end2) ? end1 : end2;
+      continue;
+    }
+
+    len = auto_chunk_size;
+    if ((off_t)len > end1 - bytes) len = (size_t)(end1 - bytes);
+    if ((off_t)len > end2 - bytes) len = (size_t)(end2 - bytes);
+    if (!hole1 && fread(c1, 1, len, fp1) != len) return 1;
+    if (!hole2 && fread(c2, 1, len, fp2) != len) return 1;
+    if (hole1) {
+      if (!is_zero_block(c2, len)) return 1;
+    } else if (hole2) {
+      if (!is_zero_block(c1, len)) return 1;
+    } else if (memcmp(c1, c2, len)) return 1;
+
+    bytes += (off_t)len;
+    if (jc_alarm_ring != 0) {
+      jc_alarm_ring = 0;
+      update_phase2_progress("confirm", (int)((bytes * 100) / size));
+    }
+  }
+  return 0;
+}
+
+
 /* Do a byte-by-byte comparison in case two different files produce the
    same signature. Unlikely, but better safe than sorry. */
 int confirmmatch(const char * const restrict file1, const char * const restrict file2, const off_t size)
@@ -367,6 +558,7 @@ int confirmmatch(const char * const restrict file1, const char * const restrict
   FILE *fp1, *fp2;
   size_t r1, r2;
   off_t bytes = 0;
+  off_t ra_end1, ra_end2;
   int retval = 0;
 
   if (unlikely(file1 == NULL || file2 == NULL)) jc_nullptr("confirmmatch()");
@@ -391,21 +583,38 @@ int confirmmatch(const char * const restrict file1, const char * const restrict
     goto different;
   }
 
-  fseek(fp1, 0, SEEK_SET);
-  fseek(fp2, 0, SEEK_SET);
 #ifdef __linux__
   /* Tell Linux we will accees sequentially and soon */
   posix_fadvise(fileno(fp1), 0, size, POSIX_FADV_SEQUENTIAL);
-  posix_fadvise(fileno(fp1), 0, size, POSIX_FADV_WILLNEED);
   posix_fadvise(fileno(fp2), 0, size, POSIX_FADV_SEQUENTIAL);
-  posix_fadvise(fileno(fp2), 0, size, POSIX_FADV_WILLNEED);
 #endif /* __linux__ */
 
+  /* Files with holes are compared region by region instead of reading zeroes */
+  if (size > (off_t)auto_chunk_size) {
+    off_t end1, end2;
+    const int hole1 = sparse_region(fileno(fp1), 0, size, &end1);
+    const int hole2 = sparse_region(fileno(fp2), 0, size, &end2);
+
+    if (hole1 || hole2 || end1 < size || end2 < size) {
+      retval = confirm_sparse(fp1, fp2, size, c1, c2);
+      goto finish_confirm;
+    }
+  }
+
+  fseek(fp1, 0, SEEK_SET);
+  fseek(fp2, 0, SEEK_SET);
+  ra_end1 = readahead_window(fileno(fp1), 0, 0, size);
+  ra_end2 = readahead_window(fileno(fp2), 0, 0, size);
+
   do {
     if (interrupt) goto different;
     r1 = fread(c1, sizeof(char), auto_chunk_size, fp1);
     r2 = fread(c2, sizeof(char), auto_chunk_size, fp2);
 
+    /* Both files keep loading in the background during the compare */
+    ra_end1 = readahead_window(fileno(fp1), bytes + (off_t)r1, ra_end1, size);
+    ra_end2 = readahead_window(fileno(fp2), bytes + (off_t)r2, ra_end2, size);
+
     if (r1 != r2) goto different; /* file lengths are different */
     if (memcmp (c1, c2, r1)) goto different; /* file contents are different */
 
@@ -14,7 +14,13 @@ extern "C" {
 /* registerfile() direction options */
 enum tree_direction { NONE, LEFT, RIGHT };
 
-void registerpair(file_t **matchlist, file_t *newmatch, int (*comparef)(file_t *f1, file_t *f2));
+#ifndef NO_HARDLINKS
+void collapse_hardlinks(file_t *files);
+void expand_hardlinks(file_t *files);
+void expand_set_hardlinks(file_t *head);
+void expand_lone_hardlinks(file_t *head);
+#endif
+void registerpair(file_t **matchlist, file_t *newmatch);
 void registerfile(filetree_t * restrict * const restrict nodeptr, const enum tree_direction d, file_t * const restrict file);
 file_t **checkmatch(filetree_t * restrict tree, file_t * const restrict file);
 int confirmmatch(const char * const restrict file1, const char * const restrict file2, const off_t size);
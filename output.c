@@ -0,0 +1,292 @@
+/* Buffered standard output for match listings
+ * This file is part of jdupes; see jdupes.c for license information
+ *
+ * Listings of millions of paths go through one large buffer that is
+ * handed straight to writev() instead of making several stdio calls per
+ * file. Nothing else may print to stdout between output_begin() and
+ * output_flush(); output_begin() flushes stdio so earlier output stays in
+ * order. Windows builds keep using stdio so that jc_fwprint() can still
+ * convert paths for the console. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "output.h"
+
+#ifndef ON_WINDOWS
+ #include <unistd.h>
+ #include <sys/uio.h>
+#endif
+#ifdef __SSE2__
+ #include <emmintrin.h>
+#endif
+
+#ifndef OUTPUT_BUFSIZE
+ #ifdef LOW_MEMORY
+  #define OUTPUT_BUFSIZE 16384
+ #else
+  #define OUTPUT_BUFSIZE 1048576
+ #endif
+#endif
+
+#define TO_HEX(a) (char)(((a) & 0x0f) <= 0x09 ? ((a) & 0x0f) + 0x30 : ((a) & 0x0f) + 0x57)
+
+#ifndef ON_WINDOWS
+static char *outbuf = NULL;
+static size_t outlen = 0;
+static int outfailed = 0;
+
+
+/* Write out every buffer; like stdio, give up quietly on a real error */
+static void write_all(struct iovec *iov, int iovcnt)
+{
+  while (iovcnt > 0 && outfailed == 0) {
+    ssize_t written = writev(STDOUT_FILENO, iov, iovcnt);
+
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      outfailed = 1;
+      return;
+    }
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len) {
+      written -= (ssize_t)iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= (size_t)written;
+    }
+  }
+  return;
+}
+#endif /* ON_WINDOWS */
+
+
+void output_begin(void)
+{
+  fflush(stdout);
+#ifndef ON_WINDOWS
+  if (outbuf == NULL) {
+    outbuf = (char *)malloc(OUTPUT_BUFSIZE);
+    if (outbuf == NULL) jc_oom("output_begin()");
+  }
+#endif
+  return;
+}
+
+
+void output_flush(void)
+{
+#ifndef ON_WINDOWS
+  struct iovec iov;
+
+  if (outlen == 0) return;
+  iov.iov_base = outbuf;
+  iov.iov_len = outlen;
+  write_all(&iov, 1);
+  outlen = 0;
+#else
+  fflush(stdout);
+#endif
+  return;
+}
+
+
+void output_write(const char * const restrict data, const size_t len)
+{
+#ifndef ON_WINDOWS
+  struct iovec iov[2];
+
+  if (likely(len <= OUTPUT_BUFSIZE - outlen)) {
+    memcpy(outbuf + outlen, data, len);
+    outlen += len;
+    return;
+  }
+  /* Small pieces start a new buffer; large ones go out with the old one */
+  if (len < OUTPUT_BUFSIZE / 2) {
+    output_flush();
+    memcpy(outbuf, data, len);
+    outlen = len;
+    return;
+  }
+  iov[0].iov_base = outbuf;
+  iov[0].iov_len = outlen;
+  iov[1].iov_base = (void *)(uintptr_t)data;
+  iov[1].iov_len = len;
+  write_all(iov, 2);
+  outlen = 0;
+#else
+  fwrite(data, 1, len, stdout);
+#endif
+  return;
+}
+
+
+void output_str(const char * const restrict str)
+{
+  output_write(str, strlen(str));
+  return;
+}
+
+
+void output_char(const char c)
+{
+#ifndef ON_WINDOWS
+  if (unlikely(outlen == OUTPUT_BUFSIZE)) output_flush();
+  outbuf[outlen++] = c;
+#else
+  fputc(c, stdout);
+#endif
+  return;
+}
+
+
+void output_intmax(const intmax_t num)
+{
+  char buf[24];
+  char *p = buf + sizeof(buf);
+  uintmax_t n = (num < 0) ? -(uintmax_t)num : (uintmax_t)num;
+
+  do {
+    *--p = (char)('0' + (n % 10));
+    n /= 10;
+  } while (n != 0);
+  if (num < 0) *--p = '-';
+  output_write(p, (size_t)(buf + sizeof(buf) - p));
+  return;
+}
+
+
+/* Print a path the way jc_fwprint() does; cr: 0=nothing, 1=\n, 2=NUL */
+void output_path(const char * const restrict path, const int cr)
+{
+#ifndef ON_WINDOWS
+  output_str(path);
+  if (cr == 1) output_char('\n');
+  else if (cr == 2) output_char('\0');
+#else
+  jc_fwprint(stdout, path, cr);
+#endif
+  return;
+}
+
+
+/* Length of the leading run that JSON strings can carry unchanged: ASCII
+ * from space through DEL except for the quote and the backslash */
+static size_t json_plain_run(const unsigned char * const restrict s, const size_t len)
+{
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i bslash = _mm_set1_epi8('\\');
+
+  for (; i + 16 <= len; i += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    /* The signed compare also catches every byte with the high bit set */
+    const __m128i special = _mm_or_si128(_mm_cmplt_epi8(v, space),
+        _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)));
+    const int mask = _mm_movemask_epi8(special);
+
+    if (mask != 0) return i + (size_t)__builtin_ctz((unsigned int)mask);
+  }
+#endif
+  for (; i < len; i++) if (s[i] < 0x20 || s[i] > 0x7f || s[i] == '"' || s[i] == '\\') break;
+  return i;
+}
+
+
+/* Decode one UTF-8 sequence the same lenient way as the old escaper:
+ * continuation bytes are not checked and a lone continuation byte or an
+ * invalid lead byte is dropped. Missing bytes at the end count as zero. */
+static uint32_t json_decode_utf8(const unsigned char ** const restrict s, const unsigned char * const restrict end)
+{
+  const unsigned char *p = *s;
+  uint32_t ret;
+  int extra;
+
+  if (*p < 0x80) {
+    ret = *p;
+    extra = 0;
+  } else if ((*p & 0xe0) == 0xc0) {
+    ret = *p & 0x1f;
+    extra = 1;
+  } else if ((*p & 0xf0) == 0xe0) {
+    ret = *p & 0x0f;
+    extra = 2;
+  } else if ((*p & 0xf8) == 0xf0) {
+    ret = *p & 0x07;
+    extra = 3;
+  } else {
+    *s = p + 1;
+    return 0xffffffff;
+  }
+  p++;
+  for (; extra > 0; extra--) ret = (ret << 6) | ((p < end) ? (uint32_t)(*p++ & 0x3f) : 0);
+  *s = p;
+  return ret;
+}
+
+
+static int json_uni16(const uint16_t u16, char * const restrict out)
+{
+  out[0] = '\\';
+  out[1] = 'u';
+  out[2] = TO_HEX(u16 >> 12);
+  out[3] = TO_HEX(u16 >> 8);
+  out[4] = TO_HEX(u16 >> 4);
+  out[5] = TO_HEX(u16);
+  return 6;
+}
+
+
+/* Print a UTF-8 string escaped for a JSON string as 7-bit ASCII; runs
+ * that need no escaping are copied in one piece */
+void output_json(const char * const restrict str)
+{
+  const unsigned char *s = (const unsigned char *)str;
+  const unsigned char * const end = s + strlen(str);
+  char esc[12];
+
+  while (s < end) {
+    const size_t run = json_plain_run(s, (size_t)(end - s));
+    uint32_t curr;
+    int len;
+
+    if (run > 0) {
+      output_write((const char *)s, run);
+      s += run;
+      if (s == end) break;
+    }
+    if (*s == '"' || *s == '\\') {
+      esc[0] = '\\';
+      esc[1] = (char)*s++;
+      output_write(esc, 2);
+      continue;
+    }
+    curr = json_decode_utf8(&s, end);
+    if (curr == 0xffffffff) continue;
+    if (likely(curr < 0xffff)) {
+      /* Overlong encodings of plain ASCII come out as the plain character */
+      if (curr >= 0x20 && curr <= 0x7f) {
+        output_char((char)curr);
+        continue;
+      }
+      len = json_uni16((uint16_t)curr, esc);
+    } else {
+      curr -= 0x10000;
+      len = json_uni16((uint16_t)(0xD800 + ((curr >> 10) & 0x03ff)), esc);
+      len += json_uni16((uint16_t)(0xDC00 + (curr & 0x03ff)), esc + len);
+    }
+    output_write(esc, (size_t)len);
+  }
+  return;
+}
@@ -0,0 +1,27 @@
+/* Buffered standard output for match listings
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_OUTPUT_H
+#define JDUPES_OUTPUT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+void output_begin(void);
+void output_flush(void);
+void output_write(const char * const restrict data, const size_t len);
+void output_str(const char * const restrict str);
+void output_char(const char c);
+void output_intmax(const intmax_t num);
+void output_path(const char * const restrict path, const int cr);
+void output_json(const char * const restrict str);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_OUTPUT_H */
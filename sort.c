@@ -2,60 +2,138 @@
  * This file is part of jdupes; see jdupes.c for license information */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <libjodycode.h>
 #include "likely_unlikely.h"
 #include "jdupes.h"
+#include "sort.h"
 
-
+/* Sort keys are copied out of each file_t once per set so the comparison
+ * function doesn't chase file pointers for the common fields. Names are
+ * compared with jc_numeric_strcmp() directly; its order is libjodycode's
+ * to define, so it is not rebuilt here as a precomputed key. pos is the
+ * place in the set before sorting and breaks ties between equal keys. */
+struct sort_key {
+  file_t *file;
+  const char *name;
+  size_t pos;
+#ifndef NO_MTIME
+  time_t mtime;
+#endif
 #ifndef NO_USER_ORDER
-static int sort_pairs_by_param_order(file_t *f1, file_t *f2)
-{
-  if (!ISFLAG(flags, F_USEPARAMORDER)) return 0;
-  if (unlikely(f1 == NULL || f2 == NULL)) jc_nullptr("sort_pairs_by_param_order()");
-  if (f1->user_order < f2->user_order) return -sort_direction;
-  if (f1->user_order > f2->user_order) return sort_direction;
-  return 0;
-}
+  unsigned int user_order;
 #endif
-
+};
 
 #ifndef NO_MTIME
-int sort_pairs_by_mtime(file_t *f1, file_t *f2)
+static ordertype_t sort_ordertype = ORDER_NAME;
+#endif
+static struct sort_key *keys = NULL;
+static size_t keysize = 0;
+
+
+static int sort_keys(const void *k1, const void *k2)
 {
-  if (unlikely(f1 == NULL || f2 == NULL)) jc_nullptr("sort_pairs_by_mtime()");
+  const struct sort_key * const f1 = (const struct sort_key *)k1;
+  const struct sort_key * const f2 = (const struct sort_key *)k2;
+  int cmp;
 
 #ifndef NO_USER_ORDER
-  int po = sort_pairs_by_param_order(f1, f2);
-  if (po != 0) return po;
+  if (ISFLAG(flags, F_USEPARAMORDER)) {
+    if (f1->user_order < f2->user_order) return -sort_direction;
+    if (f1->user_order > f2->user_order) return sort_direction;
+  }
 #endif /* NO_USER_ORDER */
 
-  if (f1->mtime < f2->mtime) return -sort_direction;
-  else if (f1->mtime > f2->mtime) return sort_direction;
+#ifndef NO_MTIME
+  if (sort_ordertype == ORDER_TIME) {
+    if (f1->mtime < f2->mtime) return -sort_direction;
+    if (f1->mtime > f2->mtime) return sort_direction;
+    /* If the mtimes match, use the names to break the tie */
+  }
+#endif /* NO_MTIME */
 
 #ifndef NO_NUMSORT
-  /* If the mtimes match, use the names to break the tie */
-  return jc_numeric_strcmp(f1->d_name, f2->d_name) > 0 ? -sort_direction : -sort_direction;
+  cmp = jc_numeric_strcmp(f1->name, f2->name);
 #else
-  return strcmp(f1->d_name, f2->d_name) > 0 ? sort_direction : -sort_direction;
+  cmp = strcmp(f1->name, f2->name);
 #endif /* NO_NUMSORT */
+  if (cmp > 0) return sort_direction;
+  if (cmp < 0) return -sort_direction;
+  /* qsort() needs a consistent order, so equal keys keep their places */
+  return (f1->pos > f2->pos) - (f1->pos < f2->pos);
 }
-#endif
 
 
-int sort_pairs_by_filename(file_t *f1, file_t *f2)
+/* Sort one match set and return its new head
+ *
+ * registerpair() does not keep sets ordered as pairs arrive, so each set
+ * is sorted exactly once when it is final. The file that ends up first in
+ * the set takes over the FF_HAS_DUPES flag from the old set head. */
+file_t *sort_match_set(file_t *head, const ordertype_t ordertype)
 {
-  if (unlikely(f1 == NULL || f2 == NULL)) jc_nullptr("sort_pairs_by_filename()");
+  file_t *cur;
+  size_t cnt = 0;
+
+#ifndef NO_MTIME
+  sort_ordertype = ordertype;
+#else
+  (void)ordertype;
+#endif
 
+  for (cur = head; cur != NULL; cur = cur->duplicates) {
+    if (cnt == keysize) {
+      keysize += 4096;
+      keys = (struct sort_key *)realloc(keys, sizeof(struct sort_key) * keysize);
+      if (unlikely(keys == NULL)) jc_oom("sort_match_set() keys");
+    }
+    keys[cnt].file = cur;
+    keys[cnt].name = cur->d_name;
+    keys[cnt].pos = cnt;
+#ifndef NO_MTIME
+    keys[cnt].mtime = cur->mtime;
+#endif
 #ifndef NO_USER_ORDER
-  int po = sort_pairs_by_param_order(f1, f2);
-  if (po != 0) return po;
-#endif /* NO_USER_ORDER */
+    keys[cnt].user_order = cur->user_order;
+#endif
+    cnt++;
+  }
 
-#ifndef NO_NUMSORT
-  return jc_numeric_strcmp(f1->d_name, f2->d_name) > 0 ? sort_direction : -sort_direction;
-#else
-  return strcmp(f1->d_name, f2->d_name) > 0 ? sort_direction : -sort_direction;
-#endif /* NO_NUMSORT */
+  qsort(keys, cnt, sizeof(struct sort_key), sort_keys);
+
+  /* Relink the chain in sorted order */
+  CLEARFLAG(head->flags, FF_HAS_DUPES);
+  for (size_t i = 0; i < cnt - 1; i++) keys[i].file->duplicates = keys[i + 1].file;
+  keys[cnt - 1].file->duplicates = NULL;
+  SETFLAG(keys[0].file->flags, FF_HAS_DUPES);
+  return keys[0].file;
+}
+
+
+/* Sort every match set in one pass after matching has finished */
+void sort_match_sets(file_t *files, const ordertype_t ordertype)
+{
+  file_t **heads = NULL;
+  size_t headcnt = 0, headsize = 0;
+
+  if (unlikely(files == NULL)) return;
+  LOUD(fprintf(stderr, "sort_match_sets(%p, %d)\n", (void *)files, ordertype);)
+
+  /* Collect set heads first; sorting moves FF_HAS_DUPES down the file list */
+  for (; files != NULL; files = files->next) {
+    if (!ISFLAG(files->flags, FF_HAS_DUPES)) continue;
+    if (headcnt == headsize) {
+      headsize += 4096;
+      heads = (file_t **)realloc(heads, sizeof(file_t *) * headsize);
+      if (unlikely(heads == NULL)) jc_oom("sort_match_sets() heads");
+    }
+    heads[headcnt++] = files;
+  }
+
+  for (size_t h = 0; h < headcnt; h++) sort_match_set(heads[h], ordertype);
+
+  free(heads);
+  return;
 }
@@ -10,10 +10,8 @@ extern "C" {
 
 #include "jdupes.h"
 
-#ifndef NO_MTIME
-int sort_pairs_by_mtime(file_t *f1, file_t *f2);
-#endif
-int sort_pairs_by_filename(file_t *f1, file_t *f2);
+file_t *sort_match_set(file_t *head, const ordertype_t ordertype);
+void sort_match_sets(file_t *files, const ordertype_t ordertype);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,186 @@
+/* Print match sets while the scan is still running
+ * This file is part of jdupes; see jdupes.c for license information
+ *
+ * Duplicates always have the same size, so the match sets of one size are
+ * final once every file of that size has been through the main loop.
+ * stream_init() groups the file list by size and stream_file_done() counts
+ * each group down; when a group reaches zero, its sets get their hard
+ * links expanded, are sorted, and are printed and flushed right away. */
+
+#ifndef NO_STREAM
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libjodycode.h>
+#include "likely_unlikely.h"
+#include "jdupes.h"
+#include "match.h"
+#include "output.h"
+#include "sort.h"
+#include "stream.h"
+#include "act_printmatches.h"
+#ifndef NO_JSON
+ #include "act_printjson.h"
+#endif
+
+struct stream_member {
+  file_t *file;
+  size_t order;
+};
+
+/* All files of one size, as a range of the sorted member list */
+struct size_group {
+  off_t size;
+  size_t first;
+  size_t count;
+  size_t remaining;
+};
+
+static struct stream_member *members = NULL;
+static struct size_group *groups = NULL;
+static size_t groupcount = 0;
+static file_t **heads = NULL;
+static size_t headsize = 0;
+static ordertype_t stream_ordertype = ORDER_NAME;
+static int streamed = 0;
+
+
+static int cmp_stream_member(const void *a, const void *b)
+{
+  const struct stream_member * const restrict m1 = (const struct stream_member *)a;
+  const struct stream_member * const restrict m2 = (const struct stream_member *)b;
+
+  if (m1->file->size != m2->file->size) return (m1->file->size < m2->file->size) ? -1 : 1;
+  return (m1->order < m2->order) ? -1 : (m1->order > m2->order);
+}
+
+
+static int cmp_group_size(const void *key, const void *group)
+{
+  const off_t size = *(const off_t *)key;
+  const off_t gsize = ((const struct size_group *)group)->size;
+
+  return (size < gsize) ? -1 : (size > gsize);
+}
+
+
+static void add_head(file_t * const restrict head, size_t * const restrict cnt)
+{
+  if (*cnt == headsize) {
+    headsize += 256;
+    heads = (file_t **)realloc(heads, sizeof(file_t *) * headsize);
+    if (unlikely(heads == NULL)) jc_oom("stream add_head()");
+  }
+  heads[(*cnt)++] = head;
+  return;
+}
+
+
+/* Finish and print every match set of a completed size group */
+static void stream_group(struct size_group * const restrict group)
+{
+  size_t cnt = 0;
+  int cr = 1;
+
+  group->remaining = 0;
+  if (ISFLAG(a_flags, FA_PRINTNULL)) cr = 2;
+
+  /* Collect the set heads first; sorting moves FF_HAS_DUPES to other files */
+  for (size_t i = group->first; i < group->first + group->count; i++)
+    if (ISFLAG(members[i].file->flags, FF_HAS_DUPES)) add_head(members[i].file, &cnt);
+#ifndef NO_HARDLINKS
+  for (size_t i = 0; i < cnt; i++) expand_set_hardlinks(heads[i]);
+  /* Links left over belong to files without duplicates */
+  for (size_t i = group->first; i < group->first + group->count; i++) {
+    file_t *file = members[i].file;
+    if (file->hardlinks == NULL) continue;
+    expand_lone_hardlinks(file);
+    if (ISFLAG(file->flags, FF_HAS_DUPES)) add_head(file, &cnt);
+  }
+#endif
+  if (cnt == 0) return;
+
+  if (!ISFLAG(flags, F_HIDEPROGRESS)) fprintf(stderr, "\r%60s\r", " ");
+  output_begin();
+  for (size_t i = 0; i < cnt; i++) {
+    file_t *head = sort_match_set(heads[i], stream_ordertype);
+#ifndef NO_JSON
+    if (ISFLAG(a_flags, FA_PRINTJSON)) {
+      printjson_set(head);
+      continue;
+    }
+#endif
+    printmatchset(head, cr);
+    output_path("", cr);
+  }
+  output_flush();
+  streamed = 1;
+  return;
+}
+
+
+/* Group the file list by size before the main loop starts */
+void stream_init(file_t *files, const ordertype_t ordertype)
+{
+  size_t count = 0, memberalloc = 0;
+
+  LOUD(fprintf(stderr, "stream_init(%p)\n", (void *)files);)
+  stream_ordertype = ordertype;
+  for (; files != NULL; files = files->next) {
+    if (count == memberalloc) {
+      memberalloc = (memberalloc == 0) ? 4096 : memberalloc * 2;
+      members = (struct stream_member *)realloc(members, sizeof(struct stream_member) * memberalloc);
+      if (unlikely(members == NULL)) jc_oom("stream_init() members");
+    }
+    members[count].file = files;
+    members[count].order = count;
+    count++;
+  }
+  if (count == 0) return;
+  qsort(members, count, sizeof(struct stream_member), cmp_stream_member);
+
+  groups = (struct size_group *)malloc(sizeof(struct size_group) * count);
+  if (unlikely(groups == NULL)) jc_oom("stream_init() groups");
+  for (size_t i = 0; i < count; i++) {
+    if (groupcount > 0 && groups[groupcount - 1].size == members[i].file->size) {
+      groups[groupcount - 1].count++;
+      groups[groupcount - 1].remaining++;
+      continue;
+    }
+    groups[groupcount].size = members[i].file->size;
+    groups[groupcount].first = i;
+    groups[groupcount].count = 1;
+    groups[groupcount].remaining = 1;
+    groupcount++;
+  }
+  return;
+}
+
+
+/* Count a file as processed by the main loop */
+void stream_file_done(const file_t * const restrict file)
+{
+  struct size_group *group;
+
+  group = (struct size_group *)bsearch(&file->size, groups, groupcount, sizeof(struct size_group), cmp_group_size);
+  if (unlikely(group == NULL || group->remaining == 0)) return;
+  if (--group->remaining == 0) stream_group(group);
+  return;
+}
+
+
+/* Print whatever an aborted scan left unfinished and clean up */
+void stream_finish(void)
+{
+  LOUD(fprintf(stderr, "stream_finish()\n");)
+  for (size_t i = 0; i < groupcount; i++)
+    if (groups[i].remaining > 0) stream_group(&groups[i]);
+  if (streamed == 0 && !ISFLAG(a_flags, FA_PRINTJSON)) printf("%s", s_no_dupes);
+  free(members); free(groups); free(heads);
+  members = NULL; groups = NULL; heads = NULL;
+  groupcount = 0; headsize = 0;
+  return;
+}
+
+#endif /* NO_STREAM */
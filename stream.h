@@ -0,0 +1,25 @@
+/* Print match sets while the scan is still running
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef NO_STREAM
+
+#ifndef JDUPES_STREAM_H
+#define JDUPES_STREAM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "jdupes.h"
+
+void stream_init(file_t *files, const ordertype_t ordertype);
+void stream_file_done(const file_t * const restrict file);
+void stream_finish(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_STREAM_H */
+
+#endif /* NO_STREAM */
@@ -0,0 +1,163 @@
+/* Minimal io_uring interface for batched file operations
+ * This file is part of jdupes; see jdupes.c for license information
+ *
+ * Only what the action pool needs: one ring per thread, no SQPOLL, and
+ * submission of whole batches followed by reaping every completion.
+ * Setup fails (and callers fall back to plain syscalls) if the kernel
+ * lacks io_uring, forbids it, or lacks any of the metadata opcodes. */
+
+#include "uring.h"
+
+#ifdef ENABLE_IO_URING
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <libjodycode.h>
+#include "jdupes.h"
+
+/* The opcodes the action pool submits */
+static const unsigned char needed_ops[] = {
+  IORING_OP_LINKAT, IORING_OP_SYMLINKAT, IORING_OP_RENAMEAT, IORING_OP_UNLINKAT
+};
+
+
+/* Check that the kernel supports every opcode we submit */
+static int uring_probe(const int fd)
+{
+  struct io_uring_probe *probe;
+  const size_t len = sizeof(struct io_uring_probe) + sizeof(struct io_uring_probe_op) * 256;
+  int ok = 1;
+
+  probe = (struct io_uring_probe *)calloc(1, len);
+  if (probe == NULL) jc_oom("uring_probe()");
+  if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) ok = 0;
+  for (size_t i = 0; ok && i < sizeof(needed_ops); i++) {
+    if (needed_ops[i] > probe->last_op || !(probe->ops[needed_ops[i]].flags & IO_URING_OP_SUPPORTED)) ok = 0;
+  }
+  free(probe);
+  return ok;
+}
+
+
+/* Set up a ring; returns 0 on success or -1 if io_uring can't be used */
+int uring_init(struct uring * const restrict ring, const unsigned int entries)
+{
+  struct io_uring_params p;
+
+  memset(ring, 0, sizeof(struct uring));
+  memset(&p, 0, sizeof(struct io_uring_params));
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+  if (ring->fd < 0) {
+    ring->fd = -1;
+    return -1;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !uring_probe(ring->fd)) goto error_uring;
+
+  ring->sq_entries = p.sq_entries;
+  ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) goto error_uring;
+  /* Both rings share one mapping with IORING_FEAT_SINGLE_MMAP */
+  ring->cq_ring = ring->sq_ring;
+  ring->sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    goto error_uring;
+  }
+
+  ring->sq_khead = (unsigned int *)((char *)ring->sq_ring + p.sq_off.head);
+  ring->sq_ktail = (unsigned int *)((char *)ring->sq_ring + p.sq_off.tail);
+  ring->sq_kmask = (unsigned int *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)((char *)ring->sq_ring + p.sq_off.array);
+  ring->cq_khead = (unsigned int *)((char *)ring->cq_ring + p.cq_off.head);
+  ring->cq_ktail = (unsigned int *)((char *)ring->cq_ring + p.cq_off.tail);
+  ring->cq_kmask = (unsigned int *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+  ring->sq_tail = ring->sq_published = *ring->sq_ktail;
+  return 0;
+
+error_uring:
+  close(ring->fd);
+  ring->fd = -1;
+  return -1;
+}
+
+
+void uring_exit(struct uring * const restrict ring)
+{
+  if (ring->fd == -1) return;
+  munmap(ring->sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+  ring->fd = -1;
+  return;
+}
+
+
+/* Number of free submission queue entries */
+unsigned int uring_sq_space(const struct uring * const restrict ring)
+{
+  return ring->sq_entries - (ring->sq_tail - __atomic_load_n(ring->sq_khead, __ATOMIC_ACQUIRE));
+}
+
+
+/* Get a zeroed submission queue entry or NULL if the queue is full */
+struct io_uring_sqe *uring_get_sqe(struct uring * const restrict ring)
+{
+  struct io_uring_sqe *sqe;
+  unsigned int idx;
+
+  if (uring_sq_space(ring) == 0) return NULL;
+  idx = ring->sq_tail & *ring->sq_kmask;
+  ring->sq_array[idx] = idx;
+  ring->sq_tail++;
+  sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  return sqe;
+}
+
+
+/* Submit all queued entries and wait for at least wait_nr completions
+ * Returns 0 on success or -errno */
+int uring_submit_and_wait(struct uring * const restrict ring, const unsigned int wait_nr)
+{
+  unsigned int to_submit;
+  long ret;
+
+  __atomic_store_n(ring->sq_ktail, ring->sq_tail, __ATOMIC_RELEASE);
+  to_submit = ring->sq_tail - ring->sq_published;
+  ring->sq_published = ring->sq_tail;
+  do {
+    ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+        (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret > 0) to_submit -= (unsigned int)ret;
+  } while ((ret < 0 && errno == EINTR) || (ret > 0 && to_submit > 0));
+  return (ret < 0) ? -errno : 0;
+}
+
+
+/* Get the next completion or NULL if none is ready */
+struct io_uring_cqe *uring_peek_cqe(struct uring * const restrict ring)
+{
+  const unsigned int head = *ring->cq_khead;
+
+  if (head == __atomic_load_n(ring->cq_ktail, __ATOMIC_ACQUIRE)) return NULL;
+  return &ring->cqes[head & *ring->cq_kmask];
+}
+
+
+void uring_cqe_seen(struct uring * const restrict ring)
+{
+  __atomic_store_n(ring->cq_khead, *ring->cq_khead + 1, __ATOMIC_RELEASE);
+  return;
+}
+
+#endif /* ENABLE_IO_URING */
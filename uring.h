@@ -0,0 +1,54 @@
+/* Minimal io_uring interface for batched file operations
+ * This file is part of jdupes; see jdupes.c for license information */
+
+#ifndef JDUPES_URING_H
+#define JDUPES_URING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The metadata opcodes (LINKAT etc.) first appeared in Linux 5.15 */
+#if defined __linux__ && !defined NO_IO_URING
+ #include <linux/version.h>
+ #if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+  #define ENABLE_IO_URING 1
+ #endif
+#endif
+
+#ifdef ENABLE_IO_URING
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/* Submission queue entries per ring */
+ #ifndef URING_ENTRIES
+  #define URING_ENTRIES 4096
+ #endif
+
+struct uring {
+  int fd;
+  unsigned int sq_entries;
+  unsigned int sq_tail;       /* local tail, published on submit */
+  unsigned int sq_published;
+  unsigned int *sq_khead, *sq_ktail, *sq_kmask, *sq_array;
+  unsigned int *cq_khead, *cq_ktail, *cq_kmask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+};
+
+extern int uring_init(struct uring * const restrict ring, const unsigned int entries);
+extern void uring_exit(struct uring * const restrict ring);
+extern unsigned int uring_sq_space(const struct uring * const restrict ring);
+extern struct io_uring_sqe *uring_get_sqe(struct uring * const restrict ring);
+extern int uring_submit_and_wait(struct uring * const restrict ring, const unsigned int wait_nr);
+extern struct io_uring_cqe *uring_peek_cqe(struct uring * const restrict ring);
+extern void uring_cqe_seen(struct uring * const restrict ring);
+#endif /* ENABLE_IO_URING */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JDUPES_URING_H */